@@ -0,0 +1,1188 @@
+/*
+ * history.cc
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#include "history.hh"
+#include "util/file.hh"
+#include "util/getenv.hh"
+#include "util/histogram.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <functional>
+#include <regex>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace history {
+
+namespace {
+
+constexpr char     segment_magic[8] = { 'I', 'C', 'E', 'T', 'O', 'P', 'H', '1' };
+constexpr uint32_t segment_capacity = 256 * 1024;
+constexpr size_t   batch_rows = 1024;
+constexpr size_t   max_queued_batches = 64;
+
+struct segment_header {
+    char     magic[8];
+    uint32_t capacity;
+    uint32_t rows;
+    uint8_t  reserved[48];
+};
+
+static_assert(sizeof(segment_header) == 64, "unexpected segment header size");
+
+enum column {
+    START_MSEC,
+    END_MSEC,
+    CLIENT,
+    SERVER,
+    FILE_ID,
+    REAL_MSEC,
+    USER_MSEC,
+    SYS_MSEC,
+    PAGE_FAULTS,
+    EXIT_CODE,
+    N_COLUMNS,
+};
+
+constexpr size_t column_width[N_COLUMNS] = { 8, 8, 4, 4, 4, 4, 4, 4, 4, 4 };
+
+size_t column_offset(unsigned c, uint32_t capacity)
+{
+    size_t offset = sizeof(segment_header);
+    for (unsigned i = 0; i < c; i++)
+        offset += column_width[i] * capacity;
+    return offset;
+}
+
+std::string segment_path(const std::string& directory, uint32_t number)
+{
+    char name[24];
+    snprintf(name, sizeof(name), "/%08u.seg", number);
+    return directory + name;
+}
+
+std::vector<uint32_t> list_segments(const std::string& directory)
+{
+    std::vector<uint32_t> numbers;
+    if (DIR* dir = opendir(directory.c_str())) {
+        while (struct dirent* entry = readdir(dir)) {
+            unsigned number;
+            char suffix[8];
+            if (sscanf(entry->d_name, "%8u.%3s", &number, suffix) == 2 && strcmp(suffix, "seg") == 0)
+                numbers.push_back(number);
+        }
+        closedir(dir);
+    }
+    std::sort(numbers.begin(), numbers.end());
+    return numbers;
+}
+
+uint64_t wall_clock_msec()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+
+std::string default_directory()
+{
+    if (auto data_home = util::getenv("XDG_DATA_HOME"))
+        return data_home.value() + "/icetop/history";
+    if (auto home = util::getenv("HOME"))
+        return home.value() + "/.local/share/icetop/history";
+    return "icetop-history";
+}
+
+
+struct writer::batch {
+    std::vector<std::string> strings;  // New dictionary entries, in order.
+    std::vector<uint64_t>    start_msec;
+    std::vector<uint64_t>    end_msec;
+    std::vector<uint32_t>    client;
+    std::vector<uint32_t>    server;
+    std::vector<uint32_t>    file;
+    std::vector<uint32_t>    real_msec;
+    std::vector<uint32_t>    user_msec;
+    std::vector<uint32_t>    sys_msec;
+    std::vector<uint32_t>    page_faults;
+    std::vector<int32_t>     exit_code;
+
+    size_t size() const { return start_msec.size(); }
+
+    const void* data(unsigned c) const {
+        switch (c) {
+            case START_MSEC:  return start_msec.data();
+            case END_MSEC:    return end_msec.data();
+            case CLIENT:      return client.data();
+            case SERVER:      return server.data();
+            case FILE_ID:     return file.data();
+            case REAL_MSEC:   return real_msec.data();
+            case USER_MSEC:   return user_msec.data();
+            case SYS_MSEC:    return sys_msec.data();
+            case PAGE_FAULTS: return page_faults.data();
+            case EXIT_CODE:   return exit_code.data();
+        }
+        return nullptr;
+    }
+};
+
+
+writer::writer(const std::string& directory, int strings_fd)
+    : m_directory(directory)
+    , m_strings_fd(strings_fd)
+    , m_pending(new batch)
+    , m_stopping(false)
+    , m_segment_fd(-1)
+    , m_segment(0)
+    , m_segment_rows(0)
+    , m_strings_size(0)
+    , m_strings_broken(false)
+    , m_written(0)
+    , m_dropped(0)
+{
+}
+
+std::unique_ptr<writer> writer::open(const std::string& directory, bool& busy)
+{
+    busy = false;
+    if (!util::make_directories(directory)) {
+        perror(directory.c_str());
+        return nullptr;
+    }
+
+    auto path = directory + "/strings";
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path.c_str());
+        return nullptr;
+    }
+    // Two writers would each number new strings on their own, and append
+    // rows to the same segment. The lock goes away with the descriptor.
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK)
+            busy = true;
+        else
+            perror(path.c_str());
+        close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<writer> w(new writer(directory, fd));
+    if (!w->load_strings()) {
+        perror(path.c_str());
+        return nullptr;
+    }
+
+    auto segments = list_segments(directory);
+    auto number = segments.empty() ? 0 : segments.back();
+    if (!w->open_segment(number)) {
+        perror(segment_path(directory, number).c_str());
+        return nullptr;
+    }
+
+    w->m_thread = std::thread(&writer::run, w.get());
+    return w;
+}
+
+writer::~writer()
+{
+    if (m_thread.joinable()) {
+        flush();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wakeup.notify_one();
+        m_thread.join();
+    }
+    if (m_segment_fd >= 0)
+        close(m_segment_fd);
+    close(m_strings_fd);
+}
+
+bool writer::load_strings()
+{
+    std::string contents;
+    char buffer[64 * 1024];
+    ssize_t n;
+    off_t offset = 0;
+    while ((n = pread(m_strings_fd, buffer, sizeof(buffer), offset)) > 0) {
+        contents.append(buffer, n);
+        offset += n;
+    }
+    if (n < 0)
+        return false;
+    m_strings_size = offset;
+
+    size_t start = 0, end;
+    while ((end = contents.find('\n', start)) != std::string::npos) {
+        m_strings.intern(contents.substr(start, end - start));
+        start = end + 1;
+    }
+    return true;
+}
+
+uint32_t writer::string_id(const std::string& s)
+{
+    if (s.empty())
+        return 0;
+
+    std::string line(s);
+    std::replace(line.begin(), line.end(), '\n', '?');
+    auto id = m_strings.find(line);
+    if (!id) {
+        id = m_strings.intern(line);
+        m_pending->strings.push_back(line);
+    }
+    return id;
+}
+
+void writer::append(const record& r)
+{
+    auto& b = *m_pending;
+    b.start_msec.push_back(r.start_msec);
+    b.end_msec.push_back(r.end_msec);
+    b.client.push_back(string_id(r.client));
+    b.server.push_back(string_id(r.server));
+    b.file.push_back(string_id(r.file));
+    b.real_msec.push_back(r.real_msec);
+    b.user_msec.push_back(r.user_msec);
+    b.sys_msec.push_back(r.sys_msec);
+    b.page_faults.push_back(r.page_faults);
+    b.exit_code.push_back(r.exit_code);
+
+    if (b.size() >= batch_rows)
+        flush();
+}
+
+void writer::flush()
+{
+    if (m_pending->size() == 0 && m_pending->strings.empty())
+        return;
+
+    std::unique_ptr<batch> next(new batch);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queue.size() >= max_queued_batches) {
+            // The disk is not keeping up: drop the rows, but keep the new
+            // strings, as rows written later may refer to them.
+            m_dropped += m_pending->size();
+            next->strings = std::move(m_pending->strings);
+        } else {
+            m_queue.emplace_back(std::move(m_pending));
+        }
+    }
+    m_pending = std::move(next);
+    m_wakeup.notify_one();
+}
+
+void writer::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_wakeup.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+        if (m_queue.empty())
+            break;  // Stopping, and nothing left to write.
+        auto b = std::move(m_queue.front());
+        m_queue.pop_front();
+        lock.unlock();
+        write_batch(*b);
+        lock.lock();
+    }
+}
+
+bool writer::open_segment(uint32_t number)
+{
+    if (m_segment_fd >= 0) {
+        close(m_segment_fd);
+        m_segment_fd = -1;
+    }
+
+    auto path = segment_path(m_directory, number);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    segment_header header;
+    auto n = pread(fd, &header, sizeof(header), 0);
+    if (n == 0) {
+        // New segment: the file is sparse until rows are written.
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, segment_magic, sizeof(segment_magic));
+        header.capacity = segment_capacity;
+        header.rows = 0;
+        if (ftruncate(fd, column_offset(N_COLUMNS, segment_capacity)) != 0
+            || !util::write_fully(fd, &header, sizeof(header), 0)) {
+            close(fd);
+            return false;
+        }
+    } else if (n != sizeof(header)
+               || memcmp(header.magic, segment_magic, sizeof(segment_magic)) != 0
+               || header.capacity != segment_capacity) {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    m_segment_fd = fd;
+    m_segment = number;
+    m_segment_rows = header.rows;
+    if (m_segment_rows >= segment_capacity)
+        return open_segment(number + 1);
+    return true;
+}
+
+void writer::write_batch(batch& b)
+{
+    // Strings go first, so rows never refer to unknown identifiers. Their
+    // identifiers were handed out already, so those which cannot be written
+    // are tried again with the next batch; until then, rows are dropped.
+    m_unwritten.insert(m_unwritten.end(), b.strings.begin(), b.strings.end());
+    if (m_strings_broken) {
+        m_unwritten.clear();
+        m_dropped += b.size();
+        return;
+    }
+    if (!m_unwritten.empty()) {
+        std::string lines;
+        for (auto& s: m_unwritten) {
+            lines += s;
+            lines += '\n';
+        }
+        if (!util::write_fully(m_strings_fd, lines.data(), lines.size(), -1)) {
+            // A partial line would shift the identifiers of all the next
+            // ones; if it cannot be undone, stop recording altogether.
+            if (ftruncate(m_strings_fd, m_strings_size) != 0)
+                m_strings_broken = true;
+            m_dropped += b.size();
+            return;
+        }
+        m_strings_size += lines.size();
+        m_unwritten.clear();
+    }
+
+    size_t index = 0;
+    while (index < b.size()) {
+        if (m_segment_fd < 0
+            || (m_segment_rows >= segment_capacity && !open_segment(m_segment + 1))) {
+            m_dropped += b.size() - index;
+            return;
+        }
+
+        size_t count = std::min<size_t>(b.size() - index, segment_capacity - m_segment_rows);
+        for (unsigned c = 0; c < N_COLUMNS; c++) {
+            auto width = column_width[c];
+            auto data = static_cast<const char*>(b.data(c)) + index * width;
+            auto offset = column_offset(c, segment_capacity) + m_segment_rows * width;
+            if (!util::write_fully(m_segment_fd, data, count * width, offset)) {
+                m_dropped += b.size() - index;
+                return;
+            }
+        }
+
+        // Readers only look at rows covered by the header.
+        m_segment_rows += count;
+        if (!util::write_fully(m_segment_fd, &m_segment_rows, sizeof(m_segment_rows),
+                         offsetof(segment_header, rows))) {
+            m_dropped += b.size() - index;
+            return;
+        }
+        m_written += count;
+        index += count;
+    }
+}
+
+
+namespace {
+
+struct mapped_segment {
+    const char* base;
+    size_t      length;
+    uint32_t    rows;
+    uint32_t    capacity;
+
+    template <typename T>
+    const T* column(unsigned c) const {
+        return reinterpret_cast<const T*>(base + column_offset(c, capacity));
+    }
+};
+
+bool map_segment(const std::string& path, mapped_segment& segment)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    segment_header header;
+    bool ok = fstat(fd, &st) == 0
+        && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header.magic, segment_magic, sizeof(segment_magic)) == 0
+        && header.rows <= header.capacity
+        && static_cast<size_t>(st.st_size) >= column_offset(N_COLUMNS, header.capacity);
+    if (!ok) {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    auto length = column_offset(N_COLUMNS, header.capacity);
+    void* base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    segment = { static_cast<const char*>(base), length, header.rows, header.capacity };
+    return true;
+}
+
+// Segments which cannot be mapped are reported, and left out.
+std::vector<mapped_segment> map_segments(const std::string& directory)
+{
+    std::vector<mapped_segment> segments;
+    for (auto number: list_segments(directory)) {
+        mapped_segment segment;
+        auto path = segment_path(directory, number);
+        if (map_segment(path, segment)) {
+            segments.push_back(segment);
+        } else {
+            perror(path.c_str());
+        }
+    }
+    return segments;
+}
+
+void unmap_segments(std::vector<mapped_segment>& segments)
+{
+    for (auto& segment: segments)
+        munmap(const_cast<char*>(segment.base), segment.length);
+    segments.clear();
+}
+
+// Threads to run "tasks" independent pieces of work with.
+unsigned worker_threads(size_t tasks)
+{
+    return std::max(1u, std::min<unsigned>(std::thread::hardware_concurrency(), tasks));
+}
+
+enum group_by { BY_NONE, BY_CLIENT, BY_SERVER, BY_FILE, BY_HOUR, BY_DAY };
+enum sort_by { SORT_KEY, SORT_COUNT, SORT_FAILED, SORT_TOTAL, SORT_MEAN, SORT_MAX };
+
+struct query_plan {
+    uint64_t          since_msec  = 0;
+    uint64_t          until_msec  = UINT64_MAX;
+    bool              only_failed = false;
+    bool              only_local  = false;
+    bool              only_remote = false;
+    group_by          by          = BY_NONE;
+    sort_by           sort        = SORT_TOTAL;
+    size_t            top         = 20;
+
+    // Indexed by string identifier, empty when not filtering.
+    std::vector<char> client_ok;
+    std::vector<char> server_ok;
+    std::vector<char> file_ok;
+};
+
+struct aggregate {
+    uint64_t count      = 0;
+    uint64_t failed     = 0;
+    uint64_t total_msec = 0;
+    uint64_t max_msec   = 0;
+
+    void merge(const aggregate& other) {
+        count += other.count;
+        failed += other.failed;
+        total_msec += other.total_msec;
+        max_msec = std::max(max_msec, other.max_msec);
+    }
+};
+
+using partial_result = std::unordered_map<uint64_t, aggregate>;
+
+inline bool allowed(const std::vector<char>& ok, uint32_t id)
+{
+    return ok.empty() || (id < ok.size() && ok[id]);
+}
+
+void scan_segment(const mapped_segment& segment, const query_plan& plan, partial_result& result)
+{
+    auto start  = segment.column<uint64_t>(START_MSEC);
+    auto end    = segment.column<uint64_t>(END_MSEC);
+    auto client = segment.column<uint32_t>(CLIENT);
+    auto server = segment.column<uint32_t>(SERVER);
+    auto file   = segment.column<uint32_t>(FILE_ID);
+    auto real   = segment.column<uint32_t>(REAL_MSEC);
+    auto exit   = segment.column<int32_t>(EXIT_CODE);
+
+    for (uint32_t i = 0; i < segment.rows; i++) {
+        if (start[i] < plan.since_msec || start[i] >= plan.until_msec)
+            continue;
+        if ((plan.only_failed && exit[i] == 0)
+            || (plan.only_local && server[i] != 0)
+            || (plan.only_remote && server[i] == 0))
+            continue;
+        if (!allowed(plan.client_ok, client[i])
+            || !allowed(plan.server_ok, server[i])
+            || !allowed(plan.file_ok, file[i]))
+            continue;
+
+        uint64_t key = 0;
+        switch (plan.by) {
+            case BY_NONE:   break;
+            case BY_CLIENT: key = client[i]; break;
+            case BY_SERVER: key = server[i]; break;
+            case BY_FILE:   key = file[i]; break;
+            case BY_HOUR:   key = start[i] / (3600 * 1000); break;
+            case BY_DAY:    key = start[i] / (24 * 3600 * 1000); break;
+        }
+
+        // The scheduler does not report timings for local jobs.
+        uint64_t duration = server[i] ? real[i] : end[i] - start[i];
+        auto& a = result[key];
+        a.count++;
+        a.failed += (exit[i] != 0);
+        a.total_msec += duration;
+        a.max_msec = std::max(a.max_msec, duration);
+    }
+}
+
+std::vector<std::string> load_strings(const std::string& directory)
+{
+    std::vector<std::string> strings(1);
+    if (FILE* input = fopen((directory + "/strings").c_str(), "r")) {
+        char* line = nullptr;
+        size_t size = 0;
+        ssize_t n;
+        while ((n = getline(&line, &size, input)) > 0) {
+            if (line[n - 1] == '\n') line[--n] = '\0';
+            strings.emplace_back(line, n);
+        }
+        free(line);
+        fclose(input);
+    }
+    return strings;
+}
+
+// Relative ("90m", "12h", "7d", "2w") or absolute ("2016-05-31 18:00").
+bool parse_time(const std::string& value, uint64_t& msec)
+{
+    char* end;
+    auto amount = strtoull(value.c_str(), &end, 10);
+    if (end != value.c_str() && *end && !end[1]) {
+        uint64_t unit;
+        switch (*end) {
+            case 's': unit = 1; break;
+            case 'm': unit = 60; break;
+            case 'h': unit = 3600; break;
+            case 'd': unit = 24 * 3600; break;
+            case 'w': unit = 7 * 24 * 3600; break;
+            default: return false;
+        }
+        msec = wall_clock_msec() - amount * unit * 1000;
+        return true;
+    }
+
+    for (auto format: { "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d" }) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        auto rest = strptime(value.c_str(), format, &tm);
+        if (rest && !*rest) {
+            tm.tm_isdst = -1;
+            msec = static_cast<uint64_t>(mktime(&tm)) * 1000;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<char> match_strings(const std::vector<std::string>& strings,
+                                std::function<bool(const std::string&)> predicate)
+{
+    std::vector<char> ok(strings.size(), 0);
+    for (size_t id = 1; id < strings.size(); id++)
+        ok[id] = predicate(strings[id]);
+    return ok;
+}
+
+void print_query_usage()
+{
+    fprintf(stderr,
+            "Query terms:\n"
+            "  since=TIME, until=TIME  Relative (90m, 12h, 7d, 2w) or absolute\n"
+            "                          (YYYY-MM-DD [HH:MM]) start time limits.\n"
+            "  client=GLOB, server=GLOB\n"
+            "                          Only jobs from/to matching host names.\n"
+            "  file=REGEX              Only jobs whose file name matches.\n"
+            "  failed, local, remote   Only jobs which failed, ran locally, or\n"
+            "                          ran remotely.\n"
+            "  by=FIELD                Group by none, client, server, file,\n"
+            "                          hour or day (default: none).\n"
+            "  sort=FIELD              Order by key, count, failed, total,\n"
+            "                          mean or max (default: total).\n"
+            "  top=N                   Show at most N groups (default: 20, 0\n"
+            "                          shows all of them).\n");
+}
+
+bool parse_term(const std::string& term, const std::vector<std::string>& strings, query_plan& plan)
+{
+    auto eq = term.find('=');
+    auto key = term.substr(0, eq);
+    auto value = (eq == std::string::npos) ? std::string() : term.substr(eq + 1);
+
+    if (key == "failed") plan.only_failed = true;
+    else if (key == "local") plan.only_local = true;
+    else if (key == "remote") plan.only_remote = true;
+    else if (eq == std::string::npos) return false;
+    else if (key == "since") return parse_time(value, plan.since_msec);
+    else if (key == "until") return parse_time(value, plan.until_msec);
+    else if (key == "top") plan.top = strtoul(value.c_str(), nullptr, 10);
+    else if (key == "client" || key == "server") {
+        auto ok = match_strings(strings, [&value](const std::string& s) {
+            return fnmatch(value.c_str(), s.c_str(), FNM_CASEFOLD) == 0;
+        });
+        (key == "client" ? plan.client_ok : plan.server_ok) = std::move(ok);
+    } else if (key == "file") {
+        std::regex re;
+        try {
+            re = std::regex(value, std::regex::ECMAScript | std::regex::optimize);
+        } catch (const std::regex_error& e) {
+            fprintf(stderr, "Invalid regular expression '%s': %s\n", value.c_str(), e.what());
+            return false;
+        }
+        plan.file_ok = match_strings(strings, [&re](const std::string& s) {
+            return std::regex_search(s, re);
+        });
+    } else if (key == "by") {
+        static const std::pair<const char*, group_by> names[] = {
+            { "none", BY_NONE }, { "client", BY_CLIENT }, { "server", BY_SERVER },
+            { "file", BY_FILE }, { "hour", BY_HOUR }, { "day", BY_DAY },
+        };
+        auto item = std::find_if(std::begin(names), std::end(names), [&value](const std::pair<const char*, group_by>& n) {
+            return value == n.first;
+        });
+        if (item == std::end(names)) return false;
+        plan.by = item->second;
+    } else if (key == "sort") {
+        static const std::pair<const char*, sort_by> names[] = {
+            { "key", SORT_KEY }, { "count", SORT_COUNT }, { "failed", SORT_FAILED },
+            { "total", SORT_TOTAL }, { "mean", SORT_MEAN }, { "max", SORT_MAX },
+        };
+        auto item = std::find_if(std::begin(names), std::end(names), [&value](const std::pair<const char*, sort_by>& n) {
+            return value == n.first;
+        });
+        if (item == std::end(names)) return false;
+        plan.sort = item->second;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string key_name(group_by by, uint64_t key, const std::vector<std::string>& strings)
+{
+    char buffer[32];
+    time_t t;
+    switch (by) {
+        case BY_NONE:
+            return "all jobs";
+        case BY_CLIENT:
+        case BY_SERVER:
+        case BY_FILE:
+            if (key == 0) return (by == BY_SERVER) ? "(local)" : "(unknown)";
+            return (key < strings.size()) ? strings[key] : "#" + std::to_string(key);
+        case BY_HOUR:
+            t = key * 3600;
+            strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:00", localtime(&t));
+            return buffer;
+        case BY_DAY:
+            t = key * 24 * 3600;
+            strftime(buffer, sizeof(buffer), "%Y-%m-%d", localtime(&t));
+            return buffer;
+    }
+    return std::string();
+}
+
+
+/*
+ * Capacity planning: remote jobs are replayed, in order of submission, on
+ * the slots of the platform of the server which ran them. Each platform is
+ * a queue of its own, served first come first served by whichever slot is
+ * free first, like the scheduler does when it has no better choice.
+ */
+struct sim_job {
+    uint64_t submit_msec;
+    uint32_t real_msec;
+};
+
+struct sim_platform {
+    std::string          name;
+    unsigned             hosts = 0;
+    unsigned             slots = 0;
+    std::vector<sim_job> jobs;
+};
+
+struct sim_change {
+    std::string platform;
+    int         hosts;
+    unsigned    slots;    // Per host; zero for the mean of the platform.
+};
+
+struct sim_plan {
+    uint64_t                since_msec = 0;
+    uint64_t                until_msec = UINT64_MAX;
+    std::vector<double>     scales { 0.5, 0.75, 1, 1.25, 1.5, 2 };
+    std::vector<sim_change> changes;
+};
+
+struct sim_scan {
+    std::vector<std::vector<sim_job>> jobs;      // Per platform.
+    util::log_histogram               recorded;  // Time outside compilation.
+    uint64_t                          unknown = 0;
+};
+
+struct sim_result {
+    util::log_histogram waits;
+    uint64_t            busy_msec = 0;
+    uint64_t            first_msec = UINT64_MAX;
+    uint64_t            last_msec = 0;
+};
+
+void print_simulate_usage()
+{
+    fprintf(stderr,
+            "Simulation terms:\n"
+            "  since=TIME, until=TIME  Relative (90m, 12h, 7d, 2w) or absolute\n"
+            "                          (YYYY-MM-DD [HH:MM]) start time limits.\n"
+            "  scale=LIST              Comma-separated factors for the number of\n"
+            "                          hosts (default: 0.5,0.75,1,1.25,1.5,2).\n"
+            "  add=PLATFORM:N[:SLOTS]  Add N hosts (remove, if negative) with\n"
+            "                          SLOTS slots each (default: the mean of\n"
+            "                          the platform) after scaling.\n");
+}
+
+bool parse_simulate_term(const std::string& term, const std::vector<sim_platform>& platforms,
+                         sim_plan& plan)
+{
+    auto eq = term.find('=');
+    if (eq == std::string::npos)
+        return false;
+    auto key = term.substr(0, eq);
+    auto value = term.substr(eq + 1);
+
+    if (key == "since") return parse_time(value, plan.since_msec);
+    else if (key == "until") return parse_time(value, plan.until_msec);
+    else if (key == "scale") {
+        plan.scales.clear();
+        const char* p = value.c_str();
+        while (*p) {
+            char* end;
+            double scale = strtod(p, &end);
+            if (end == p || scale < 0 || (*end && *end != ','))
+                return false;
+            plan.scales.push_back(scale);
+            p = *end ? end + 1 : end;
+        }
+        return !plan.scales.empty();
+    } else if (key == "add") {
+        auto colon = value.find(':');
+        if (colon == std::string::npos)
+            return false;
+        sim_change change { value.substr(0, colon), 0, 0 };
+        char* end;
+        change.hosts = strtol(value.c_str() + colon + 1, &end, 10);
+        if (*end == ':')
+            change.slots = strtoul(end + 1, &end, 10);
+        if (*end)
+            return false;
+        auto known = std::any_of(platforms.begin(), platforms.end(), [&change](const sim_platform& p) {
+            return p.name == change.platform;
+        });
+        if (!known) {
+            fprintf(stderr, "No hosts of platform '%s' in the farm\n", change.platform.c_str());
+            return false;
+        }
+        plan.changes.push_back(change);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void scan_remote_jobs(const mapped_segment& segment, const sim_plan& plan,
+                      const std::vector<int>& server_platform, sim_scan& result)
+{
+    auto start  = segment.column<uint64_t>(START_MSEC);
+    auto end    = segment.column<uint64_t>(END_MSEC);
+    auto server = segment.column<uint32_t>(SERVER);
+    auto real   = segment.column<uint32_t>(REAL_MSEC);
+
+    for (uint32_t i = 0; i < segment.rows; i++) {
+        if (!server[i] || start[i] < plan.since_msec || start[i] >= plan.until_msec)
+            continue;
+        int platform = (server[i] < server_platform.size()) ? server_platform[server[i]] : -1;
+        if (platform < 0) {
+            result.unknown++;
+            continue;
+        }
+        result.jobs[platform].push_back({ start[i], real[i] });
+        auto elapsed = end[i] - start[i];
+        result.recorded.add(elapsed > real[i] ? elapsed - real[i] : 0);
+    }
+}
+
+// Slots of a platform once scaled and changed; at least one, if it has jobs.
+unsigned scenario_slots(const sim_platform& platform, double scale, const sim_plan& plan,
+                        unsigned& hosts)
+{
+    long h = std::lround(platform.hosts * scale);
+    long s = std::lround(platform.slots * scale);
+    for (auto& change: plan.changes) {
+        if (change.platform != platform.name)
+            continue;
+        unsigned per_host = change.slots ? change.slots
+            : std::max(1u, (platform.slots + platform.hosts / 2) / platform.hosts);
+        h += change.hosts;
+        s += long(change.hosts) * per_host;
+    }
+    hosts = std::max(0L, h);
+    if (platform.jobs.empty())
+        return std::max(0L, s);
+    hosts = std::max(1u, hosts);
+    return std::max(1L, s);
+}
+
+void simulate_queue(const std::vector<sim_job>& jobs, unsigned slots, sim_result& result)
+{
+    if (jobs.empty())
+        return;
+
+    // Min-heap with the time at which each slot is free again.
+    std::vector<uint64_t> free_at(slots, 0);
+    auto later = std::greater<uint64_t>();
+    for (auto& job: jobs) {
+        std::pop_heap(free_at.begin(), free_at.end(), later);
+        auto started = std::max(free_at.back(), job.submit_msec);
+        free_at.back() = started + job.real_msec;
+        std::push_heap(free_at.begin(), free_at.end(), later);
+
+        result.waits.add(started - job.submit_msec);
+        result.busy_msec += job.real_msec;
+        result.last_msec = std::max(result.last_msec, started + job.real_msec);
+    }
+    result.first_msec = std::min(result.first_msec, jobs.front().submit_msec);
+}
+
+// Waits of an overloaded farm grow to days; keep them in a column anyway.
+std::string format_wait(uint64_t msec)
+{
+    char buffer[16];
+    if (msec < 100 * 1000)
+        snprintf(buffer, sizeof(buffer), "%.2fs", msec / 1000.0);
+    else if (msec < 100 * 60 * 1000)
+        snprintf(buffer, sizeof(buffer), "%.1fm", msec / 60000.0);
+    else if (msec < 48 * 3600 * 1000)
+        snprintf(buffer, sizeof(buffer), "%.1fh", msec / 3600000.0);
+    else
+        snprintf(buffer, sizeof(buffer), "%.1fd", msec / 86400000.0);
+    return buffer;
+}
+
+std::string format_msec(uint64_t msec)
+{
+    char buffer[32];
+    time_t t = msec / 1000;
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", localtime(&t));
+    return buffer;
+}
+
+} // namespace
+
+
+int query(const std::string& directory, const std::vector<std::string>& terms)
+{
+    auto started = std::chrono::steady_clock::now();
+
+    auto strings = load_strings(directory);
+    query_plan plan;
+    for (auto& term: terms) {
+        if (!parse_term(term, strings, plan)) {
+            fprintf(stderr, "Invalid query term: %s\n", term.c_str());
+            print_query_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto segments = map_segments(directory);
+    if (segments.empty()) {
+        fprintf(stderr, "No history found in %s\n", directory.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // Each thread takes segments from a shared counter until none are left.
+    unsigned nthreads = worker_threads(segments.size());
+    std::vector<partial_result> partials(nthreads);
+    std::atomic<size_t> next_segment { 0 };
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([&, i] {
+            size_t index;
+            while ((index = next_segment++) < segments.size())
+                scan_segment(segments[index], plan, partials[i]);
+        });
+    }
+    uint64_t rows = 0;
+    for (auto& segment: segments)
+        rows += segment.rows;
+    for (auto& thread: threads)
+        thread.join();
+
+    partial_result result;
+    for (auto& partial: partials) {
+        for (auto& item: partial)
+            result[item.first].merge(item.second);
+    }
+    unmap_segments(segments);
+
+    std::vector<std::pair<uint64_t, aggregate>> groups(result.begin(), result.end());
+    auto score = [&plan](const aggregate& a) -> double {
+        switch (plan.sort) {
+            case SORT_COUNT:  return a.count;
+            case SORT_FAILED: return a.failed;
+            case SORT_MEAN:   return a.count ? double(a.total_msec) / a.count : 0;
+            case SORT_MAX:    return a.max_msec;
+            default:          return a.total_msec;
+        }
+    };
+    std::sort(groups.begin(), groups.end(), [&](const std::pair<uint64_t, aggregate>& a,
+                                               const std::pair<uint64_t, aggregate>& b) {
+        if (plan.sort == SORT_KEY) return a.first < b.first;
+        return score(a.second) > score(b.second);
+    });
+    if (plan.top && groups.size() > plan.top)
+        groups.resize(plan.top);
+
+    uint64_t matched = 0;
+    for (auto& item: result)
+        matched += item.second.count;
+
+    printf("%-40s %10s %8s %12s %10s %10s\n", "", "Jobs", "Failed", "Total", "Mean", "Max");
+    for (auto& group: groups) {
+        auto& a = group.second;
+        printf("%-40s %10llu %8llu %11.1fs %9.2fs %9.2fs\n",
+               key_name(plan.by, group.first, strings).c_str(),
+               static_cast<unsigned long long>(a.count),
+               static_cast<unsigned long long>(a.failed),
+               a.total_msec / 1000.0,
+               a.count ? a.total_msec / 1000.0 / a.count : 0.0,
+               a.max_msec / 1000.0);
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started).count();
+    printf("\n%llu of %llu jobs matched, %zu segments, %u threads, %.1f ms\n",
+           static_cast<unsigned long long>(matched),
+           static_cast<unsigned long long>(rows),
+           segments.size(), nthreads, elapsed / 1000.0);
+    return EXIT_SUCCESS;
+}
+
+
+int simulate(const std::string& directory, const std::vector<farm_host>& farm,
+             const std::vector<std::string>& terms)
+{
+    auto started = std::chrono::steady_clock::now();
+
+    std::vector<sim_platform> platforms;
+    std::unordered_map<std::string, int> host_platform;
+    for (auto& host: farm) {
+        auto item = std::find_if(platforms.begin(), platforms.end(), [&host](const sim_platform& p) {
+            return p.name == host.platform;
+        });
+        if (item == platforms.end()) {
+            item = platforms.insert(platforms.end(), sim_platform());
+            item->name = host.platform;
+        }
+        item->hosts++;
+        item->slots += host.max_jobs;
+        host_platform[host.name] = item - platforms.begin();
+    }
+
+    sim_plan plan;
+    for (auto& term: terms) {
+        if (!parse_simulate_term(term, platforms, plan)) {
+            fprintf(stderr, "Invalid simulation term: %s\n", term.c_str());
+            print_simulate_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto strings = load_strings(directory);
+    std::vector<int> server_platform(strings.size(), -1);
+    for (size_t id = 1; id < strings.size(); id++) {
+        auto item = host_platform.find(strings[id]);
+        if (item != host_platform.end())
+            server_platform[id] = item->second;
+    }
+
+    auto segments = map_segments(directory);
+    if (segments.empty()) {
+        fprintf(stderr, "No history found in %s\n", directory.c_str());
+        return EXIT_FAILURE;
+    }
+
+    unsigned nthreads = worker_threads(segments.size());
+    std::vector<sim_scan> scans(nthreads);
+    std::atomic<size_t> next_segment { 0 };
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([&, i] {
+            scans[i].jobs.resize(platforms.size());
+            size_t index;
+            while ((index = next_segment++) < segments.size())
+                scan_remote_jobs(segments[index], plan, server_platform, scans[i]);
+        });
+    }
+    for (auto& thread: threads)
+        thread.join();
+    threads.clear();
+    unmap_segments(segments);
+
+    util::log_histogram recorded;
+    uint64_t unknown = 0;
+    for (auto& scan: scans) {
+        recorded.merge(scan.recorded);
+        unknown += scan.unknown;
+    }
+    for (size_t p = 0; p < platforms.size(); p++) {
+        auto& jobs = platforms[p].jobs;
+        for (auto& scan: scans) {
+            jobs.insert(jobs.end(), scan.jobs[p].begin(), scan.jobs[p].end());
+            std::vector<sim_job>().swap(scan.jobs[p]);
+        }
+        std::sort(jobs.begin(), jobs.end(), [](const sim_job& a, const sim_job& b) {
+            return a.submit_msec < b.submit_msec;
+        });
+    }
+    if (!recorded.count()) {
+        fprintf(stderr, "No remote jobs on hosts of the farm in %s\n", directory.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // Platforms do not share slots, so each scenario is one task per
+    // platform, and the threads take tasks until none are left.
+    struct task {
+        size_t     scenario;
+        size_t     platform;
+        unsigned   slots;
+        sim_result result;
+    };
+    std::vector<task> tasks;
+    std::vector<unsigned> scenario_hosts(plan.scales.size(), 0);
+    std::vector<unsigned> scenario_total(plan.scales.size(), 0);
+    for (size_t s = 0; s < plan.scales.size(); s++) {
+        for (size_t p = 0; p < platforms.size(); p++) {
+            unsigned hosts;
+            unsigned slots = scenario_slots(platforms[p], plan.scales[s], plan, hosts);
+            scenario_hosts[s] += hosts;
+            scenario_total[s] += slots;
+            tasks.push_back({ s, p, slots, sim_result() });
+        }
+    }
+
+    nthreads = worker_threads(tasks.size());
+    std::atomic<size_t> next_task { 0 };
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([&] {
+            size_t index;
+            while ((index = next_task++) < tasks.size()) {
+                auto& t = tasks[index];
+                simulate_queue(platforms[t.platform].jobs, t.slots, t.result);
+            }
+        });
+    }
+    for (auto& thread: threads)
+        thread.join();
+
+    std::vector<sim_result> results(plan.scales.size());
+    for (auto& t: tasks) {
+        auto& r = results[t.scenario];
+        r.waits.merge(t.result.waits);
+        r.busy_msec += t.result.busy_msec;
+        r.first_msec = std::min(r.first_msec, t.result.first_msec);
+        r.last_msec = std::max(r.last_msec, t.result.last_msec);
+    }
+
+    unsigned hosts = 0, slots = 0;
+    uint64_t first_msec = UINT64_MAX, last_msec = 0;
+    for (auto& platform: platforms) {
+        hosts += platform.hosts;
+        slots += platform.slots;
+        if (!platform.jobs.empty()) {
+            first_msec = std::min(first_msec, platform.jobs.front().submit_msec);
+            last_msec = std::max(last_msec, platform.jobs.back().submit_msec);
+        }
+    }
+    printf("Farm: %u hosts, %u slots, %zu platforms\n", hosts, slots, platforms.size());
+    for (auto& platform: platforms) {
+        printf("  %-20s %5u hosts %6u slots %10zu jobs\n", platform.name.c_str(),
+               platform.hosts, platform.slots, platform.jobs.size());
+    }
+    printf("Jobs: %llu remote, submitted from %s to %s\n",
+           static_cast<unsigned long long>(recorded.count()),
+           format_msec(first_msec).c_str(), format_msec(last_msec).c_str());
+    printf("Recorded time outside compilation (waiting, sending, preprocessing):\n"
+           "  p50 %s, p90 %s, p99 %s, max %s\n\n",
+           format_wait(recorded.percentile(0.5)).c_str(),
+           format_wait(recorded.percentile(0.9)).c_str(),
+           format_wait(recorded.percentile(0.99)).c_str(),
+           format_wait(recorded.max()).c_str());
+
+    printf("%8s %7s %7s %7s %10s %10s %10s %10s\n",
+           "Scale", "Hosts", "Slots", "Util", "Wait p50", "p90", "p99", "Max");
+    for (size_t s = 0; s < plan.scales.size(); s++) {
+        auto& r = results[s];
+        double span = (r.last_msec > r.first_msec) ? r.last_msec - r.first_msec : 1;
+        printf("%7.2fx %7u %7u %6.1f%% %10s %10s %10s %10s\n",
+               plan.scales[s], scenario_hosts[s], scenario_total[s],
+               100.0 * r.busy_msec / (span * std::max(1u, scenario_total[s])),
+               format_wait(r.waits.percentile(0.5)).c_str(),
+               format_wait(r.waits.percentile(0.9)).c_str(),
+               format_wait(r.waits.percentile(0.99)).c_str(),
+               format_wait(r.waits.max()).c_str());
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started).count();
+    printf("\n");
+    if (unknown) {
+        printf("%llu jobs on servers not in the farm left out\n",
+               static_cast<unsigned long long>(unknown));
+    }
+    printf("%zu scenarios, %u threads, %.1f ms\n",
+           plan.scales.size(), nthreads, elapsed / 1000.0);
+    return EXIT_SUCCESS;
+}
+
+} // namespace history
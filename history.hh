@@ -0,0 +1,134 @@
+/*
+ * history.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef HISTORY_HH
+#define HISTORY_HH
+
+#include "util/intern.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+/*
+ * On-disk history of completed jobs.
+ *
+ * A history directory contains a dictionary of strings ("strings", one per
+ * line, the line number being the identifier) and numbered segment files.
+ * Each segment has a fixed capacity of rows, and stores each column in a
+ * fixed-width array of its own, so queries only touch the columns they
+ * need. Segments are only ever appended to.
+ */
+namespace history {
+
+struct record {
+    uint64_t    start_msec;   // Wall clock, milliseconds since the epoch.
+    uint64_t    end_msec;
+    std::string client;
+    std::string server;       // Empty for jobs compiled locally.
+    std::string file;
+    uint32_t    real_msec;
+    uint32_t    user_msec;
+    uint32_t    sys_msec;
+    uint32_t    page_faults;
+    int32_t     exit_code;
+};
+
+
+/*
+ * Rows are buffered by append() and written in batches by a thread of its
+ * own, so the caller never waits for the disk. If the disk cannot keep up,
+ * whole batches are dropped (and counted) instead.
+ */
+class writer {
+public:
+    // Returns nullptr, after printing the reason, on failure. Only one
+    // writer may use a directory at a time: when another one (another
+    // icetop, most likely) holds it, "busy" is set and nothing is printed.
+    static std::unique_ptr<writer> open(const std::string& directory, bool& busy);
+
+    ~writer();
+
+    void append(const record& r);
+
+    // Hands the rows buffered so far to the writer thread.
+    void flush();
+
+    uint64_t written() const { return m_written; }
+    uint64_t dropped() const { return m_dropped; }
+
+    struct batch;
+
+private:
+    writer(const std::string& directory, int strings_fd);
+
+    bool load_strings();
+    uint32_t string_id(const std::string& s);
+    void run();
+    void write_batch(batch& b);
+    bool open_segment(uint32_t number);
+
+    std::string                         m_directory;
+    int                                 m_strings_fd;
+    util::string_table                  m_strings;
+    std::unique_ptr<batch>              m_pending;
+
+    std::mutex                          m_mutex;
+    std::condition_variable             m_wakeup;
+    std::deque<std::unique_ptr<batch>>  m_queue;
+    bool                                m_stopping;
+    std::thread                         m_thread;
+
+    // Only used by the writer thread.
+    int                                 m_segment_fd;
+    uint32_t                            m_segment;
+    uint32_t                            m_segment_rows;
+    off_t                               m_strings_size;
+    std::vector<std::string>            m_unwritten;  // Strings, in order.
+    bool                                m_strings_broken;
+
+    std::atomic<uint64_t>               m_written;
+    std::atomic<uint64_t>               m_dropped;
+};
+
+
+// $XDG_DATA_HOME/icetop/history, or ~/.local/share/icetop/history
+std::string default_directory();
+
+/*
+ * Runs a query over the history and prints the results. Terms are of the
+ * form key=value; see the usage text printed for invalid terms. Returns
+ * the process exit status.
+ */
+int query(const std::string& directory, const std::vector<std::string>& terms);
+
+// A host of the farm which the history is replayed on.
+struct farm_host {
+    std::string  name;
+    std::string  platform;
+    unsigned int max_jobs;
+};
+
+/*
+ * Replays the remote jobs of the history on the farm, scaled to more or
+ * fewer hosts, and prints the queue waits and utilization predicted for
+ * each scale. Jobs on servers which are not in the farm are left out.
+ * Returns the process exit status.
+ */
+int simulate(const std::string& directory, const std::vector<farm_host>& farm,
+             const std::vector<std::string>& terms);
+
+} // namespace history
+
+#endif /* !HISTORY_HH */
@@ -5,7 +5,17 @@
  * Distributed under terms of the GPLv2 license.
  */
 
+#include "history.hh"
+#include "snapshot.hh"
+#include "stream.hh"
+#include "util/bloom.hh"
 #include "util/getenv.hh"
+#include "util/histogram.hh"
+#include "util/intern.hh"
+#include "util/ring.hh"
+#include "util/space_saving.hh"
+#include "util/top_k.hh"
+#include "util/spsc.hh"
 #include "util/ti.hh"
 
 extern "C" {
@@ -14,16 +24,44 @@ extern "C" {
 
 #include <icecc/comm.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <regex>
 #include <sstream>
 #include <string>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <thread>
+#include <tuple>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 static std::vector<std::string> s_opt_netnames;
 
+// Sections of the state saved across runs.
+enum snapshot_section : uint32_t {
+    SNAPSHOT_SCHEDULER = 1,
+    SNAPSHOT_HOSTS,
+    SNAPSHOT_FILES,
+    SNAPSHOT_DURATIONS,
+    SNAPSHOT_LATENCY,
+};
+
 using host_stats_map = std::unordered_map<std::string, std::string>;
 
 struct host_info {
@@ -32,10 +70,12 @@ public:
     unsigned int max_jobs;
     int          load;
     bool         offline;
+    uint16_t     platform_id;  // Assigned by team_info.
     std::string  name;
     std::string  platform;
 
-    host_info(unsigned int id_): id(id_), name(), platform() {}
+    host_info(unsigned int id_)
+        : id(id_), max_jobs(0), load(0), offline(false), platform_id(0), name(), platform() {}
     host_info(const host_info&) = delete;
     host_info(host_info&&) = default;
 
@@ -61,15 +101,26 @@ public:
 };
 
 
-using host_info_map = std::unordered_map<unsigned int, host_info>;
-
-
+/*
+ * Hosts are never forgotten, so each one gets a fixed position in a table.
+ * What is needed to add up the capacity of the cluster (slots, load, state,
+ * platform) is kept in arrays of its own, so the totals are short loops over
+ * dense memory instead of a walk over the host records. The rest of each
+ * host is kept in a host_info record, which does not move.
+ */
 struct team_info {
 public:
+    struct platform_totals {
+        std::string name;
+        unsigned    hosts = 0;  // Online only, as the rest.
+        unsigned    slots = 0;
+        int64_t     load  = 0;  // Sum of the load of the hosts.
+    };
+
     const host_info* find(unsigned int id) const {
-        auto item = host_infos.find(id);
-        if (item != host_infos.end())
-            return &item->second;
+        auto item = index.find(id);
+        if (item != index.end())
+            return &infos[item->second];
         return nullptr;
     }
 
@@ -80,21 +131,93 @@ public:
     }
 
     const unsigned int max_jobs_for(unsigned int id) const {
-        auto host = find(id);
-        return host ? host->max_jobs : 0;
+        auto item = index.find(id);
+        return item != index.end() ? max_jobs[item->second] : 0;
     }
 
+    size_t size() const { return infos.size(); }
+
     host_info* check_host(unsigned int id, const host_stats_map& stats) {
-        auto item = host_infos.find(id);
-        if (item == host_infos.end()) {
-            item = host_infos.emplace(id, host_info(id)).first;
+        auto& host = get(id);
+        host.update_from_stats_map(stats);
+        updated(host);
+        return &host;
+    }
+
+    // Changes to the host must be followed by a call to updated().
+    host_info& get(unsigned int id) {
+        auto item = index.find(id);
+        if (item != index.end())
+            return infos[item->second];
+        index.emplace(id, infos.size());
+        infos.emplace_back(id);
+        max_jobs.push_back(0);
+        loads.push_back(0);
+        offline.push_back(true);  // Not counted until updated.
+        platform_ids.push_back(0);
+        return infos.back();
+    }
+
+    void updated(host_info& host) {
+        auto i = index.at(host.id);
+        host.platform_id = platform_id(host.platform);
+        max_jobs[i] = host.max_jobs;
+        loads[i] = host.load;
+        offline[i] = host.offline;
+        platform_ids[i] = host.platform_id;
+    }
+
+    template <typename F>
+    void for_each(F f) const {
+        for (auto& host: infos)
+            f(host);
+    }
+
+    // Indexed by host_info::platform_id.
+    std::vector<platform_totals> platforms() const {
+        std::vector<platform_totals> result(platform_names.size());
+        for (size_t i = 0; i < result.size(); i++)
+            result[i].name = platform_names[i];
+        for (size_t i = 0; i < offline.size(); i++) {
+            if (offline[i])
+                continue;
+            auto& p = result[platform_ids[i]];
+            p.hosts++;
+            p.slots += max_jobs[i];
+            p.load += loads[i];
+        }
+        return result;
+    }
+
+    // Without branches, so that the compiler can vectorize it.
+    platform_totals totals() const {
+        platform_totals all;
+        for (size_t i = 0; i < offline.size(); i++) {
+            int online = !offline[i];
+            all.hosts += online;
+            all.slots += online * max_jobs[i];
+            all.load += online * loads[i];
         }
-        item->second.update_from_stats_map(stats);
-        return &item->second;
+        return all;
     }
 
 private:
-    host_info_map host_infos;
+    uint16_t platform_id(const std::string& name) {
+        auto item = platform_index.find(name);
+        if (item != platform_index.end())
+            return item->second;
+        platform_names.push_back(name);
+        return platform_index.emplace(name, platform_names.size() - 1).first->second;
+    }
+
+    std::unordered_map<unsigned int, size_t>     index;
+    std::deque<host_info>                        infos;
+    std::vector<unsigned int>                    max_jobs;
+    std::vector<int>                             loads;
+    std::vector<uint8_t>                         offline;
+    std::vector<uint16_t>                        platform_ids;
+    std::unordered_map<std::string, uint16_t>    platform_index;
+    std::vector<std::string>                     platform_names;
 };
 
 
@@ -116,11 +239,14 @@ struct job_info {
     unsigned int client_id;
     unsigned int server_id;
     std::string  filename;
+    uint32_t     filename_id;  // Interned by the monitor.
     unsigned int real_msec;
     unsigned int user_msec;
     unsigned int sys_msec;
     unsigned int page_faults;
     int          exit_code;
+    int64_t      submitted_usec;  // From now_usec(), zero if unknown.
+    int64_t      started_usec;    // Remote jobs only.
 
     const char* state_string() const {
         switch (state) {
@@ -143,9 +269,12 @@ private:
     job_info(icecc_monitor& monitor_,
              unsigned int id_,
              unsigned int client_id_,
-             const std::string& filename_)
-        : id(id_), client_id(client_id_)
-        , filename(filename_)
+             const std::string& filename_,
+             uint32_t filename_id_)
+        : id(id_), state(WAITING), client_id(client_id_), server_id(0)
+        , filename(filename_), filename_id(filename_id_)
+        , real_msec(0), user_msec(0), sys_msec(0), page_faults(0)
+        , exit_code(0), submitted_usec(0), started_usec(0)
         , monitor(monitor_) { }
 
     friend struct icecc_monitor;
@@ -164,6 +293,151 @@ using job_info_map = std::unordered_map<unsigned int, job_info>;
     F (MON_STATS,           MonStatsMsg)
 
 
+static inline int64_t now_usec()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ * Counters for each type of message received from the scheduler, indexed
+ * by MsgType. Messages of types without a handler count as ignored.
+ */
+struct message_type_stats {
+    uint64_t received    = 0;
+    uint64_t handled     = 0;
+    uint64_t ignored     = 0;  // No handler, or nothing to update.
+    uint64_t bytes       = 0;  // Approximate, see message_wire_size().
+    uint64_t handle_usec = 0;
+};
+
+static constexpr unsigned max_message_type = 256;
+
+
+/*
+ * Counters for both ends of the message pipeline. The ingest side may run
+ * in a thread of its own, hence the atomics; the rest is only touched by
+ * the thread which handles the messages.
+ */
+struct pipeline_stats {
+    std::atomic<uint64_t> received      { 0 };
+    std::atomic<uint64_t> read_usec     { 0 };
+    std::atomic<uint64_t> stalls        { 0 };
+    std::atomic<uint64_t> pending_bytes { 0 };  // Unread, on the socket.
+
+    uint64_t handled                 = 0;
+    uint64_t handle_usec             = 0;
+    uint64_t shed                    = 0;  // Callbacks skipped.
+    uint64_t callbacks               = 0;  // Callbacks delivered.
+    int64_t  max_queue_delay_usec    = 0;
+    int64_t  max_lag_usec            = 0;
+    size_t   max_queue_depth         = 0;
+
+    message_type_stats types[max_message_type];
+};
+
+
+/*
+ * Approximate size of messages on the wire: length and type, then the
+ * fields, with strings prefixed by their length and NUL-terminated. For
+ * messages with fields icetop does not use, those are left out.
+ */
+static constexpr size_t message_header_size = 8;
+
+static inline size_t wire_size(const std::string& s)
+{
+    return 4 + s.size() + 1;
+}
+
+static size_t message_wire_size(const MonStatsMsg& m)
+{
+    return message_header_size + 4 + wire_size(m.statmsg);
+}
+
+static size_t message_wire_size(const MonLocalJobBeginMsg& m)
+{
+    return message_header_size + 3 * 4 + wire_size(m.file);
+}
+
+static size_t message_wire_size(const JobLocalDoneMsg&)
+{
+    return message_header_size + 4;
+}
+
+static size_t message_wire_size(const MonGetCSMsg& m)
+{
+    return message_header_size + 6 * 4 + wire_size(m.filename);
+}
+
+static size_t message_wire_size(const MonJobBeginMsg&)
+{
+    return message_header_size + 3 * 4;
+}
+
+static size_t message_wire_size(const MonJobDoneMsg&)
+{
+    return message_header_size + 11 * 4;
+}
+
+
+/*
+ * Messages are dispatched through a table indexed by type, built at
+ * compile time from a list of handlers. A handler is only ever called
+ * with messages of its own type, so static_cast is enough.
+ */
+template <MsgType Type, typename M, bool (icecc_monitor::*Handler)(const M&)>
+struct message_handler {
+    static bool handle(icecc_monitor& monitor, const Msg& m) {
+        return (monitor.*Handler)(static_cast<const M&>(m));
+    }
+
+    static size_t wire_size(const Msg& m) {
+        return message_wire_size(static_cast<const M&>(m));
+    }
+};
+
+template <typename... Handlers>
+struct message_typelist { };
+
+struct message_typelist_end { };
+
+struct message_dispatch_table {
+    struct entry {
+        bool   (*handle)(icecc_monitor&, const Msg&);
+        size_t (*wire_size)(const Msg&);
+    };
+
+    template <typename... Handlers>
+    constexpr message_dispatch_table(message_typelist<Handlers...>)
+        : entries()
+    {
+        // Explicitly, or GCC does not consider the result constant.
+        for (auto& e: entries)
+            e = { nullptr, nullptr };
+        add(Handlers()...);
+    }
+
+    // Returns nullptr for types without a handler.
+    const entry* find(unsigned type) const {
+        return (type < max_message_type && entries[type].handle) ? &entries[type] : nullptr;
+    }
+
+private:
+    constexpr void add(message_typelist_end) { }
+
+    template <MsgType Type, typename M, bool (icecc_monitor::*Handler)(const M&), typename... Rest>
+    constexpr void add(message_handler<Type, M, Handler>, Rest... rest) {
+        static_assert(Type < max_message_type, "message type out of range");
+        entries[Type] = { &message_handler<Type, M, Handler>::handle,
+                          &message_handler<Type, M, Handler>::wire_size };
+        add(rest...);
+    }
+
+    entry entries[max_message_type];
+};
+
+
 struct icecc_monitor {
 public:
     using host_updated_func = std::function<void(const host_info&)>;
@@ -174,102 +448,489 @@ public:
         ONLINE,
     };
 
+    // Where a scheduler was found, to try it first the next time.
+    struct scheduler_address {
+        std::string network;
+        std::string host;
+        unsigned    port = 0;
+    };
+
     icecc_monitor(host_updated_func on_host_updated_ = nullptr,
                   job_updated_func on_job_updated_ = nullptr)
         : on_host_updated(on_host_updated_)
         , on_job_updated(on_job_updated_)
         , state(OFFLINE)
+        , logged_in(false)
+        , stopping(false)
     { }
 
+    ~icecc_monitor() {
+        stop_ingest_thread();
+    }
 
+    static void add_netname(const std::string& name) {
+        if (std::find(s_opt_netnames.begin(), s_opt_netnames.end(), name) == s_opt_netnames.end())
+            s_opt_netnames.push_back(name);
+    }
 
     coroutine void check_scheduler(bool deleteit=false) {
+        bool from_environment = false;
         if (auto env_scheduler = util::getenv("USE_SCHEDULER")) {
-            s_opt_netnames.push_back(env_scheduler.value());
+            add_netname(env_scheduler.value());
+            from_environment = true;
         }
         if (auto env_scheduler = util::getenv("ICECREAM_SCHEDULER")) {
-            s_opt_netnames.push_back(env_scheduler.value());
+            add_netname(env_scheduler.value());
+            from_environment = true;
         }
-        if (!network_name.empty()) {
-            s_opt_netnames.push_back(network_name);
-        } else {
-            s_opt_netnames.push_back("ICECREAM");
+        std::string network;
+        {
+            std::lock_guard<std::mutex> lock(names_mutex);
+            if (from_environment)
+                last_scheduler = scheduler_address();
+            network = network_name;
         }
+        add_netname(network.empty() ? "ICECREAM" : network);
 
         if (deleteit) {
             scheduler = nullptr;
         }
 
         static constexpr auto max_wait_seconds = 3;
-        while (!scheduler) {
+        while (!scheduler && !stopping) {
+            // Try the scheduler of the previous run first, once, if it was
+            // found on one of the networks to look at now.
+            auto previous = previous_scheduler();
+            if (!previous.host.empty()
+                && std::find(s_opt_netnames.begin(), s_opt_netnames.end(), previous.network) != s_opt_netnames.end()) {
+                DiscoverSched discover(previous.network, max_wait_seconds, previous.host, previous.port);
+                if (wait_for_scheduler(discover, previous.network))
+                    return;
+                std::lock_guard<std::mutex> lock(names_mutex);
+                last_scheduler = scheduler_address();
+            }
             for (auto& name: s_opt_netnames) {
-                auto discover = std::make_unique<DiscoverSched>(name, max_wait_seconds);
-                scheduler.reset(discover->try_get_scheduler());
-                while (!scheduler && !discover->timed_out()) {
-                    if (discover->listen_fd() != -1) {
-                        if (fdin(discover->listen_fd(), now() + 100) && (errno != ETIMEDOUT)) {
-                            perror("fdin");
-                            exit(EXIT_FAILURE);
-                        }
-                    } else {
-                        msleep(now() + 50);
-                    }
-                    scheduler.reset(discover->try_get_scheduler());
-                }
-                fdclean(discover->listen_fd());
-                if (scheduler) {
-                    state = ONLINE;
-                    network_name = discover->networkName();
-                    scheduler_name = discover->schedulerName();
-                    scheduler->setBulkTransfer();
+                DiscoverSched discover(name, max_wait_seconds);
+                if (wait_for_scheduler(discover, name))
                     return;
-                }
             }
         }
     }
 
     coroutine void listen(int64_t deadline = -1) {
-        if (!scheduler->send_msg(MonLoginMsg())) {
-            // TODO: Recheck for the scheduler
-            return;
+        while (deadline < 0 || now() < deadline) {
+            poll([this](message_batch& batch, int64_t stamp) {
+                _handle_batch(batch, now_usec() - stamp);
+            }, deadline);
         }
-        while (true) {
-            if (fdin(scheduler->fd, deadline)) {
-                return;
+    }
+
+    /*
+     * Runs check_scheduler() and reads messages in a separate thread, so
+     * reading from the scheduler socket does not have to wait for the
+     * screen to be updated. Messages are handed over through a bounded
+     * queue, and handled when the calling thread uses drain().
+     */
+    void start_ingest_thread(size_t capacity) {
+        assert(!ingest_thread.joinable());
+        queue = std::make_unique<util::spsc_ring<queued_msg>>(capacity);
+        ingest_thread = std::thread([this] {
+            check_scheduler();
+            while (!stopping) {
+                poll([this](message_batch& batch, int64_t stamp) {
+                    for (auto& m: batch)
+                        _enqueue(std::move(m), stamp);
+                }, now() + 100);
             }
-            while (!scheduler->read_a_bit() || scheduler->has_msg()) {
-                if (!_handle_activity()) {
-                    fdclean(scheduler->fd);
-                    break;
-                }
+        });
+    }
+
+    void stop_ingest_thread() {
+        if (!ingest_thread.joinable())
+            return;
+        stopping = true;
+        ingest_thread.join();
+        queued_msg item;
+        while (queue->pop(item))
+            delete item.msg;
+    }
+
+    // Handles queued messages for at most the given time budget, and
+    // returns how many were handled.
+    size_t drain(int64_t budget_usec) {
+        assert(queue);
+        stats.max_queue_depth = std::max(stats.max_queue_depth, queue->size());
+        auto started = now_usec();
+        size_t count = 0;
+        message_batch batch;
+        queued_msg item;
+        while (now_usec() - started < budget_usec) {
+            int64_t oldest = 0;
+            while (batch.size() < max_batch_size && queue->pop(item)) {
+                if (batch.empty()) oldest = item.stamp;
+                batch.emplace_back(item.msg);
             }
+            if (batch.empty())
+                break;
+            auto delay = now_usec() - oldest;
+            stats.max_queue_delay_usec = std::max(stats.max_queue_delay_usec, delay);
+            _handle_batch(batch, delay);
+            count += batch.size();
+            batch.clear();
+        }
+        return count;
+    }
+
+    /*
+     * When lagging behind the scheduler (too many bytes pending to be read,
+     * or messages waiting too long to be handled), all messages are still
+     * applied to the model, but callbacks are only delivered for the last
+     * message in a batch which refers to each job or host, collapsing
+     * intermediate transitions into their final state.
+     */
+    void set_load_shedding(bool enabled) { shedding_enabled = enabled; }
+
+    static constexpr uint64_t max_pending_bytes = 256 * 1024;
+    static constexpr int64_t max_lag_usec = 250 * 1000;
+
+    // Observers are called for every update, before callbacks and even
+    // when those are skipped by load shedding. Use them to gather stats.
+    void add_host_observer(host_updated_func f) { host_observers.emplace_back(std::move(f)); }
+    void add_job_observer(job_updated_func f) { job_observers.emplace_back(std::move(f)); }
+
+    bool online() const { return state == ONLINE; }
+    bool threaded() const { return ingest_thread.joinable(); }
+
+    /*
+     * Updates the model from another source than the scheduler, like an
+     * aggregator (see stream.hh). Observers and callbacks are notified the
+     * same as for scheduler messages.
+     */
+    void apply(const stream::host_state& s);
+    void apply(const stream::job_state& s, const std::string& filename);
+
+    void set_online(const std::string& source) {
+        {
+            std::lock_guard<std::mutex> lock(names_mutex);
+            scheduler_name = source;
+            scheduler_discovered = false;
         }
+        state = ONLINE;
+    }
+
+    // Copies, as the ingest thread may be changing them.
+    std::string scheduler_host() const {
+        std::lock_guard<std::mutex> lock(names_mutex);
+        return scheduler_name;
     }
 
     const host_info* find_host(unsigned int id) const { return team.find(id); }
+    const team_info& hosts() const { return team; }
+
+    uint32_t intern_filename(const std::string& name) { return filename_table.intern(name); }
+
+    /*
+     * Forgets the file names which no job, and nothing marked by "mark",
+     * refers to anymore, once the table doubled since the last time. Their
+     * identifiers are then reused, so whatever keeps identifiers around
+     * must mark them.
+     */
+    void collect_filenames(std::function<void(util::string_table::in_use&)> mark) {
+        static constexpr size_t min_filenames = 64 * 1024;
+        if (filename_table.count() < std::max(min_filenames, next_collection))
+            return;
+        auto in_use = filename_table.begin_sweep();
+        for (auto& item: jobs)
+            in_use.mark(item.second.filename_id);
+        mark(in_use);
+        filename_table.sweep(in_use);
+        next_collection = 2 * filename_table.count();
+    }
+
+    /*
+     * Hosts are restored as they were, so they are shown right away, and
+     * are marked offline unless the scheduler mentions them soon after
+     * connecting. Jobs are not saved: those running at exit are most
+     * likely done by the time icetop starts again.
+     */
+    void save(snapshot::writer& w) const {
+        auto address = saved_scheduler();
+        w.section(SNAPSHOT_SCHEDULER);
+        w.str(address.network);
+        w.str(address.host);
+        w.u64(address.port);
+        w.section(SNAPSHOT_HOSTS);
+        team.for_each([&w](const host_info& host) {
+            w.u64(host.id);
+            w.str(host.name);
+            w.shared_str(host.platform);
+            w.u64(host.max_jobs);
+            w.i64(host.load);
+            w.u64(host.offline);
+        });
+    }
+
+    void load(snapshot::reader& r) {
+        // Networks given with -n are looked at afresh.
+        if (s_opt_netnames.empty() && r.section(SNAPSHOT_SCHEDULER)) {
+            scheduler_address address;
+            address.network = r.str();
+            address.host = r.str();
+            address.port = r.u64();
+            std::lock_guard<std::mutex> lock(names_mutex);
+            if (r.ok())
+                last_scheduler = address;
+        }
+        if (r.section(SNAPSHOT_HOSTS)) {
+            while (r.more()) {
+                stream::host_state host;
+                host.id = r.u64();
+                host.name = r.str();
+                host.platform = r.shared_str();
+                host.max_jobs = r.u64();
+                host.load = r.i64();
+                host.offline = r.u64();
+                if (!r.ok())
+                    break;
+                apply(host);
+                if (!host.offline)
+                    restored_hosts.insert(host.id);
+            }
+        }
+    }
+
+    // Called periodically, to let go of restored hosts which are gone.
+    void expire_restored() {
+        static constexpr int64_t grace_usec = 10 * 1000 * 1000;
+        if (restored_hosts.empty() || !online())
+            return;
+        if (!restored_deadline) {
+            restored_deadline = now_usec() + grace_usec;
+            return;
+        }
+        if (now_usec() < restored_deadline)
+            return;
+        for (auto id: restored_hosts) {
+            auto& host = team.get(id);
+            host.offline = true;
+            team.updated(host);
+            _notify(host);
+        }
+        restored_hosts.clear();
+    }
+
+    // Calls the functions for every host and every job being tracked.
+    void for_each(const host_updated_func& on_host, const job_updated_func& on_job) const {
+        team.for_each(on_host);
+        for (auto& item: jobs)
+            on_job(item.second);
+    }
+    const util::string_table& filenames() const { return filename_table; }
+    size_t job_count() const { return jobs.size(); }
+    size_t host_count() const { return team.size(); }
 
-    std::string                    network_name;
-    std::string                    scheduler_name;
     std::unique_ptr<MsgChannel>    scheduler;
+    pipeline_stats                 stats;
+    int64_t                        arrival_usec = 0;  // Of the messages being handled.
 
 private:
+    struct queued_msg {
+        int64_t stamp;  // Arrival time, from now_usec().
+        Msg*    msg;
+    };
+
+    using message_batch = std::vector<std::unique_ptr<Msg>>;
+    static constexpr size_t max_batch_size = 4096;
+
     host_updated_func              on_host_updated;
     job_updated_func               on_job_updated;
-    monitor_state                  state;
+    std::vector<host_updated_func> host_observers;
+    std::vector<job_updated_func>  job_observers;
+    std::atomic<monitor_state>     state;
+    bool                           logged_in;
     team_info                      team;
     job_info_map                   jobs;
+    util::string_table             filename_table;
+    size_t                         next_collection = 0;  // File names.
+
+    // Written by check_scheduler(), which may run in the ingest thread.
+    mutable std::mutex             names_mutex;
+    std::string                    network_name;
+    std::string                    scheduler_name;
+    unsigned                       scheduler_port = 0;
+    scheduler_address              last_scheduler;  // From the snapshot.
+    bool                           scheduler_discovered = false;
+    std::unordered_set<unsigned int> restored_hosts;
+    int64_t                        restored_deadline = 0;
+
+    std::thread                    ingest_thread;
+    std::atomic<bool>              stopping;
+    std::unique_ptr<util::spsc_ring<queued_msg>> queue;
+
+    bool                           shedding_enabled = true;
+    bool                           deliver_callbacks = true;
+    std::unordered_map<uint64_t, size_t> last_in_batch;
+
+    // Waits until the deadline for messages from the scheduler, and passes
+    // them in batches to "deliver" along with their arrival time. Reconnects
+    // when the scheduler goes away.
+    template <typename F>
+    void poll(F deliver, int64_t deadline) {
+        if (!scheduler) {
+            // Give check_scheduler() a chance to run, when it is another
+            // coroutine, instead of spinning until it finds one.
+            auto wakeup = now() + 100;
+            msleep(deadline < 0 ? wakeup : std::min(deadline, wakeup));
+            return;
+        }
+        if (!logged_in && !(logged_in = scheduler->send_msg(MonLoginMsg()))) {
+            reconnect();
+            return;
+        }
+        if (fdin(scheduler->fd, deadline)) {
+            if (errno != ETIMEDOUT)
+                reconnect();
+            return;
+        }
+
+        auto started = now_usec();
+        int64_t delivering_usec = 0;
+        auto flush_batch = [&](message_batch& batch) {
+            auto t = now_usec();
+            deliver(batch, started);
+            batch.clear();
+            delivering_usec += now_usec() - t;
+        };
 
-    bool _handle_activity();
+        message_batch batch;
+        bool disconnected = false;
+        while (!scheduler->read_a_bit() || scheduler->has_msg()) {
+            std::unique_ptr<Msg> m(scheduler->get_msg());
+            if (!m || m->type == M_END) {
+                disconnected = true;
+                break;
+            }
+            stats.received++;
+            batch.emplace_back(std::move(m));
+            if (batch.size() == max_batch_size)
+                flush_batch(batch);
+        }
+
+        int pending = 0;
+        if (!disconnected && ioctl(scheduler->fd, FIONREAD, &pending) == 0)
+            stats.pending_bytes = pending;
+        stats.read_usec += now_usec() - started - delivering_usec;
+
+        if (!batch.empty())
+            flush_batch(batch);
+        if (disconnected)
+            reconnect();
+    }
+
+    void reconnect() {
+        state = OFFLINE;
+        logged_in = false;
+        fdclean(scheduler->fd);
+        check_scheduler(true);
+    }
+
+    void _enqueue(std::unique_ptr<Msg> m, int64_t stamp) {
+        queued_msg item { stamp, m.release() };
+        while (!queue->push(item)) {
+            if (stopping) {
+                delete item.msg;
+                return;
+            }
+            stats.stalls++;
+            msleep(now() + 1);
+        }
+    }
+
+    // Waits until the discovery finds a scheduler, or gives up.
+    bool wait_for_scheduler(DiscoverSched& discover, const std::string& network) {
+        scheduler.reset(discover.try_get_scheduler());
+        while (!scheduler && !discover.timed_out()) {
+            if (discover.listen_fd() != -1) {
+                if (fdin(discover.listen_fd(), now() + 100) && (errno != ETIMEDOUT)) {
+                    perror("fdin");
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                msleep(now() + 50);
+            }
+            scheduler.reset(discover.try_get_scheduler());
+        }
+        fdclean(discover.listen_fd());
+        if (!scheduler)
+            return false;
+        {
+            std::lock_guard<std::mutex> lock(names_mutex);
+            network_name = network;
+            scheduler_name = discover.schedulerName();
+            scheduler_port = scheduler->port;
+            scheduler_discovered = true;
+        }
+        scheduler->setBulkTransfer();
+        state = ONLINE;
+        return true;
+    }
+
+    scheduler_address previous_scheduler() const {
+        std::lock_guard<std::mutex> lock(names_mutex);
+        return last_scheduler;
+    }
+
+    // The scheduler to try first next time: only one found by discovery,
+    // never an aggregator given with --connect.
+    scheduler_address saved_scheduler() const {
+        std::lock_guard<std::mutex> lock(names_mutex);
+        if (!scheduler_discovered)
+            return last_scheduler;
+        scheduler_address address;
+        address.network = network_name;
+        address.host = scheduler_name;
+        address.port = scheduler_port;
+        return address;
+    }
 
+    void _handle_message(const Msg& m);
+    void _handle_batch(message_batch& batch, int64_t lag_usec);
+
+    void _notify(const host_info& host) {
+        for (auto& observer: host_observers) observer(host);
+        if (!on_host_updated) return;
+        if (deliver_callbacks) { stats.callbacks++; on_host_updated(host); } else stats.shed++;
+    }
+
+    void _notify(const job_info& job) {
+        for (auto& observer: job_observers) observer(job);
+        if (!on_job_updated) return;
+        if (deliver_callbacks) { stats.callbacks++; on_job_updated(job); } else stats.shed++;
+    }
+
+// Handlers return false when the message did not change anything.
 #define MESSAGE_HANDLER(typecode, msgtype, msgvarname) \
-    void icecc_monitor::_handle_ ## typecode(const msgtype & msgvarname)
+    bool icecc_monitor::_handle_ ## typecode(const msgtype & msgvarname)
 
 #define DECLARE_MESSAGE_HANDLER(typecode, msgtype) \
-    void _handle_ ## typecode(const msgtype & m);
+    bool _handle_ ## typecode(const msgtype & m);
 
     MESSAGE_TYPES (DECLARE_MESSAGE_HANDLER)
 
 #undef DECLARE_MESSAGE_HANDLER
+
+#define MESSAGE_TYPE_HANDLER(typecode, msgtype) \
+    message_handler<M_ ## typecode, msgtype, &icecc_monitor::_handle_ ## typecode>,
+
+    using message_handlers = message_typelist<MESSAGE_TYPES (MESSAGE_TYPE_HANDLER) message_typelist_end>;
+
+#undef MESSAGE_TYPE_HANDLER
+
+    static const message_dispatch_table& dispatch_table();
+
+public:
+    static bool has_handler(unsigned type) { return dispatch_table().find(type); }
+    static const char* message_type_name(unsigned type);
 };
 
 
@@ -277,33 +938,101 @@ const host_info* job_info::server() const { return monitor.find_host(server_id);
 const host_info* job_info::client() const { return monitor.find_host(client_id); }
 
 
-bool icecc_monitor::_handle_activity()
+const message_dispatch_table& icecc_monitor::dispatch_table()
 {
-    std::unique_ptr<Msg> m(scheduler->get_msg());
-    if (!m) {
-        check_scheduler();
-        state = OFFLINE;
-        return false;
+    static constexpr message_dispatch_table table { message_handlers() };
+    return table;
+}
+
+const char* icecc_monitor::message_type_name(unsigned type)
+{
+#define MESSAGE_TYPE_NAME(typecode, msgtype) \
+    case M_ ## typecode: return #typecode;
+
+    switch (type) {
+        MESSAGE_TYPES (MESSAGE_TYPE_NAME)
+        default: return nullptr;
     }
 
-#define SWITCH_MESSAGE_TYPE(typecode, msgtype)          \
-    case M_ ## typecode: {                              \
-        msgtype * mm = dynamic_cast<msgtype*>(m.get()); \
-        if (mm) _handle_ ## typecode(*mm);              \
-    } break;
+#undef MESSAGE_TYPE_NAME
+}
 
-    switch (m->type) {
-        MESSAGE_TYPES (SWITCH_MESSAGE_TYPE)
-        case M_END:
-            check_scheduler(true);
-            // fall-through
+void icecc_monitor::_handle_message(const Msg& m)
+{
+    auto started = now_usec();
+
+    unsigned type = m.type;
+    auto& counters = stats.types[std::min(type, max_message_type - 1)];
+    counters.received++;
+    if (auto entry = dispatch_table().find(type)) {
+        counters.bytes += entry->wire_size(m);
+        if (entry->handle(*this, m))
+            counters.handled++;
+        else
+            counters.ignored++;
+    } else {
+        counters.ignored++;
+    }
+
+    auto elapsed = now_usec() - started;
+    counters.handle_usec += elapsed;
+    stats.handled++;
+    stats.handle_usec += elapsed;
+}
+
+// Messages which refer to the same job or host share a key.
+static bool collapse_key(const Msg& m, uint64_t& key)
+{
+    static constexpr uint64_t host_key = uint64_t(1) << 32;
+    switch (m.type) {
+        case M_MON_STATS:
+            key = host_key | static_cast<const MonStatsMsg&>(m).hostid;
+            return true;
+        case M_MON_LOCAL_JOB_BEGIN:
+            key = static_cast<const MonLocalJobBeginMsg&>(m).job_id;
+            return true;
+        case M_JOB_LOCAL_DONE:
+            key = static_cast<const JobLocalDoneMsg&>(m).job_id;
+            return true;
+        case M_MON_JOB_BEGIN:
+            key = static_cast<const MonJobBeginMsg&>(m).job_id;
+            return true;
+        case M_MON_JOB_DONE:
+            key = static_cast<const MonJobDoneMsg&>(m).job_id;
+            return true;
+        case M_MON_GET_CS:
+            key = static_cast<const MonGetCSMsg&>(m).job_id;
+            return true;
         default:
-            break;
+            return false;
     }
+}
+
+void icecc_monitor::_handle_batch(message_batch& batch, int64_t lag_usec)
+{
+    stats.max_lag_usec = std::max(stats.max_lag_usec, lag_usec);
+    arrival_usec = now_usec() - lag_usec;
 
-#undef SWITCH_MESSAGE_TYPE
+    bool shed = shedding_enabled && batch.size() > 1
+        && (stats.pending_bytes > max_pending_bytes || lag_usec > max_lag_usec);
 
-    return true;
+    if (!shed) {
+        for (auto& m: batch)
+            _handle_message(*m);
+        return;
+    }
+
+    last_in_batch.clear();
+    uint64_t key;
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (collapse_key(*batch[i], key))
+            last_in_batch[key] = i;
+    }
+    for (size_t i = 0; i < batch.size(); i++) {
+        deliver_callbacks = !collapse_key(*batch[i], key) || last_in_batch[key] == i;
+        _handle_message(*batch[i]);
+    }
+    deliver_callbacks = true;
 }
 
 static host_stats_map
@@ -322,7 +1051,9 @@ MESSAGE_HANDLER (MON_STATS, MonStatsMsg, m)
 {
     auto stats = parse_stats(m.statmsg);
     auto host = team.check_host(m.hostid, stats);
-    if (on_host_updated) on_host_updated(*host);
+    restored_hosts.erase(m.hostid);
+    _notify(*host);
+    return true;
 }
 
 MESSAGE_HANDLER (MON_LOCAL_JOB_BEGIN, MonLocalJobBeginMsg, m)
@@ -330,20 +1061,24 @@ MESSAGE_HANDLER (MON_LOCAL_JOB_BEGIN, MonLocalJobBeginMsg, m)
     job_info& job = jobs.emplace(m.job_id, job_info(*this,
                                                     m.job_id,
                                                     m.hostid,
-                                                    m.file)).first->second;
+                                                    m.file,
+                                                    filename_table.intern(m.file))).first->second;
     job.state = job_info::LOCAL;
-    if (on_job_updated) on_job_updated(job);
+    job.submitted_usec = now_usec();
+    _notify(job);
+    return true;
 }
 
 MESSAGE_HANDLER (JOB_LOCAL_DONE, JobLocalDoneMsg, m)
 {
     auto item = jobs.find(m.job_id);
     if (item == jobs.end()) {
-        return;  // Monitoring started after the job was created.
+        return false;  // Monitoring started after the job was created.
     }
     job_info& job = item->second;
     job.state = job_info::FINISHED;
-    if (on_job_updated) on_job_updated(job);
+    _notify(job);
+    return true;
 }
 
 MESSAGE_HANDLER (MON_GET_CS, MonGetCSMsg, m)
@@ -351,28 +1086,33 @@ MESSAGE_HANDLER (MON_GET_CS, MonGetCSMsg, m)
     job_info& job = jobs.emplace(m.job_id, job_info(*this,
                                                     m.job_id,
                                                     m.clientid,
-                                                    m.filename)).first->second;
+                                                    m.filename,
+                                                    filename_table.intern(m.filename))).first->second;
     job.state = job_info::WAITING;
-    if (on_job_updated) on_job_updated(job);
+    job.submitted_usec = now_usec();
+    _notify(job);
+    return true;
 }
 
 MESSAGE_HANDLER (MON_JOB_BEGIN, MonJobBeginMsg, m)
 {
     auto item = jobs.find(m.job_id);
     if (item == jobs.end()) {
-        return;  // Monitoring started after the job was created.
+        return false;  // Monitoring started after the job was created.
     }
     job_info& job = item->second;
     job.server_id = m.hostid;
     job.state = job_info::COMPILING;
-    if (on_job_updated) on_job_updated(job);
+    job.started_usec = now_usec();
+    _notify(job);
+    return true;
 }
 
 MESSAGE_HANDLER (MON_JOB_DONE, MonJobDoneMsg, m)
 {
     auto item = jobs.find(m.job_id);
     if (item == jobs.end()) {
-        return;  // Monitoring started after the job was created.
+        return false;  // Monitoring started after the job was created.
     }
 
     job_info& job = item->second;
@@ -388,251 +1128,4141 @@ MESSAGE_HANDLER (MON_JOB_DONE, MonJobDoneMsg, m)
         job.page_faults = m.pfaults;
     }
 
-    if (on_job_updated) on_job_updated(job);
+    _notify(job);
 
     jobs.erase(item);
+    return true;
 }
 
 
-struct host_layout {
-    static ti::pen line_pens[2];
-    static ti::pen busy_pen, warn_pen, okay_pen, host_pen;
+void icecc_monitor::apply(const stream::host_state& s)
+{
+    auto& host = team.get(s.id);
+    host.name = s.name;
+    host.platform = s.platform;
+    host.max_jobs = s.max_jobs;
+    host.load = s.load;
+    host.offline = s.offline;
+    team.updated(host);
+    restored_hosts.erase(s.id);
+    _notify(host);
+}
 
-    host_layout(ti::window&& w, const host_info& host)
-        : window(std::move(w)), hostname(host.name)
-        , platform(host.platform)
-        , filename()
-        , state_string("idle")
-    {
-        window.on_expose([this](ti::window::expose_event& event) {
-            on_expose(event);
-            return true;
-        });
+void icecc_monitor::apply(const stream::job_state& s, const std::string& filename)
+{
+    auto item = jobs.find(s.id);
+    if (item == jobs.end()) {
+        item = jobs.emplace(s.id, job_info(*this, s.id, s.client_id, filename,
+                                           filename_table.intern(filename))).first;
     }
+    job_info& job = item->second;
+    job.state = static_cast<job_info::job_state>(s.state);
+    job.client_id = s.client_id;
+    job.server_id = s.server_id;
+    job.real_msec = s.real_msec;
+    job.user_msec = s.user_msec;
+    job.sys_msec = s.sys_msec;
+    job.page_faults = s.page_faults;
+    job.exit_code = s.exit_code;
+    job.submitted_usec = s.submitted_usec;
+    job.started_usec = s.started_usec;
+    _notify(job);
+    if (s.done())
+        jobs.erase(item);
+}
 
-    host_layout(host_layout&&) = default;
+static_assert(stream::job_state::finished == job_info::FINISHED
+              && stream::job_state::failed == job_info::FAILED,
+              "job states differ from those of the stream");
 
-    unsigned position() const {
-        return window.top();
-    }
+static stream::host_state stream_state(const host_info& host)
+{
+    return { host.id, host.name, host.platform, host.max_jobs, host.load, host.offline };
+}
 
-    void move_up() {
-        window.set_position(position() - 1, window.left());
-        window.root().expose();
-    }
+static stream::job_state stream_state(const job_info& job)
+{
+    return {
+        job.id, job.state, job.client_id, job.server_id, job.filename_id,
+        job.real_msec, job.user_msec, job.sys_msec, job.page_faults, job.exit_code,
+        job.submitted_usec, job.started_usec,
+    };
+}
+
+
+static inline int64_t now_sec()
+{
+    return now_usec() / 1000000;
+}
+
+static inline int64_t wall_msec()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ * Tracks which clients submit the most jobs, and which ones use the most
+ * remote compilation time, over sliding windows of up to one hour. Memory
+ * use is fixed, no matter how many clients there are.
+ */
+struct client_tracker {
+    static constexpr int64_t bucket_seconds = 30;
+    static constexpr size_t buckets = 120;
+    static constexpr size_t counters_per_bucket = 32;
+
+    using name_func = std::function<std::string(unsigned int)>;
+
+    client_tracker()
+        : jobs(buckets, bucket_seconds, counters_per_bucket)
+        , remote_msec(buckets, bucket_seconds, counters_per_bucket)
+    { }
+
+    void job_updated(const job_info& job, int64_t now) {
+        switch (job.state) {
+            case job_info::WAITING:
+            case job_info::LOCAL:
+                jobs.add(now, job.client_id);
+                break;
+            case job_info::FINISHED:
+                if (job.server_id)
+                    remote_msec.add(now, job.client_id, job.real_msec);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void report(std::vector<std::string>& lines, int64_t now, name_func name_for, size_t count = 10) {
+        report_section(lines, "Jobs submitted", jobs, now, name_for, count, 1);
+        lines.emplace_back();
+        report_section(lines, "Remote compile seconds", remote_msec, now, name_for, count, 1000);
+    }
+
+private:
+    using sketch = util::sliding_space_saving<unsigned int>;
+
+    static void report_section(std::vector<std::string>& lines, const char* title, sketch& s,
+                               int64_t now, name_func& name_for, size_t count, uint64_t divisor) {
+        // Rank by the five minute window, show the others for context.
+        static constexpr size_t windows[] = { 60 / bucket_seconds, 300 / bucket_seconds, buckets };
+        auto ranked = s.top(now, windows[1], count);
+        std::vector<std::unordered_map<unsigned int, uint64_t>> totals;
+        for (auto w: windows) {
+            totals.emplace_back();
+            for (auto& c: s.top(now, w, counters_per_bucket))
+                totals.back()[c.key] = c.count;
+        }
+
+        char buffer[160];
+        snprintf(buffer, sizeof(buffer), "%-32s %10s %10s %10s", title, "1 min", "5 min", "1 hour");
+        lines.emplace_back(buffer);
+        for (auto& c: ranked) {
+            uint64_t values[3];
+            for (size_t i = 0; i < 3; i++) {
+                auto item = totals[i].find(c.key);
+                values[i] = (item == totals[i].end()) ? 0 : item->second / divisor;
+            }
+            snprintf(buffer, sizeof(buffer), "%-32s %10llu %10llu %10llu",
+                     name_for(c.key).c_str(),
+                     static_cast<unsigned long long>(values[0]),
+                     static_cast<unsigned long long>(values[1]),
+                     static_cast<unsigned long long>(values[2]));
+            lines.emplace_back(buffer);
+        }
+    }
+
+    sketch jobs;
+    sketch remote_msec;
+};
+
+
+/*
+ * Groups the jobs of each client into build sessions, which end after a
+ * minute without jobs, and measures how well each session used the
+ * cluster: remote jobs running at once (on average and at the peak), the
+ * share of jobs compiled locally, the time jobs waited for a server, and
+ * the compile time offloaded. Everything is updated as jobs change state.
+ */
+struct session_tracker {
+    static constexpr int64_t idle_gap_usec = 60 * 1000 * 1000;
+    static constexpr size_t finished_count = 20;
+
+    using name_func = std::function<std::string(unsigned int)>;
+    using predict_func = std::function<uint32_t(uint32_t file, unsigned int server_id)>;
+
+    struct session {
+        unsigned int client_id;
+        int64_t      start_usec;
+        int64_t      last_usec;         // Last time a job changed state.
+        unsigned     remote_jobs;
+        unsigned     local_jobs;
+        unsigned     failed_jobs;
+        unsigned     waiting;
+        unsigned     running_remote;
+        unsigned     running_local;
+        unsigned     peak_remote;
+        uint64_t     remote_busy_usec;  // Remote jobs running, over time.
+        uint64_t     wait_usec;
+        unsigned     waits;
+        uint64_t     offloaded_msec;
+
+        bool idle(int64_t now) const {
+            return !waiting && !running_remote && !running_local && now - last_usec >= idle_gap_usec;
+        }
+
+        int64_t duration_usec(int64_t now) const {
+            return (idle(now) ? last_usec : now) - start_usec;
+        }
+
+        // Mean number of remote jobs running at once.
+        double parallelism(int64_t now) const {
+            auto duration = duration_usec(now);
+            if (duration <= 0)
+                return 0;
+            auto busy = remote_busy_usec + running_remote * static_cast<uint64_t>(std::max<int64_t>(0, now - last_usec));
+            return double(busy) / duration;
+        }
+    };
+
+    void job_updated(const job_info& job, int64_t now) {
+        auto item = jobs.find(job.id);
+        switch (job.state) {
+            case job_info::WAITING:
+                if (item == jobs.end()) {
+                    auto& s = touch(job.client_id, now);
+                    s.waiting++;
+                    jobs.emplace(job.id, tracked_job { job.client_id, job_info::WAITING, job.filename_id, 0, now });
+                }
+                break;
+            case job_info::LOCAL:
+            case job_info::COMPILING: {
+                if (item != jobs.end() && item->second.state != job_info::WAITING)
+                    break;
+                auto& s = touch(job.client_id, now);
+                if (item == jobs.end()) {
+                    item = jobs.emplace(job.id, tracked_job { job.client_id, job.state, job.filename_id, 0, now }).first;
+                } else {
+                    s.waiting--;
+                    item->second.state = job.state;
+                }
+                item->second.server_id = job.server_id;
+                item->second.started_usec = job.started_usec ? job.started_usec : now;
+                if (job.state == job_info::LOCAL) {
+                    s.local_jobs++;
+                    s.running_local++;
+                } else {
+                    s.remote_jobs++;
+                    s.running_remote++;
+                    s.peak_remote = std::max(s.peak_remote, s.running_remote);
+                    if (job.submitted_usec && job.started_usec > job.submitted_usec) {
+                        s.wait_usec += job.started_usec - job.submitted_usec;
+                        s.waits++;
+                    }
+                }
+                break;
+            }
+            case job_info::FINISHED:
+            case job_info::FAILED: {
+                if (item == jobs.end())
+                    break;
+                auto tracked = item->second;
+                jobs.erase(item);
+                auto& s = touch(tracked.client_id, now);
+                switch (tracked.state) {
+                    case job_info::WAITING: s.waiting--; break;
+                    case job_info::LOCAL: s.running_local--; break;
+                    default: s.running_remote--; break;
+                }
+                if (job.state == job_info::FAILED)
+                    s.failed_jobs++;
+                else if (tracked.state == job_info::COMPILING)
+                    s.offloaded_msec += job.real_msec;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    /*
+     * The ETA of a session is the predicted time left for its running jobs,
+     * plus that of its waiting ones, over the number of jobs it is running.
+     */
+    void report(std::vector<std::string>& lines, int64_t now, name_func name_for, unsigned slots,
+                predict_func predict) {
+        for (auto item = open.begin(); item != open.end(); ) {
+            if (item->second.idle(now)) {
+                close(item->second);
+                item = open.erase(item);
+            } else {
+                ++item;
+            }
+        }
+
+        std::vector<const session*> shown;
+        for (auto& item: open)
+            shown.push_back(&item.second);
+        std::sort(shown.begin(), shown.end(), [](const session* a, const session* b) {
+            return a->start_usec > b->start_usec;
+        });
+        for (auto item = finished.rbegin(); item != finished.rend(); ++item)
+            shown.push_back(&*item);
+
+        std::unordered_map<unsigned int, uint64_t> remaining_msec;
+        for (auto& item: jobs) {
+            auto& j = item.second;
+            int64_t msec = predict(j.filename_id, j.server_id);
+            if (j.state != job_info::WAITING)
+                msec = std::max<int64_t>(0, msec - (now - j.started_usec) / 1000);
+            remaining_msec[j.client_id] += msec;
+        }
+
+        char buffer[160];
+        snprintf(buffer, sizeof(buffer), "Cluster slots: %u. Sessions end after %llds without jobs.",
+                 slots, static_cast<long long>(idle_gap_usec / 1000000));
+        lines.emplace_back(buffer);
+        lines.emplace_back();
+        snprintf(buffer, sizeof(buffer), "%-24s %8s %7s %7s %6s %6s %5s %6s %8s %10s %6s %8s",
+                 "Client", "Duration", "Remote", "Local", "Local%", "Mean", "Peak", "Farm",
+                 "Wait", "Offloaded", "Failed", "ETA");
+        lines.emplace_back(buffer);
+        for (auto s: shown) {
+            auto total = s->remote_jobs + s->local_jobs;
+            auto parallelism = s->parallelism(now);
+            auto seconds = s->duration_usec(now) / 1000000;
+            char duration[16];
+            snprintf(duration, sizeof(duration), "%lld:%02lld%s", static_cast<long long>(seconds / 60),
+                     static_cast<long long>(seconds % 60), s->idle(now) ? "" : "+");
+            char eta[16] = "-";
+            auto running = s->running_remote + s->running_local;
+            auto remaining = remaining_msec.find(s->client_id);
+            if (!s->idle(now) && running && remaining != remaining_msec.end()) {
+                auto left = remaining->second / 1000 / running;
+                snprintf(eta, sizeof(eta), "%llu:%02llu", static_cast<unsigned long long>(left / 60),
+                         static_cast<unsigned long long>(left % 60));
+            }
+            snprintf(buffer, sizeof(buffer), "%-24.24s %8s %7u %7u %5.0f%% %6.1f %5u %5.0f%% %7.2fs %9.0fs %6u %8s",
+                     name_for(s->client_id).c_str(), duration, s->remote_jobs, s->local_jobs,
+                     total ? 100.0 * s->local_jobs / total : 0.0, parallelism, s->peak_remote,
+                     slots ? 100.0 * parallelism / slots : 0.0,
+                     s->waits ? s->wait_usec / 1e6 / s->waits : 0.0,
+                     s->offloaded_msec / 1000.0, s->failed_jobs, eta);
+            lines.emplace_back(buffer);
+        }
+        if (shown.empty())
+            lines.emplace_back("No build sessions yet.");
+    }
+
+    void mark_filenames(util::string_table::in_use& in_use) const {
+        for (auto& item: jobs)
+            in_use.mark(item.second.filename_id);
+    }
+
+private:
+    struct tracked_job {
+        unsigned int         client_id;
+        job_info::job_state  state;
+        uint32_t             filename_id;
+        unsigned int         server_id;
+        int64_t              started_usec;  // Or submitted, while waiting.
+    };
+
+    // Returns the open session of the client, after accounting for the time
+    // since its last change; starts a new session after an idle gap.
+    session& touch(unsigned int client_id, int64_t now) {
+        auto item = open.find(client_id);
+        if (item != open.end() && item->second.idle(now)) {
+            close(item->second);
+            open.erase(item);
+            item = open.end();
+        }
+        if (item == open.end()) {
+            session s {};
+            s.client_id = client_id;
+            s.start_usec = s.last_usec = now;
+            item = open.emplace(client_id, s).first;
+        }
+        auto& s = item->second;
+        if (now > s.last_usec) {
+            s.remote_busy_usec += s.running_remote * static_cast<uint64_t>(now - s.last_usec);
+            s.last_usec = now;
+        }
+        return s;
+    }
+
+    void close(const session& s) {
+        finished.push_back(s);
+        if (finished.size() > finished_count)
+            finished.pop_front();
+    }
+
+    std::unordered_map<unsigned int, session>     open;     // By client.
+    std::deque<session>                           finished;
+    std::unordered_map<unsigned int, tracked_job> jobs;     // Jobs in flight.
+};
+
+
+/*
+ * Jobs waiting for the scheduler to place them, oldest first. Jobs arrive
+ * in submission order, so appending keeps the list sorted, and the index
+ * allows removing any of them when it starts. Start times are estimated
+ * from the rate at which jobs started over the last minute, and the slots
+ * free right now.
+ */
+struct job_queue {
+    static constexpr size_t rate_seconds = 60;
+    static constexpr size_t shown_jobs = 200;
+    static constexpr size_t shown_clients = 10;
+
+    using name_func = std::function<std::string(unsigned int)>;
+
+    struct entry {
+        unsigned int id;
+        unsigned int client_id;
+        uint32_t     filename_id;
+        int64_t      submitted_usec;
+    };
+
+    job_queue()
+        : starts(rate_seconds, 0)
+        , last_second(0)
+    { }
+
+    void job_updated(const job_info& job, int64_t now) {
+        if (job.state == job_info::WAITING) {
+            if (index.count(job.id))
+                return;
+            queue.push_back({ job.id, job.client_id, job.filename_id,
+                              job.submitted_usec ? job.submitted_usec : now });
+            index.emplace(job.id, std::prev(queue.end()));
+            per_client[job.client_id]++;
+            return;
+        }
+
+        if (job.state == job_info::COMPILING)
+            count_start(now);
+
+        auto item = index.find(job.id);
+        if (item == index.end())
+            return;
+        auto client = per_client.find(item->second->client_id);
+        if (client != per_client.end() && !--client->second)
+            per_client.erase(client);
+        queue.erase(item->second);
+        index.erase(item);
+    }
+
+    size_t size() const { return queue.size(); }
+
+    // Jobs started per second over the last minute.
+    double start_rate(int64_t now) {
+        count_start(now, 0);
+        uint64_t total = 0;
+        for (auto n: starts)
+            total += n;
+        return double(total) / rate_seconds;
+    }
+
+    // Seconds until the job at the given position (zero is the oldest)
+    // starts, or a negative value when nothing has started lately.
+    double estimate(size_t position, unsigned free_slots, double rate) const {
+        if (position < free_slots)
+            return 0;
+        if (rate <= 0)
+            return -1;
+        return (position - free_slots + 1) / rate;
+    }
+
+    void report(std::vector<std::string>& lines, unsigned columns, int64_t now,
+                name_func name_for, const util::string_table& filenames, unsigned free_slots) {
+        auto rate = start_rate(now);
+        char buffer[160];
+        snprintf(buffer, sizeof(buffer), "%zu jobs waiting, oldest %.1fs. %u free slots, %.1f jobs/s started.",
+                 queue.size(), queue.empty() ? 0.0 : (now - queue.front().submitted_usec) / 1e6,
+                 free_slots, rate);
+        lines.emplace_back(buffer);
+        if (queue.empty())
+            return;
+
+        std::vector<std::pair<unsigned int, size_t>> clients(per_client.begin(), per_client.end());
+        std::sort(clients.begin(), clients.end(), [](const std::pair<unsigned int, size_t>& a,
+                                                     const std::pair<unsigned int, size_t>& b) {
+            return a.second > b.second;
+        });
+        if (clients.size() > shown_clients)
+            clients.resize(shown_clients);
+        lines.emplace_back();
+        snprintf(buffer, sizeof(buffer), "%-32s %8s", "Client", "Waiting");
+        lines.emplace_back(buffer);
+        for (auto& c: clients) {
+            snprintf(buffer, sizeof(buffer), "%-32.32s %8zu", name_for(c.first).c_str(), c.second);
+            lines.emplace_back(buffer);
+        }
+
+        lines.emplace_back();
+        snprintf(buffer, sizeof(buffer), "%8s %8s %-24s ", "Age", "Start in", "Client");
+        lines.emplace_back(std::string(buffer) + "File");
+        size_t position = 0;
+        for (auto& e: queue) {
+            if (position == shown_jobs)
+                break;
+            char eta[16];
+            auto seconds = estimate(position++, free_slots, rate);
+            if (seconds < 0)
+                snprintf(eta, sizeof(eta), "?");
+            else
+                snprintf(eta, sizeof(eta), "%.1fs", seconds);
+            snprintf(buffer, sizeof(buffer), "%7.1fs %8s %-24.24s ",
+                     (now - e.submitted_usec) / 1e6, eta, name_for(e.client_id).c_str());
+            std::string line(buffer);
+            auto& name = filenames.lookup(e.filename_id);
+            auto room = (columns > line.size() + 2) ? columns - line.size() - 2 : 0;
+            if (name.size() > room && room > 3)
+                line += "..." + name.substr(name.size() - room + 3);
+            else
+                line += name;
+            lines.emplace_back(std::move(line));
+        }
+        if (queue.size() > shown_jobs)
+            lines.emplace_back("... and " + std::to_string(queue.size() - shown_jobs) + " more");
+    }
+
+    void mark_filenames(util::string_table::in_use& in_use) const {
+        for (auto& e: queue)
+            in_use.mark(e.filename_id);
+    }
+
+private:
+    // One bucket per second; buckets are cleared as time passes them.
+    void count_start(int64_t now, unsigned n = 1) {
+        auto second = now / 1000000;
+        if (second - last_second >= static_cast<int64_t>(rate_seconds)) {
+            std::fill(starts.begin(), starts.end(), 0);
+        } else {
+            for (auto s = last_second + 1; s <= second; s++)
+                starts[s % rate_seconds] = 0;
+        }
+        if (second > last_second)
+            last_second = second;
+        starts[last_second % rate_seconds] += n;
+    }
+
+    std::list<entry>                                              queue;
+    std::unordered_map<unsigned int, std::list<entry>::iterator>  index;
+    std::unordered_map<unsigned int, size_t>                      per_client;
+    std::vector<unsigned>                                         starts;
+    int64_t                                                       last_second;
+};
+
+
+/*
+ * Detects files compiled again within ten minutes of a previous job for
+ * the same file, either from the same client (retries, rebuilds) or from
+ * another one (several CI workers building the same commit). Recent files
+ * are remembered in sliding Bloom filters, so memory use is fixed however
+ * many jobs there are, at the cost of some false positives: a lookup checks
+ * all ten filters, which at 60000 jobs per minute gives about 0.6%.
+ */
+struct redundancy_tracker {
+    static constexpr int64_t bucket_seconds = 60;
+    static constexpr size_t buckets = 10;
+    static constexpr size_t bits_per_bucket = 1 << 20;
+    static constexpr unsigned hashes = 6;
+    static constexpr size_t counters_per_bucket = 32;
+
+    using name_func = std::function<std::string(unsigned int)>;
+
+    struct counts {
+        uint64_t jobs;
+        uint64_t duplicates;   // Any client.
+        uint64_t retries;      // Same client.
+        uint64_t wasted_msec;  // Compiling duplicates remotely.
+    };
+
+    redundancy_tracker()
+        : any_client(buckets, bucket_seconds, bits_per_bucket, hashes)
+        , same_client(buckets, bucket_seconds, bits_per_bucket, hashes)
+        , files(buckets, bucket_seconds, counters_per_bucket)
+        , clients(buckets, bucket_seconds, counters_per_bucket)
+    { }
+
+    void job_updated(const job_info& job, int64_t now) {
+        switch (job.state) {
+            case job_info::WAITING:
+            case job_info::LOCAL: {
+                if (!seen.insert(job.id).second)
+                    break;
+                // By name: identifiers of file names are reused once swept,
+                // and these filters cannot tell which ones they still hold.
+                uint64_t file_key = std::hash<std::string>()(job.filename);
+                auto client_key = file_key ^ (uint64_t(job.client_id) * 0x9e3779b97f4a7c15ull);
+                bool duplicate = any_client.contains(now, file_key);
+                bool retry = duplicate && same_client.contains(now, client_key);
+                any_client.add(now, file_key);
+                same_client.add(now, client_key);
+
+                auto& c = bucket(now);
+                c.jobs++;
+                if (duplicate) {
+                    c.duplicates++;
+                    c.retries += retry;
+                    files.add(now, job.filename_id);
+                    clients.add(now, job.client_id);
+                    duplicates.insert(job.id);
+                }
+                break;
+            }
+            case job_info::FINISHED:
+            case job_info::FAILED:
+                seen.erase(job.id);
+                if (duplicates.erase(job.id) && job.server_id)
+                    bucket(now).wasted_msec += job.real_msec;
+                break;
+            default:
+                break;
+        }
+    }
+
+    counts total(int64_t now, size_t last_buckets = buckets) const {
+        counts result = { 0, 0, 0, 0 };
+        auto epoch = now / bucket_seconds;
+        for (auto& b: slots) {
+            if (epoch - b.epoch < static_cast<int64_t>(last_buckets)) {
+                result.jobs += b.c.jobs;
+                result.duplicates += b.c.duplicates;
+                result.retries += b.c.retries;
+                result.wasted_msec += b.c.wasted_msec;
+            }
+        }
+        return result;
+    }
+
+    void report(std::vector<std::string>& lines, unsigned columns, int64_t now,
+                name_func name_for, const util::string_table& filenames, size_t count = 10) {
+        char buffer[160];
+        snprintf(buffer, sizeof(buffer), "%-12s %10s %10s %7s %10s %7s %12s",
+                 "", "Jobs", "Duplicates", "", "Same host", "", "Wasted");
+        lines.emplace_back(buffer);
+        for (auto window: { size_t(1), buckets }) {
+            auto c = total(now, window);
+            char title[16];
+            snprintf(title, sizeof(title), "Last %zu min", window);
+            snprintf(buffer, sizeof(buffer), "%-12s %10llu %10llu %6.1f%% %10llu %6.1f%% %11.0fs",
+                     title, static_cast<unsigned long long>(c.jobs),
+                     static_cast<unsigned long long>(c.duplicates),
+                     c.jobs ? 100.0 * c.duplicates / c.jobs : 0.0,
+                     static_cast<unsigned long long>(c.retries),
+                     c.jobs ? 100.0 * c.retries / c.jobs : 0.0, c.wasted_msec / 1000.0);
+            lines.emplace_back(buffer);
+        }
+
+        lines.emplace_back();
+        snprintf(buffer, sizeof(buffer), "%-32s %10s", "Client", "Duplicates");
+        lines.emplace_back(buffer);
+        for (auto& c: clients.top(now, buckets, count)) {
+            snprintf(buffer, sizeof(buffer), "%-32.32s %10llu", name_for(c.key).c_str(),
+                     static_cast<unsigned long long>(c.count));
+            lines.emplace_back(buffer);
+        }
+
+        lines.emplace_back();
+        snprintf(buffer, sizeof(buffer), "%10s  ", "Duplicates");
+        lines.emplace_back(std::string(buffer) + "File");
+        for (auto& c: files.top(now, buckets, count)) {
+            snprintf(buffer, sizeof(buffer), "%10llu  ", static_cast<unsigned long long>(c.count));
+            std::string line(buffer);
+            auto& name = filenames.lookup(c.key);
+            auto room = (columns > line.size() + 2) ? columns - line.size() - 2 : 0;
+            if (name.size() > room && room > 3)
+                line += "..." + name.substr(name.size() - room + 3);
+            else
+                line += name;
+            lines.emplace_back(std::move(line));
+        }
+    }
+
+    void mark_filenames(util::string_table::in_use& in_use) const {
+        files.for_each_key([&in_use](uint32_t file) { in_use.mark(file); });
+    }
+
+private:
+    struct slot {
+        int64_t epoch;
+        counts  c;
+    };
+
+    counts& bucket(int64_t now) {
+        auto epoch = now / bucket_seconds;
+        auto& b = slots[epoch % buckets];
+        if (b.epoch != epoch)
+            b = { epoch, { 0, 0, 0, 0 } };
+        return b.c;
+    }
+
+    util::sliding_bloom                       any_client;
+    util::sliding_bloom                       same_client;
+    util::sliding_space_saving<unsigned int>  files;
+    util::sliding_space_saving<unsigned int>  clients;
+    std::unordered_set<unsigned int>          seen;        // Jobs in flight.
+    std::unordered_set<unsigned int>          duplicates;  // Of those.
+    slot                                      slots[buckets] = { };
+};
+
+
+/*
+ * Compilation time aggregates per file, keyed by interned file name, plus
+ * the files with the slowest mean compilation time. The table is bounded:
+ * when full, the entry updated longest ago is evicted, unless it is among
+ * the slowest files.
+ */
+struct file_stats {
+    struct entry {
+        uint32_t file;
+        uint32_t count;
+        uint64_t total_msec;
+        uint32_t max_msec;
+        uint32_t last_msec;
+
+        uint32_t mean_msec() const { return count ? total_msec / count : 0; }
+    };
+
+    file_stats(size_t capacity_ = 16 * 1024, size_t top_count = 100)
+        : capacity(capacity_)
+        , slowest(top_count)
+    {
+        assert(capacity > top_count);
+    }
+
+    void job_finished(uint32_t file, uint32_t real_msec) {
+        auto item = index.find(file);
+        if (item == index.end()) {
+            lru.push_front({ file, 0, 0, 0, 0 });
+            item = index.emplace(file, lru.begin()).first;
+            evict();
+        } else {
+            lru.splice(lru.begin(), lru, item->second);
+        }
+
+        auto& e = *item->second;
+        e.count++;
+        e.total_msec += real_msec;
+        e.max_msec = std::max(e.max_msec, real_msec);
+        e.last_msec = real_msec;
+        slowest.update(file, e.mean_msec());
+    }
+
+    const entry* find(uint32_t file) const {
+        auto item = index.find(file);
+        return (item == index.end()) ? nullptr : &*item->second;
+    }
+
+    size_t size() const { return lru.size(); }
+
+    void save(snapshot::writer& w, const util::string_table& filenames) const {
+        w.section(SNAPSHOT_FILES);
+        // Least recent first, so loading them keeps the order.
+        for (auto e = lru.rbegin(); e != lru.rend(); ++e) {
+            w.shared_str(filenames.lookup(e->file));
+            w.u64(e->count);
+            w.u64(e->total_msec);
+            w.u64(e->max_msec);
+            w.u64(e->last_msec);
+        }
+    }
+
+    void load(snapshot::reader& r, std::function<uint32_t(const std::string&)> intern) {
+        if (!r.section(SNAPSHOT_FILES))
+            return;
+        while (r.more()) {
+            entry e;
+            e.file = intern(r.shared_str());
+            e.count = r.u64();
+            e.total_msec = r.u64();
+            e.max_msec = r.u64();
+            e.last_msec = r.u64();
+            if (!r.ok() || index.count(e.file))
+                break;
+            lru.push_front(e);
+            index.emplace(e.file, lru.begin());
+            slowest.update(e.file, e.mean_msec());
+            evict();
+        }
+    }
+
+    void report(std::vector<std::string>& lines, unsigned columns,
+                const util::string_table& filenames) const {
+        char buffer[80];
+        snprintf(buffer, sizeof(buffer), "%9s %9s %9s %7s %11s  ",
+                 "Mean", "Max", "Last", "Count", "Total");
+        lines.emplace_back(std::string(buffer) + "File");
+        for (auto& item: slowest.sorted()) {
+            auto e = find(item.first);
+            assert(e);
+            snprintf(buffer, sizeof(buffer), "%8.2fs %8.2fs %8.2fs %7u %10.1fs  ",
+                     e->mean_msec() / 1000.0, e->max_msec / 1000.0, e->last_msec / 1000.0,
+                     e->count, e->total_msec / 1000.0);
+            std::string line(buffer);
+            auto& name = filenames.lookup(e->file);
+            // Keep the end of long paths, which is the interesting part.
+            auto room = (columns > line.size() + 2) ? columns - line.size() - 2 : 0;
+            if (name.size() > room && room > 3)
+                line += "..." + name.substr(name.size() - room + 3);
+            else
+                line += name;
+            lines.emplace_back(std::move(line));
+        }
+    }
+
+    // Writes all the entries as tab-separated values, by descending total.
+    void dump(FILE* output, const util::string_table& filenames) const {
+        std::vector<const entry*> entries;
+        entries.reserve(lru.size());
+        for (auto& e: lru)
+            entries.push_back(&e);
+        std::sort(entries.begin(), entries.end(), [](const entry* a, const entry* b) {
+            return a->total_msec > b->total_msec;
+        });
+        fprintf(output, "file\tcount\ttotal_msec\tmean_msec\tmax_msec\tlast_msec\n");
+        for (auto e: entries) {
+            fprintf(output, "%s\t%u\t%llu\t%u\t%u\t%u\n",
+                    filenames.lookup(e->file).c_str(), e->count,
+                    static_cast<unsigned long long>(e->total_msec),
+                    e->mean_msec(), e->max_msec, e->last_msec);
+        }
+    }
+
+    void mark_filenames(util::string_table::in_use& in_use) const {
+        for (auto& e: lru)
+            in_use.mark(e.file);
+    }
+
+private:
+    void evict() {
+        while (lru.size() > capacity) {
+            auto last = std::prev(lru.end());
+            if (slowest.contains(last->file)) {
+                lru.splice(lru.begin(), lru, last);
+                continue;
+            }
+            index.erase(last->file);
+            lru.erase(last);
+        }
+    }
+
+    size_t                                                capacity;
+    std::list<entry>                                      lru;  // Most recent first.
+    std::unordered_map<uint32_t, std::list<entry>::iterator> index;
+    util::top_k<uint32_t, uint32_t>                       slowest;
+};
+
+
+/*
+ * Jobs and failures per server over a sliding window of fixed-size time
+ * buckets, also split by exit code. A server is flagged when it fails a
+ * much larger share of its jobs than the rest of the cluster, and stays
+ * flagged until its failure rate gets back close to the baseline.
+ */
+struct failure_tracker {
+    static constexpr int64_t bucket_seconds = 30;
+    static constexpr size_t buckets = 20;  // Ten minutes.
+    static constexpr int64_t evaluate_seconds = 5;
+    static constexpr uint32_t min_failures = 5;
+    static constexpr double min_baseline = 0.02;
+
+    struct counts {
+        uint32_t jobs;
+        uint32_t failed;
+
+        double rate() const { return jobs ? double(failed) / jobs : 0; }
+    };
+
+    struct sliding_counts {
+        struct bucket {
+            int64_t epoch;
+            counts  c;
+        };
+        bucket slots[buckets] = { };
+
+        void add(int64_t now, bool failed) {
+            auto epoch = now / bucket_seconds;
+            auto& b = slots[epoch % buckets];
+            if (b.epoch != epoch)
+                b = { epoch, { 0, 0 } };
+            b.c.jobs++;
+            b.c.failed += failed;
+        }
+
+        counts total(int64_t now) const {
+            auto epoch = now / bucket_seconds;
+            counts result = { 0, 0 };
+            for (auto& b: slots) {
+                if (epoch - b.epoch < static_cast<int64_t>(buckets)) {
+                    result.jobs += b.c.jobs;
+                    result.failed += b.c.failed;
+                }
+            }
+            return result;
+        }
+    };
+
+    struct server {
+        sliding_counts                         jobs;
+        std::unordered_map<int, sliding_counts> exit_codes;
+        bool                                   flagged = false;
+    };
+
+    // Called with the host identifier and the new state of its flag.
+    using flag_func = std::function<void(unsigned int, bool, counts, double)>;
+
+    failure_tracker(): last_evaluation(0) { }
+
+    void job_updated(const job_info& job, int64_t now) {
+        if (!job.server_id || (job.state != job_info::FINISHED && job.state != job_info::FAILED))
+            return;
+        bool failed = job.state == job_info::FAILED;
+        auto& s = servers[job.server_id];
+        s.jobs.add(now, failed);
+        if (failed)
+            s.exit_codes[job.exit_code].add(now, true);
+        cluster.add(now, failed);
+    }
+
+    // Updates the flags, at most every few seconds.
+    void evaluate(int64_t now, flag_func on_flag_changed) {
+        if (now - last_evaluation < evaluate_seconds)
+            return;
+        last_evaluation = now;
+
+        auto all = cluster.total(now);
+        for (auto& item: servers) {
+            auto& s = item.second;
+            auto c = s.jobs.total(now);
+            auto baseline = baseline_for(all, c);
+            bool flag = s.flagged ? (score(c, baseline) >= 2.0)
+                                  : (score(c, baseline) >= 4.0 && c.rate() >= 2 * baseline);
+            if (flag != s.flagged) {
+                s.flagged = flag;
+                on_flag_changed(item.first, flag, c, baseline);
+            }
+            for (auto code = s.exit_codes.begin(); code != s.exit_codes.end(); ) {
+                if (code->second.total(now).failed == 0)
+                    code = s.exit_codes.erase(code);
+                else
+                    ++code;
+            }
+        }
+    }
+
+    void report(std::vector<std::string>& lines, int64_t now,
+                std::function<std::string(unsigned int)> host_name) const {
+        auto all = cluster.total(now);
+        char buffer[100];
+        snprintf(buffer, sizeof(buffer), "Cluster: %u jobs, %u failed (%.1f%%) in the last %lld minutes",
+                 all.jobs, all.failed, all.rate() * 100,
+                 static_cast<long long>(buckets * bucket_seconds / 60));
+        lines.emplace_back(buffer);
+        lines.emplace_back();
+
+        struct row {
+            unsigned int id;
+            counts       c;
+            bool         flagged;
+        };
+        std::vector<row> rows;
+        for (auto& item: servers) {
+            auto c = item.second.jobs.total(now);
+            if (c.failed)
+                rows.push_back({ item.first, c, item.second.flagged });
+        }
+        std::sort(rows.begin(), rows.end(), [](const row& a, const row& b) {
+            return a.c.rate() > b.c.rate();
+        });
+
+        snprintf(buffer, sizeof(buffer), "  %-24s %7s %7s %7s  %s", "Server", "Jobs", "Failed", "Rate",
+                 "Exit code:failures");
+        lines.emplace_back(buffer);
+        for (auto& r: rows) {
+            std::string codes;
+            for (auto& code: servers.at(r.id).exit_codes) {
+                auto failed = code.second.total(now).failed;
+                if (failed)
+                    codes += " " + std::to_string(code.first) + ":" + std::to_string(failed);
+            }
+            snprintf(buffer, sizeof(buffer), "%c %-24s %7u %7u %6.1f%% ",
+                     r.flagged ? '!' : ' ', host_name(r.id).c_str(),
+                     r.c.jobs, r.c.failed, r.c.rate() * 100);
+            lines.emplace_back(buffer + codes);
+        }
+    }
+
+private:
+    // Failure rate of the rest of the cluster, so a broken server with many
+    // jobs does not raise the baseline it is compared against.
+    static double baseline_for(counts all, counts c) {
+        auto jobs = all.jobs - c.jobs;
+        auto failed = all.failed - c.failed;
+        return std::max(min_baseline, jobs ? double(failed) / jobs : 0);
+    }
+
+    // How many standard deviations above the baseline the failure rate is.
+    static double score(counts c, double baseline) {
+        if (c.failed < min_failures)
+            return 0;
+        return (c.rate() - baseline) / std::sqrt(baseline * (1 - baseline) / c.jobs);
+    }
+
+    sliding_counts                          cluster;
+    std::unordered_map<unsigned int, server> servers;
+    int64_t                                 last_evaluation;
+};
+
+
+/*
+ * Scores how much slower each server compiles than its peers, using the
+ * ratio of each job's real time to the median time of the same file over
+ * the last jobs which compiled it anywhere in the cluster. Ratios are kept
+ * as an EWMA of their logarithm, so the score is a typical slowdown factor.
+ * The CPU share of the real time, page faults, and reported load are kept
+ * as EWMAs too, as hints of why a server is slow. All the updates for a
+ * finished job are constant time.
+ */
+struct health_tracker {
+    static constexpr double alpha = 0.1;
+    static constexpr double cluster_alpha = 0.01;
+    static constexpr unsigned min_jobs = 8;
+    static constexpr double slow_factor = 2.0;
+    static constexpr double recovered_factor = 1.5;
+    static constexpr size_t reference_slots = 16 * 1024;
+    static constexpr size_t reference_samples = 15;
+    static constexpr size_t min_reference_samples = 3;
+
+    struct server {
+        unsigned int jobs        = 0;  // With a reference time.
+        double       log_slowdown = 0;
+        double       cpu_ratio   = 0;
+        double       page_faults = 0;
+        double       load        = 0;
+        unsigned int max_jobs    = 0;
+        bool         slow        = false;
+
+        double slowdown() const { return std::exp2(log_slowdown); }
+    };
+
+    health_tracker(): references(reference_slots), cluster_cpu_ratio(0), cluster_page_faults(0) { }
+
+    // Returns whether the server started or stopped being slow.
+    bool job_finished(const job_info& job) {
+        if (!job.server_id || job.state != job_info::FINISHED || !job.real_msec)
+            return false;
+
+        auto& s = servers[job.server_id];
+        double cpu_ratio = std::min(4.0, double(job.user_msec + job.sys_msec) / job.real_msec);
+        update(s.cpu_ratio, cpu_ratio, alpha, s.jobs == 0);
+        update(s.page_faults, job.page_faults, alpha, s.jobs == 0);
+        update(cluster_cpu_ratio, cpu_ratio, cluster_alpha, false);
+        update(cluster_page_faults, job.page_faults, cluster_alpha, false);
+
+        auto& ref = reference_for(job.filename_id);
+        if (ref.count >= min_reference_samples) {
+            uint32_t sorted[reference_samples];
+            std::copy(ref.samples, ref.samples + ref.count, sorted);
+            std::nth_element(sorted, sorted + ref.count / 2, sorted + ref.count);
+            auto median = std::max(1u, sorted[ref.count / 2]);
+            // Clamped, so a single pathological job cannot dominate.
+            auto ratio = std::min(16.0, std::max(1 / 16.0, double(job.real_msec) / median));
+            update(s.log_slowdown, std::log2(ratio), alpha, s.jobs == 0);
+            s.jobs++;
+        }
+        ref.samples[ref.next] = job.real_msec;
+        ref.next = (ref.next + 1) % reference_samples;
+        ref.count = std::min(ref.count + 1, reference_samples);
+
+        bool slow = s.jobs >= min_jobs
+            && s.slowdown() >= (s.slow ? recovered_factor : slow_factor);
+        if (slow == s.slow)
+            return false;
+        s.slow = slow;
+        return true;
+    }
+
+    void host_updated(const host_info& host) {
+        if (host.offline)
+            return;
+        auto& s = servers[host.id];
+        // The scheduler considers a host fully loaded at 1000.
+        update(s.load, std::min(host.load, 1000) / 1000.0, alpha, false);
+        s.max_jobs = host.max_jobs;
+    }
+
+    const server* find(unsigned int id) const {
+        auto item = servers.find(id);
+        return (item == servers.end()) ? nullptr : &item->second;
+    }
+
+    void report(std::vector<std::string>& lines,
+                std::function<std::string(unsigned int)> host_name) const {
+        std::vector<std::pair<unsigned int, const server*>> ranked;
+        for (auto& item: servers) {
+            if (item.second.jobs)
+                ranked.emplace_back(item.first, &item.second);
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const std::pair<unsigned int, const server*>& a,
+                                                   const std::pair<unsigned int, const server*>& b) {
+            return a.second->log_slowdown > b.second->log_slowdown;
+        });
+
+        char buffer[120];
+        snprintf(buffer, sizeof(buffer), "  %-24s %7s %8s %6s %7s %6s  %s",
+                 "Server", "Jobs", "Slowdown", "CPU", "Faults", "Load", "Hints");
+        lines.emplace_back(buffer);
+        for (auto& item: ranked) {
+            auto& s = *item.second;
+            double faults = cluster_page_faults > 0 ? s.page_faults / cluster_page_faults : 0;
+            std::string hints;
+            if (s.jobs < min_jobs) hints += " few-jobs";
+            if (cluster_cpu_ratio > 0 && s.cpu_ratio < cluster_cpu_ratio / 2) hints += " waiting-io";
+            if (faults > 4) hints += " paging";
+            if (s.load > 0.9) hints += " overloaded";
+            snprintf(buffer, sizeof(buffer), "%c %-24s %7u %7.2fx %5.0f%% %6.1fx %5.0f%% ",
+                     s.slow ? '*' : ' ', host_name(item.first).c_str(), s.jobs,
+                     s.slowdown(), s.cpu_ratio * 100, faults, s.load * 100);
+            lines.emplace_back(buffer + hints);
+        }
+    }
+
+    void mark_filenames(util::string_table::in_use& in_use) const {
+        for (auto& ref: references)
+            in_use.mark(ref.file);
+    }
+
+private:
+    struct file_reference {
+        uint32_t file;
+        size_t   count;
+        size_t   next;
+        uint32_t samples[reference_samples];
+    };
+
+    static void update(double& value, double sample, double weight, bool first) {
+        value = first ? sample : value + weight * (sample - value);
+    }
+
+    // Direct-mapped by file: a collision evicts the previous file.
+    file_reference& reference_for(uint32_t file) {
+        auto& ref = references[file % references.size()];
+        if (ref.file != file) {
+            ref.file = file;
+            ref.count = 0;
+            ref.next = 0;
+        }
+        return ref;
+    }
+
+    std::vector<file_reference>              references;
+    std::unordered_map<unsigned int, server> servers;
+    double                                   cluster_cpu_ratio;
+    double                                   cluster_page_faults;
+};
+
+
+/*
+ * Predicts how long jobs take to compile remotely, from the times observed
+ * for the same file on servers of the same platform, or on any server when
+ * that is all there is. Estimates are moving averages in direct-mapped
+ * tables, so memory is bounded and lookups take the same time however many
+ * files there are. Files not seen yet get the average of the platform.
+ */
+struct duration_predictor {
+    static constexpr double alpha = 0.3;
+    static constexpr size_t slots = 32 * 1024;
+
+    duration_predictor(): by_platform(slots), by_file(slots) { }
+
+    void job_finished(uint32_t file, const std::string& platform, uint32_t real_msec) {
+        auto id = platforms.intern(platform);
+        update(slot(by_platform, file, id), file, id, real_msec);
+        update(slot(by_file, file, 0), file, 0, real_msec);
+        for (auto key: { id, 0u }) {  // Zero is any platform.
+            auto& mean = platform_means[key];
+            mean = mean ? mean + alpha * (real_msec - mean) : real_msec;
+        }
+    }
+
+    // Milliseconds, or zero when there is nothing to go by. An empty
+    // platform stands for any server.
+    uint32_t predict(uint32_t file, const std::string& platform) const {
+        auto id = platform.empty() ? 0 : platforms.find(platform);
+        if (id) {
+            auto& e = slot(by_platform, file, id);
+            if (e.file == file && e.platform == id)
+                return e.msec;
+        }
+        auto& e = slot(by_file, file, 0);
+        if (e.file == file && e.msec > 0)
+            return e.msec;
+        auto mean = platform_means.find(id);
+        return (mean == platform_means.end()) ? 0 : mean->second;
+    }
+
+    void save(snapshot::writer& w, const util::string_table& filenames) const {
+        w.section(SNAPSHOT_DURATIONS);
+        w.u64(platform_means.size());
+        for (auto& item: platform_means) {
+            w.shared_str(platforms.lookup(item.first));
+            w.f64(item.second);
+        }
+        for (auto table: { &by_platform, &by_file }) {
+            for (auto& e: *table) {
+                if (!e.file)
+                    continue;
+                w.shared_str(filenames.lookup(e.file));
+                w.shared_str(platforms.lookup(e.platform));
+                w.f64(e.msec);
+            }
+        }
+    }
+
+    void load(snapshot::reader& r, std::function<uint32_t(const std::string&)> intern) {
+        if (!r.section(SNAPSHOT_DURATIONS))
+            return;
+        for (auto n = r.u64(); n && r.ok(); n--) {
+            auto& platform = r.shared_str();
+            auto mean = r.f64();
+            if (r.ok())
+                platform_means[platform.empty() ? 0 : platforms.intern(platform)] = mean;
+        }
+        while (r.more()) {
+            auto file = intern(r.shared_str());
+            auto& platform = r.shared_str();
+            auto msec = r.f64();
+            if (!r.ok())
+                break;
+            uint32_t id = platform.empty() ? 0 : platforms.intern(platform);
+            auto& e = slot(id ? by_platform : by_file, file, id);
+            e.file = file;
+            e.platform = id;
+            e.msec = msec;
+        }
+    }
+
+    void mark_filenames(util::string_table::in_use& in_use) const {
+        for (auto table: { &by_platform, &by_file }) {
+            for (auto& e: *table)
+                in_use.mark(e.file);
+        }
+    }
+
+private:
+    struct estimate {
+        uint32_t file     = 0;
+        uint32_t platform = 0;
+        float    msec     = 0;
+    };
+
+    template <typename Table>
+    static auto slot(Table& table, uint32_t file, uint32_t platform) -> decltype(table[0]) {
+        return table[(file * 31 + platform) % table.size()];
+    }
+
+    // A collision evicts the previous file.
+    static void update(estimate& e, uint32_t file, uint32_t platform, uint32_t real_msec) {
+        if (e.file != file || e.platform != platform) {
+            e.file = file;
+            e.platform = platform;
+            e.msec = real_msec;
+        } else {
+            e.msec += alpha * (real_msec - e.msec);
+        }
+    }
+
+    util::string_table                     platforms;
+    std::vector<estimate>                  by_platform;
+    std::vector<estimate>                  by_file;
+    std::unordered_map<uint32_t, double>   platform_means;
+};
+
+
+/*
+ * Slot occupancy (running jobs over max_jobs) of each host over time, as
+ * a percentage per time bucket, in one byte per host and bucket. All rows
+ * share the same circular head, so moving on to a new bucket writes one
+ * column instead of shifting data around.
+ */
+struct utilization_history {
+    static constexpr uint8_t no_data = 0xFF;
+
+    struct host_row {
+        unsigned int id;
+        std::string  name;
+        std::string  platform;
+        uint16_t     platform_id;
+        unsigned int max_jobs;
+        unsigned int active;
+        bool         online;
+        int64_t      last_change;  // From now_usec().
+        uint64_t     busy_usec;    // Job-microseconds in the current bucket.
+    };
+
+    utilization_history(size_t columns_, int64_t bucket_usec_)
+        : columns(columns_)
+        , bucket_usec(bucket_usec_)
+        , head(0)
+        , generation(0)
+        , layout_version(0)
+        , bucket_start(now_usec())
+        , free_total(0)
+    { }
+
+    void host_updated(const host_info& host, int64_t now) {
+        auto item = host_rows.find(host.id);
+        if (item == host_rows.end()) {
+            if (host.offline)
+                return;
+            item = host_rows.emplace(host.id, rows.size()).first;
+            rows.push_back({ host.id, host.name, host.platform, host.platform_id, 0, 0, false, now, 0 });
+            levels.resize(rows.size() * columns, no_data);
+        }
+        auto& row = rows[item->second];
+        account(row, now);
+        if (row.online == host.offline || row.name != host.name || row.platform != host.platform)
+            layout_version++;
+        if (row.online == host.offline || row.max_jobs != host.max_jobs)
+            mark_changed(item->second);
+        count(row, -1);
+        row.name = host.name;
+        row.platform = host.platform;
+        row.platform_id = host.platform_id;
+        row.max_jobs = host.max_jobs;
+        row.online = !host.offline;
+        count(row, +1);
+    }
+
+    void job_updated(const job_info& job, int64_t now) {
+        switch (job.state) {
+            case job_info::LOCAL:
+                job_started(job.id, job.client_id, now);
+                break;
+            case job_info::COMPILING:
+                job_started(job.id, job.server_id, now);
+                break;
+            case job_info::FINISHED:
+            case job_info::FAILED:
+                job_stopped(job.id, now);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Closes the buckets which ended before the given time.
+    void advance(int64_t now) {
+        if (now - bucket_start >= static_cast<int64_t>(columns) * bucket_usec) {
+            // Way behind (suspended?): do not bother filling every bucket.
+            bucket_start = now - static_cast<int64_t>(columns) * bucket_usec;
+        }
+        while (now - bucket_start >= bucket_usec) {
+            auto bucket_end = bucket_start + bucket_usec;
+            head = (head + 1) % columns;
+            for (size_t i = 0; i < rows.size(); i++) {
+                auto& row = rows[i];
+                account(row, bucket_end);
+                uint8_t level = no_data;
+                if (row.online) {
+                    // Hosts which take no jobs may still compile locally.
+                    auto slots = std::max(row.max_jobs, 1u);
+                    level = std::min<uint64_t>(100, row.busy_usec * 100 / (bucket_usec * slots));
+                }
+                levels[i * columns + head] = level;
+                row.busy_usec = 0;
+            }
+            bucket_start = bucket_end;
+            generation++;
+        }
+    }
+
+    // Rows whose slots in use, slot count, or status changed since the
+    // previous call, each listed once.
+    void take_changed(std::vector<size_t>& out) {
+        out.clear();
+        out.swap(changed_rows);
+        for (auto row: out)
+            row_changed[row] = false;
+    }
+
+    // Share of the slots in use right now, or no_data when offline.
+    uint8_t current_level(size_t row) const {
+        auto& r = rows[row];
+        if (!r.online)
+            return no_data;
+        return std::min(100u, r.active * 100 / std::max(r.max_jobs, 1u));
+    }
+
+    // Free slots of the hosts online, which take no jobs while busy
+    // compiling more than that locally.
+    unsigned free_slots() const { return free_total; }
+
+    // Jobs running on the hosts of a platform (see team_info::platforms).
+    unsigned active_on(uint16_t platform_id) const {
+        return platform_id < platform_active.size() ? platform_active[platform_id] : 0;
+    }
+
+    // Age zero is the last complete bucket.
+    uint8_t level(size_t row, size_t age) const {
+        if (age >= columns)
+            return no_data;
+        return levels[row * columns + (head + columns - age) % columns];
+    }
+
+    const size_t           columns;
+    const int64_t          bucket_usec;
+    std::vector<host_row>  rows;
+    size_t                 head;
+    uint64_t               generation;      // Buckets closed so far.
+    uint64_t               layout_version;  // Hosts added, renamed, or gone.
+
+private:
+    void account(host_row& row, int64_t now) {
+        if (now > row.last_change) {
+            row.busy_usec += row.active * static_cast<uint64_t>(now - row.last_change);
+            row.last_change = now;
+        }
+    }
+
+    // Adds or removes the row from the totals, around changes to it.
+    void count(const host_row& row, int sign) {
+        if (!row.online)
+            return;
+        if (row.max_jobs > row.active)
+            free_total += sign * static_cast<int>(row.max_jobs - row.active);
+        if (platform_active.size() <= row.platform_id)
+            platform_active.resize(row.platform_id + 1);
+        platform_active[row.platform_id] += sign * static_cast<int>(row.active);
+    }
+
+    void mark_changed(size_t row) {
+        if (row_changed.size() <= row)
+            row_changed.resize(rows.size());
+        if (!row_changed[row]) {
+            row_changed[row] = true;
+            changed_rows.push_back(row);
+        }
+    }
+
+    void job_started(unsigned int job_id, unsigned int host_id, int64_t now) {
+        auto item = host_rows.find(host_id);
+        if (item == host_rows.end() || !active_jobs.emplace(job_id, host_id).second)
+            return;
+        auto& row = rows[item->second];
+        account(row, now);
+        count(row, -1);
+        row.active++;
+        count(row, +1);
+        mark_changed(item->second);
+    }
+
+    void job_stopped(unsigned int job_id, int64_t now) {
+        auto job = active_jobs.find(job_id);
+        if (job == active_jobs.end())
+            return;
+        auto item = host_rows.find(job->second);
+        active_jobs.erase(job);
+        if (item == host_rows.end())
+            return;
+        auto& row = rows[item->second];
+        account(row, now);
+        count(row, -1);
+        if (row.active)
+            row.active--;
+        count(row, +1);
+        mark_changed(item->second);
+    }
+
+    int64_t                                        bucket_start;
+    std::vector<uint8_t>                           levels;  // Row-major.
+    std::unordered_map<unsigned int, size_t>       host_rows;
+    std::unordered_map<unsigned int, unsigned int> active_jobs;  // Job to host.
+    std::vector<size_t>                            changed_rows;
+    std::vector<bool>                              row_changed;
+    unsigned                                       free_total;
+    std::vector<unsigned>                          platform_active;
+};
+
+
+struct host_layout {
+    static ti::pen line_pens[2];
+    static ti::pen busy_pen, warn_pen, okay_pen, host_pen, progress_pen, offline_pen;
+    static constexpr unsigned state_columns = 11;
+
+    host_layout(ti::window&& w, const host_info& host)
+        : window(std::move(w)), host_id(host.id), hostname(host.name)
+        , platform(host.platform)
+        , filename()
+        , state_string("idle")
+        , state(job_info::IDLE)
+        , visible(true)
+        , marks(0)
+        , offline(false)
+        , flapping(false)
+        , offline_since(0)
+        , started_usec(0)
+        , predicted_msec(0)
+        , drawn_progress(-1)
+    {
+        window.on_expose([this](ti::window::expose_event& event) {
+            on_expose(event);
+            return true;
+        });
+    }
+
+    host_layout(host_layout&&) = default;
+
+    unsigned position() const {
+        return window.top();
+    }
+
+    void set_position(unsigned line) {
+        if (line != position()) {
+            window.set_position(line, window.left());
+            window.expose();
+        }
+    }
+
+    enum mark {
+        FAILING = 1 << 0,  // Fails many more jobs than the rest of the cluster.
+        SLOW    = 1 << 1,  // Compiles much slower than its peers.
+    };
+
+    void set_marks(unsigned marks_) {
+        if (marks != marks_) {
+            marks = marks_;
+            window.expose();
+        }
+    }
+
+    // Offline rows are kept, greyed out, for a grace period.
+    void set_offline(bool offline_, int64_t now) {
+        if (offline != offline_) {
+            offline = offline_;
+            offline_since = now;
+            window.expose();
+        }
+    }
+
+    void set_visible(bool visible_) {
+        if (visible != visible_) {
+            visible = visible_;
+            if (visible) window.show(); else window.hide();
+        }
+    }
+
+    void on_expose(ti::window::expose_event& ev) {
+        ev.render.set_pen(line_pens[position() % 2]).clear(ev.area);
+        if (offline) {
+            ev.render.save_pen().set_pen(offline_pen);
+            ev.render.at(0, 1) << platform;
+            ev.render.at(0, 9) << hostname;
+            if (window.columns() >= 30 + state_columns)
+                ev.render.at(0, window.columns() - state_columns + 1) << "offline";
+            ev.render.restore();
+            return;
+        }
+        auto mark_pen = (marks & FAILING) ? &warn_pen : (marks & SLOW) ? &busy_pen : nullptr;
+        if (mark_pen) {
+            ev.render.save_pen();
+            ev.render.at(0, 0) << *mark_pen << ((marks & FAILING) ? "!" : "*");
+            ev.render.restore();
+        }
+        ev.render.at(0, 1) << platform;
+        ev.render.at(0, 9) << (mark_pen ? *mark_pen : host_pen) << hostname;
+        ev.render.at(0, 30).restore() << filename;
+        if (window.columns() >= (11 + origin.size())) {
+            // TODO: Do something better than erasing the line all over.
+            auto col = window.columns() - 12 - origin.size();
+            ev.render.clear(0, col, window.columns() - col);
+            ev.render.at(0, ++col) << host_pen << origin;
+            col = window.columns() - state_columns;
+            ev.render.clear(0, col, window.columns() - col).restore();
+            if (predicted_msec && state == job_info::COMPILING) {
+                draw_progress(ev.render, col);
+            } else {
+                if (auto pen = state_pen()) ev.render << *pen;
+                ev.render.at(0, ++col) << state_string;
+                ev.render.restore();
+            }
+        }
+    }
+
+    /*
+     * Jobs with a predicted duration show a bar which fills up as they
+     * progress, and how many times longer than predicted they are taking
+     * once they overrun. Steps are tenths either way.
+     */
+    int progress_step(int64_t now) const {
+        auto elapsed_msec = (now - started_usec) / 1000;
+        return static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(elapsed_msec * 10 / predicted_msec, 999)));
+    }
+
+    void draw_progress(ti::render_buffer& render, unsigned col) {
+        drawn_progress = progress_step(now_usec());
+        if (drawn_progress >= 10) {
+            char text[state_columns + 1];
+            snprintf(text, sizeof(text), "late x%d.%d", drawn_progress / 10, drawn_progress % 10);
+            render.save_pen().set_pen(warn_pen);
+            render.at(0, col + 1) << text;
+            render.restore();
+            return;
+        }
+        std::string text = state_string;
+        text.resize(state_columns - 1, ' ');
+        render.save_pen().set_pen(progress_pen);
+        render.at(0, col + 1) << text.substr(0, drawn_progress);
+        render.restore().save_pen().set_pen(busy_pen);
+        render.at(0, col + 1 + drawn_progress) << text.substr(drawn_progress);
+        render.restore();
+    }
+
+    // Called every frame; only exposes the state when its step changed.
+    void update_progress(int64_t now) {
+        if (state != job_info::COMPILING || !predicted_msec || !visible)
+            return;
+        if (progress_step(now) != drawn_progress && window.columns() >= state_columns)
+            window.expose({ 0, window.columns() - state_columns, 1, state_columns });
+    }
+
+    // Both return whether any of the fields used for filtering changed.
+    bool host_info_updated(const host_info& host) {
+        bool changed = hostname != host.name || platform != host.platform;
+        hostname = host.name;
+        platform = host.platform;
+        window.expose();
+        return changed;
+    }
+
+    bool job_info_updated(const job_info& job, uint32_t predicted_msec_ = 0) {
+        if (job.state == job_info::WAITING)
+            return false;
+        started_usec = job.started_usec ? job.started_usec : now_usec();
+        predicted_msec = predicted_msec_;
+        drawn_progress = -1;
+        auto client = job.server() ? job.client() : nullptr;
+        auto new_origin = client ? client->name : std::string();
+        bool changed = origin != new_origin || filename != job.filename;
+        origin = std::move(new_origin);
+        state = job.state;
+        state_string = job.state_string();
+        filename = job.filename;
+        window.expose();
+        return changed;
+    }
+
+    ti::pen* state_pen() const {
+        switch (state) {
+            case job_info::FAILED:
+                return &warn_pen;
+            case job_info::FINISHED:
+                return &okay_pen;
+            case job_info::LOCAL:
+            case job_info::COMPILING:
+                return &busy_pen;
+            default:
+                return nullptr;
+        }
+    }
+
+    ti::window window;
+    unsigned int host_id;
+    std::string hostname;
+    std::string platform;
+    std::string filename;
+    std::string origin;
+    const char *state_string;
+    job_info::job_state state;
+    bool visible;
+    unsigned marks;
+    bool offline;
+    bool flapping;
+    int64_t offline_since;
+    int64_t started_usec;
+    uint32_t predicted_msec;
+    int drawn_progress;
+};
+
+ti::pen host_layout::line_pens[2] = {
+    { ti::pen::bg() },
+    { ti::pen::bg(234) },
+};
+ti::pen host_layout::busy_pen = { ti::pen::fg(3), ti::pen::bold };
+ti::pen host_layout::okay_pen = { ti::pen::fg(2), ti::pen::bold };
+ti::pen host_layout::warn_pen = { ti::pen::fg(1), ti::pen::bold };
+ti::pen host_layout::host_pen = { ti::pen::fg(7), ti::pen::bold };
+ti::pen host_layout::progress_pen = { ti::pen::fg(0), ti::pen::bg(3) };
+ti::pen host_layout::offline_pen = { ti::pen::fg(8) };
+
+
+/*
+ * A host filter is a list of space-separated terms, all of which must match
+ * a row for it to be shown. Each term may be prefixed by the field it
+ * applies to ("host:", "platform:", "origin:" or "file:"); terms without a
+ * prefix apply to the host name. File terms are regular expressions, the
+ * rest are case-insensitive globs, and globs without wildcards match as
+ * substrings.
+ */
+struct host_filter {
+    enum field {
+        HOST,
+        PLATFORM,
+        ORIGIN,
+        FILENAME,
+    };
+
+    struct term {
+        field       what;
+        std::string glob;
+        std::regex  regex;
+    };
+
+    // Throws std::regex_error for invalid file patterns.
+    host_filter(const std::string& pattern_): pattern(pattern_) {
+        std::istringstream stream(pattern);
+        std::string word;
+        while (stream >> word) {
+            static const std::pair<const char*, field> prefixes[] = {
+                { "host:", HOST },
+                { "platform:", PLATFORM },
+                { "origin:", ORIGIN },
+                { "file:", FILENAME },
+            };
+            term t { HOST, word, {} };
+            for (auto& prefix: prefixes) {
+                auto len = strlen(prefix.first);
+                if (word.compare(0, len, prefix.first) == 0) {
+                    t.what = prefix.second;
+                    t.glob = word.substr(len);
+                    break;
+                }
+            }
+            if (t.what == FILENAME) {
+                t.regex = std::regex(t.glob, std::regex::ECMAScript | std::regex::optimize);
+            } else if (t.glob.find_first_of("*?[") == std::string::npos) {
+                t.glob = "*" + t.glob + "*";
+            }
+            terms.emplace_back(std::move(t));
+        }
+    }
+
+    bool matches(const host_layout& row) const {
+        for (auto& t: terms) {
+            if (!matches(t, row))
+                return false;
+        }
+        return true;
+    }
+
+    const std::string pattern;
+
+private:
+    static bool matches(const term& t, const host_layout& row) {
+        switch (t.what) {
+            case HOST:     return fnmatch(t.glob.c_str(), row.hostname.c_str(), FNM_CASEFOLD) == 0;
+            case PLATFORM: return fnmatch(t.glob.c_str(), row.platform.c_str(), FNM_CASEFOLD) == 0;
+            case ORIGIN:   return fnmatch(t.glob.c_str(), row.origin.c_str(), FNM_CASEFOLD) == 0;
+            case FILENAME: return std::regex_search(row.filename, t.regex);
+        }
+        return false;
+    }
+
+    std::vector<term> terms;
+};
+
+
+/*
+ * Compiling regular expressions is expensive, and while typing the pattern
+ * changes one character at a time (and often back and forth), so keep the
+ * most recently used compiled filters around.
+ */
+struct host_filter_cache {
+    static constexpr size_t capacity = 16;
+
+    std::shared_ptr<const host_filter> get(const std::string& pattern) {
+        auto item = std::find_if(filters.begin(), filters.end(), [&pattern](const std::shared_ptr<const host_filter>& f) {
+            return f->pattern == pattern;
+        });
+        std::shared_ptr<const host_filter> filter;
+        if (item != filters.end()) {
+            filter = *item;
+            filters.erase(item);
+        } else {
+            filter = std::make_shared<const host_filter>(pattern);
+            if (filters.size() >= capacity)
+                filters.pop_back();
+        }
+        filters.insert(filters.begin(), filter);
+        return filter;
+    }
+
+private:
+    std::vector<std::shared_ptr<const host_filter>> filters;
+};
+
+
+static std::string format_time(time_t t)
+{
+    char timestring[15];
+    strftime(timestring, sizeof(timestring), "[%H:%M:%S] ", localtime(&t));
+    return timestring;
+}
+
+
+struct event_log_pane {
+    enum level {
+        DEBUG,
+        INFO,
+        NOTICE,
+        WARNING,
+        ERROR,
+    };
+
+    struct entry {
+        time_t      time;
+        level       severity;
+        std::string text;
+    };
+
+    static ti::pen level_pens[ERROR + 1];
+
+    static bool parse_level(const char* name, level& result) {
+        static const char* names[] = { "debug", "info", "notice", "warning", "error" };
+        for (unsigned i = 0; i <= ERROR; i++) {
+            if (strcmp(name, names[i]) == 0) {
+                result = static_cast<level>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    event_log_pane(ti::window&& w, level min_level_, size_t capacity = 128)
+        : window(std::move(w))
+        , entries(capacity)
+        , min_level(min_level_)
+    {
+        window.on_expose([this](ti::window::expose_event& ev) {
+            on_expose(ev);
+            return true;
+        });
+    }
+
+    void on_expose(ti::window::expose_event& ev) {
+        ev.render.set_pen(level_pens[INFO]).clear(ev.area);
+        // Entries are bottom-aligned: the newest one is at the last line.
+        auto lines = window.lines();
+        auto first = ev.area.top;
+        auto last = std::min(ev.area.top + ev.area.lines, lines);
+        for (auto line = first; line < last; line++) {
+            auto offset = lines - line;
+            if (offset > entries.size())
+                continue;
+            const entry& e = entries[entries.size() - offset];
+            ev.render.at(line, 1) << format_time(e.time);
+            ev.render.save_pen().set_pen(level_pens[e.severity]) << e.text;
+            ev.render.restore();
+        }
+    }
+
+    void append(level severity, const std::string& text) {
+        if (severity < min_level)
+            return;
+        entries.push_back({ time(nullptr), severity, text });
+        // Shift the existing lines up and let Tickit expose only the
+        // vacated line at the bottom, instead of repainting everything.
+        window.scroll(1, 0);
+    }
+
+    ti::window             window;
+    util::ring<entry>      entries;
+    level                  min_level;
+};
+
+ti::pen event_log_pane::level_pens[event_log_pane::ERROR + 1] = {
+    { ti::pen::fg(8) },
+    { ti::pen::fg() },
+    { ti::pen::fg(6) },
+    { ti::pen::fg(3), ti::pen::bold },
+    { ti::pen::fg(1), ti::pen::bold },
+};
+
+
+/*
+ * Covers the host list with a table of text produced on demand. The first
+ * line is a title, and the first line produced is shown as a header.
+ */
+struct report_view {
+    using produce_func = std::function<void(std::vector<std::string>&, unsigned columns)>;
+
+    static ti::pen title_pen, header_pen;
+
+    report_view(ti::window&& w, const std::string& title_, produce_func produce_)
+        : window(std::move(w))
+        , title(title_)
+        , produce(produce_)
+    {
+        window.on_expose([this](ti::window::expose_event& ev) {
+            on_expose(ev);
+            return true;
+        });
+    }
+
+    void refresh() {
+        lines.clear();
+        produce(lines, window.columns() - 1);
+        window.expose();
+    }
+
+    void on_expose(ti::window::expose_event& ev) {
+        ev.render.clear(ev.area);
+        ev.render.save_pen().set_pen(title_pen).clear(0, 0, window.columns());
+        ev.render.at(0, 1) << title;
+        ev.render.restore();
+        for (unsigned i = 0; i < lines.size() && i + 1 < window.lines(); i++) {
+            if (i == 0) ev.render.save_pen().set_pen(header_pen);
+            ev.render.at(i + 1, 1) << lines[i];
+            if (i == 0) ev.render.restore();
+        }
+    }
+
+    ti::window               window;
+    std::string              title;
+    produce_func             produce;
+    std::vector<std::string> lines;
+};
+
+ti::pen report_view::title_pen = { ti::pen::bg(4), ti::pen::bold };
+ti::pen report_view::header_pen = { ti::pen::fg(7), ti::pen::bold, ti::pen::underline };
+
+
+/*
+ * Shows a utilization_history as a heatmap: one line per host, or per
+ * group of hosts when there are more than lines, and one column per time
+ * bucket, the newest on the right. When buckets are closed, the cells are
+ * scrolled to the left, so only the new columns need to be drawn.
+ */
+struct heatmap_view {
+    static constexpr unsigned label_columns = 20;
+    static ti::pen level_pens[6];
+
+    heatmap_view(ti::window&& w, const utilization_history& history_)
+        : window(std::move(w))
+        , history(history_)
+        , drawn_generation(0)
+        , drawn_layout(0)
+    {
+        window.on_expose([this](ti::window::expose_event& ev) {
+            on_expose(ev);
+            return true;
+        });
+    }
+
+    void refresh() {
+        auto delta = history.generation - drawn_generation;
+        if (history.layout_version != drawn_layout || window.columns() <= label_columns
+            || delta >= window.columns() - label_columns) {
+            window.expose();
+        } else if (delta > 0) {
+            ti::rect cells { 1, label_columns, window.lines() - 1, window.columns() - label_columns };
+            window.scroll(0, delta, cells);
+        }
+        drawn_generation = history.generation;
+    }
+
+    void on_expose(ti::window::expose_event& ev) {
+        if (ev.area.top == 0) {
+            char title[80];
+            snprintf(title, sizeof(title), "Slot utilization, %llds per column",
+                     static_cast<long long>(history.bucket_usec / 1000000));
+            ev.render.save_pen().set_pen(report_view::title_pen).clear(0, 0, window.columns());
+            ev.render.at(0, 1) << title;
+            ev.render.restore();
+        }
+
+        if (history.layout_version != drawn_layout) {
+            sorted_rows.clear();
+            for (size_t i = 0; i < history.rows.size(); i++) {
+                if (history.rows[i].online)
+                    sorted_rows.push_back(i);
+            }
+            std::sort(sorted_rows.begin(), sorted_rows.end(), [this](size_t a, size_t b) {
+                return history.rows[a].name < history.rows[b].name;
+            });
+            drawn_layout = history.layout_version;
+        }
+
+        unsigned lines = window.lines() > 1 ? window.lines() - 1 : 0;
+        size_t group = lines ? (sorted_rows.size() + lines - 1) / lines : 0;
+        auto first_col = std::max(ev.area.left, label_columns);
+        auto last_col = std::min(ev.area.left + ev.area.columns, window.columns());
+
+        for (auto line = std::max(ev.area.top, 1u); line < ev.area.top + ev.area.lines; line++) {
+            size_t first = (line - 1) * group;
+            ev.render.clear(line, ev.area.left, ev.area.columns);
+            if (!group || first >= sorted_rows.size())
+                continue;
+            size_t last = std::min(first + group, sorted_rows.size());
+
+            if (ev.area.left < label_columns) {
+                auto label = history.rows[sorted_rows[first]].name;
+                if (last - first > 1)
+                    label += " +" + std::to_string(last - first - 1);
+                if (label.size() > label_columns - 2)
+                    label.resize(label_columns - 2);
+                ev.render.at(line, 1) << label;
+            }
+
+            // Groups show their busiest host, so hot spots stand out.
+            for (auto col = first_col; col < last_col; ) {
+                auto level = group_level(first, last, window.columns() - 1 - col);
+                auto run = col + 1;
+                while (run < last_col && group_level(first, last, window.columns() - 1 - run) == level)
+                    run++;
+                if (level != utilization_history::no_data) {
+                    ev.render.save_pen().set_pen(level_pen(level));
+                    ev.render.clear(line, col, run - col).restore();
+                }
+                col = run;
+            }
+        }
+        drawn_generation = history.generation;
+    }
+
+    static const ti::pen& level_pen(uint8_t level) {
+        return level_pens[(level == 0) ? 0 : std::min(5, 1 + (level - 1) / 25)];
+    }
+
+    ti::window                 window;
+
+private:
+    uint8_t group_level(size_t first, size_t last, size_t age) const {
+        uint8_t level = utilization_history::no_data;
+        for (auto i = first; i < last; i++) {
+            auto l = history.level(sorted_rows[i], age);
+            if (l != utilization_history::no_data && (level == utilization_history::no_data || l > level))
+                level = l;
+        }
+        return level;
+    }
+
+    const utilization_history& history;
+    std::vector<size_t>        sorted_rows;
+    uint64_t                   drawn_generation;
+    uint64_t                   drawn_layout;
+};
+
+ti::pen heatmap_view::level_pens[6] = {
+    { ti::pen::bg(236) },  // Idle.
+    { ti::pen::bg(22) },
+    { ti::pen::bg(28) },
+    { ti::pen::bg(142) },
+    { ti::pen::bg(208) },
+    { ti::pen::bg(196) },  // Full.
+};
+
+
+/*
+ * Shows every host online as a single cell, colored by the share of its
+ * slots in use, packed in a grid which fills the window. Hosts are sorted
+ * by platform and name, and failing or slow ones show a glyph. Only cells
+ * which changed are exposed, so a frame costs as much as the number of
+ * hosts which changed, whatever the size of the cluster.
+ */
+struct host_grid_view {
+    using marks_map = std::unordered_map<unsigned int, unsigned>;
+
+    host_grid_view(ti::window&& w, utilization_history& hosts_, const team_info& team_,
+                   const marks_map& marks_)
+        : window(std::move(w))
+        , hosts(hosts_)
+        , team(team_)
+        , marks(marks_)
+        , show_platforms(true)
+        , drawn_layout(~uint64_t(0))
+        , drawn_columns(0)
+    {
+        for (auto& pen: heatmap_view::level_pens) {
+            marked_pens.push_back(pen);
+            marked_pens.back().set(ti::pen::fg(15)).set(ti::pen::bold);
+        }
+        window.on_expose([this](ti::window::expose_event& ev) {
+            on_expose(ev);
+            return true;
+        });
+    }
+
+    // Called every frame, shown or not, so changes do not pile up.
+    void update() {
+        hosts.take_changed(changed);
+        if (!window.visible())
+            return;
+        if (stale()) {
+            window.expose();
+            return;
+        }
+        for (auto row: changed) {
+            if (row < cell_of_row.size() && cell_of_row[row] != no_cell)
+                update_cell(cell_of_row[row]);
+        }
+    }
+
+    // Called periodically, to catch up with marks and totals.
+    void refresh() {
+        if (stale()) {
+            window.expose();
+            return;
+        }
+        for (size_t i = 0; i < cells.size(); i++)
+            update_cell(i);
+        window.expose({ 0, 0, header_lines(), window.columns() });
+    }
+
+    bool on_key(ti::window::key_event& ev) {
+        if (ev.is_text() && ev.name == "P") {
+            show_platforms = !show_platforms;
+            window.expose();
+            return true;
+        }
+        return false;
+    }
+
+    void on_expose(ti::window::expose_event& ev) {
+        if (stale())
+            rebuild();
+
+        auto header = header_lines();
+        auto bottom = ev.area.top + ev.area.lines;
+        if (ev.area.top < header) {
+            std::string title, platforms;
+            summarize(title, platforms);
+            ev.render.save_pen().set_pen(report_view::title_pen).clear(0, 0, window.columns());
+            ev.render.at(0, 1) << title;
+            ev.render.restore();
+            if (show_platforms && bottom > 1) {
+                ev.render.clear(1, 0, window.columns());
+                ev.render.at(1, 1) << platforms;
+            }
+        }
+
+        auto last_col = std::min(ev.area.left + ev.area.columns, window.columns());
+        for (auto line = std::max(ev.area.top, header); line < bottom; line++) {
+            ev.render.clear(line, ev.area.left, ev.area.columns);
+            for (auto col = ev.area.left; col < last_col; col++) {
+                size_t index = size_t(line - header) * window.columns() + col;
+                if (index >= cells.size())
+                    break;
+                draw_cell(ev.render, line, col, cells[index]);
+            }
+        }
+    }
+
+    ti::window window;
+
+private:
+    static constexpr size_t no_cell = static_cast<size_t>(-1);
+
+    struct cell {
+        size_t   row;
+        uint8_t  level;
+        unsigned marks;
+    };
+
+    bool stale() const {
+        return hosts.layout_version != drawn_layout || window.columns() != drawn_columns;
+    }
+
+    unsigned header_lines() const {
+        return show_platforms ? 2 : 1;
+    }
+
+    unsigned host_marks(size_t row) const {
+        auto item = marks.find(hosts.rows[row].id);
+        return item == marks.end() ? 0 : item->second;
+    }
+
+    void rebuild() {
+        cells.clear();
+        cell_of_row.assign(hosts.rows.size(), no_cell);
+        for (size_t i = 0; i < hosts.rows.size(); i++) {
+            if (hosts.rows[i].online)
+                cells.push_back({ i, hosts.current_level(i), host_marks(i) });
+        }
+        std::sort(cells.begin(), cells.end(), [this](const cell& a, const cell& b) {
+            auto& ra = hosts.rows[a.row];
+            auto& rb = hosts.rows[b.row];
+            return std::tie(ra.platform, ra.name) < std::tie(rb.platform, rb.name);
+        });
+        for (size_t i = 0; i < cells.size(); i++)
+            cell_of_row[cells[i].row] = i;
+        drawn_layout = hosts.layout_version;
+        drawn_columns = window.columns();
+    }
+
+    void update_cell(size_t index) {
+        auto& c = cells[index];
+        auto level = hosts.current_level(c.row);
+        auto m = host_marks(c.row);
+        if (level == c.level && m == c.marks)
+            return;
+        c.level = level;
+        c.marks = m;
+        auto line = header_lines() + index / window.columns();
+        if (line < window.lines())
+            window.expose({ unsigned(line), unsigned(index % window.columns()), 1, 1 });
+    }
+
+    void draw_cell(ti::render_buffer& render, unsigned line, unsigned col, const cell& c) {
+        if (c.level == utilization_history::no_data)
+            return;
+        auto pen_index = &heatmap_view::level_pen(c.level) - heatmap_view::level_pens;
+        const char* glyph = " ";
+        if (c.marks & host_layout::FAILING)
+            glyph = "!";
+        else if (c.marks & host_layout::SLOW)
+            glyph = "*";
+        render.save_pen().set_pen(c.marks ? marked_pens[pen_index] : heatmap_view::level_pens[pen_index]);
+        render.at(line, col) << glyph;
+        render.restore();
+    }
+
+    void summarize(std::string& title, std::string& platforms) const {
+        auto by_platform = team.platforms();
+        std::vector<uint16_t> order;
+        unsigned active = 0;
+        for (uint16_t id = 0; id < by_platform.size(); id++) {
+            active += hosts.active_on(id);
+            if (by_platform[id].hosts)
+                order.push_back(id);
+        }
+        std::sort(order.begin(), order.end(), [&by_platform](uint16_t a, uint16_t b) {
+            return by_platform[a].name < by_platform[b].name;
+        });
+        auto all = team.totals();
+
+        char buffer[120];
+        snprintf(buffer, sizeof(buffer), "%u hosts, %u/%u slots in use",
+                 all.hosts, active, all.slots);
+        title = buffer;
+        auto capacity = size_t(window.lines() - std::min(window.lines(), header_lines())) * window.columns();
+        if (cells.size() > capacity)
+            title += " (" + std::to_string(cells.size() - capacity) + " not shown)";
+
+        platforms.clear();
+        for (auto id: order) {
+            auto& t = by_platform[id];
+            snprintf(buffer, sizeof(buffer), "%s%s: %u hosts, %u%%",
+                     platforms.empty() ? "" : "  ", t.name.c_str(), t.hosts,
+                     t.slots ? hosts.active_on(id) * 100 / t.slots : 0);
+            platforms += buffer;
+        }
+    }
+
+    utilization_history&  hosts;
+    const team_info&      team;
+    const marks_map&      marks;
+    std::vector<cell>     cells;        // In display order.
+    std::vector<size_t>   cell_of_row;  // Row of the history to cell.
+    std::vector<size_t>   changed;
+    std::vector<ti::pen>  marked_pens;
+    bool                  show_platforms;
+    uint64_t              drawn_layout;
+    unsigned              drawn_columns;
+};
+
+
+struct screen_layout {
+    static ti::pen status_pen;
+
+    // Alternative views replace the host list while shown, and are
+    // refreshed periodically. They may handle keys of their own.
+    struct view {
+        std::string                                   key;
+        ti::window*                                   window;
+        std::function<void()>                         refresh;
+        std::function<bool(ti::window::key_event&)>   on_key;
+    };
+
+    // Overlays are drawn on top of everything else, in the top right
+    // corner, and toggled independently of views.
+    struct overlay {
+        view     v;
+        unsigned lines;
+        unsigned columns;
+    };
+
+    screen_layout(ti::terminal& term,
+                  unsigned log_lines_,
+                  event_log_pane::level log_level_)
+        : root(ti::window(term))
+        , status(root, { root.lines() - 1, 0, 1, root.columns() })
+        , log(ti::window(root, log_geometry(log_lines_)), log_level_)
+        , log_lines(log_lines_)
+        , shown_rows(0)
+        , flapping_row(root, { 0, 0, 1, root.columns() })
+        , flapping_hosts(0)
+        , current_view(no_view)
+        , last_view_refresh(0)
+        , editing_filter(false)
+    {
+        status.on_expose([this](ti::window::expose_event& ev) {
+            on_status_expose(ev);
+            return true;
+        });
+
+        flapping_row.on_expose([this](ti::window::expose_event& ev) {
+            on_flapping_expose(ev);
+            return true;
+        });
+        flapping_row.hide();
+
+        root.on_key([this](ti::window::key_event& ev) {
+            return on_key(ev);
+        });
+
+        root.on_expose([](ti::window::expose_event& ev) {
+            // Just clear the backgrond. Avoids ghost text after certain
+            // kinds of geometry changes.
+            ev.render.clear(ev.area);
+            return true;
+        });
+
+        root.on_geometry_change([this, &term](ti::window::geometry_change_event& ev) {
+            status.set_geometry({ root.lines() - 1, 0, 1, root.columns() });
+            log.window.set_geometry(log_geometry(log_lines));
+            flapping_row.set_geometry({ flapping_row.top(), 0, 1, root.columns() });
+            for (auto& v: views)
+                v.window->set_geometry(main_geometry());
+            for (auto& o: overlays)
+                o.v.window->set_geometry(overlay_geometry(o.lines, o.columns));
+            term.clear();
+            root.expose();
+            return true;
+        });
+
+        log.window.raise();
+        status.raise();
+    }
+
+    // The event log sits right above the status line.
+    ti::rect log_geometry(unsigned lines) const {
+        lines = std::min(lines, root.lines() - 1);
+        return { root.lines() - 1 - lines, 0, lines, root.columns() };
+    }
+
+    // Area used by the host list and the alternative views.
+    ti::rect main_geometry() const {
+        return { 0, 0, log_geometry(log_lines).top, root.columns() };
+    }
+
+    void add_view(const std::string& key, ti::window& window, std::function<void()> refresh,
+                  std::function<bool(ti::window::key_event&)> on_key = nullptr) {
+        window.hide();
+        views.push_back({ key, &window, refresh, on_key });
+    }
+
+    report_view& add_report(const std::string& key, const std::string& title,
+                            report_view::produce_func produce) {
+        reports.emplace_back(std::make_unique<report_view>(ti::window(root, main_geometry()),
+                                                           title, produce));
+        auto& report = *reports.back();
+        add_view(key, report.window, [&report] { report.refresh(); });
+        return report;
+    }
+
+    ti::rect overlay_geometry(unsigned lines, unsigned columns) const {
+        auto area = main_geometry();
+        lines = std::min(lines, area.lines);
+        columns = std::min(columns, area.columns);
+        return { area.top, area.columns - columns, lines, columns };
+    }
+
+    report_view& add_overlay(const std::string& key, const std::string& title,
+                             unsigned lines, unsigned columns,
+                             report_view::produce_func produce) {
+        reports.emplace_back(std::make_unique<report_view>(ti::window(root, overlay_geometry(lines, columns)),
+                                                           title, produce));
+        auto& report = *reports.back();
+        report.window.hide();
+        overlays.push_back({ { key, &report.window, [&report] { report.refresh(); }, nullptr }, lines, columns });
+        return report;
+    }
+
+    void toggle_overlay(overlay& o) {
+        if (o.v.window->visible()) {
+            o.v.window->hide();
+        } else {
+            o.v.window->show();
+            o.v.window->raise();
+            o.v.refresh();
+        }
+    }
+
+    static constexpr size_t no_view = static_cast<size_t>(-1);
+
+    // Shows the view, or goes back to the host list if it was being shown.
+    void toggle_view(size_t index) {
+        if (current_view < views.size())
+            views[current_view].window->hide();
+        current_view = (index == current_view) ? no_view : index;
+        if (current_view < views.size()) {
+            auto& v = views[current_view];
+            v.window->show();
+            v.window->raise();
+            v.refresh();
+            last_view_refresh = now_usec();
+        }
+        for (auto& o: overlays) {
+            if (o.v.window->visible())
+                o.v.window->raise();
+        }
+    }
+
+    // Called every frame.
+    void tick() {
+        static constexpr int64_t refresh_usec = 1000 * 1000;
+        if (current_view == no_view && !frozen) {
+            auto now = now_usec();
+            for (auto& row: host_layouts)
+                row->update_progress(now);
+        }
+        if (now_usec() - last_view_refresh < refresh_usec)
+            return;
+        if (!frozen)
+            check_flapping(now_usec());
+        if (current_view < views.size())
+            views[current_view].refresh();
+        for (auto& o: overlays) {
+            if (o.v.window->visible())
+                o.v.refresh();
+        }
+        last_view_refresh = now_usec();
+    }
+
+    /*
+     * Hosts going offline keep their row, greyed out, for a grace period,
+     * so hosts which come back soon cost a single redraw. Each time a host
+     * goes offline it gets a penalty, which halves every minute; hosts with
+     * a penalty over the limit are considered flapping: their rows are
+     * hidden and summarized in a single line, and their comings and goings
+     * are not announced, until the penalty decays below a quarter of the
+     * limit.
+     */
+    struct flap_state {
+        unsigned flaps     = 0;
+        double   penalty   = 0;
+        int64_t  updated   = 0;
+        bool     suppressed = false;
+
+        void decay(int64_t now) {
+            static constexpr double half_life_usec = 60 * 1000 * 1000;
+            if (updated)
+                penalty *= std::exp2(-(now - updated) / half_life_usec);
+            updated = now;
+        }
+    };
+
+    int64_t offline_grace_usec = 30 * 1000 * 1000;
+    double flap_limit = 4;
+
+    void host_info_updated(const host_info& host) {
+        auto now = now_usec();
+        auto index_item = hostid_to_index.find(host.id);
+        if (host.offline) {
+            if (index_item == hostid_to_index.end()) {
+                // No line for it: do nothing.
+                return;
+            }
+            auto& row = *host_layouts[index_item->second];
+            if (row.offline)
+                return;
+            row.set_offline(true, now);
+            if (frozen)
+                return;
+            auto& flap = flaps[host.id];
+            flap.decay(now);
+            flap.flaps++;
+            flap.penalty += 1;
+            if (!flap.suppressed)
+                post(event_log_pane::WARNING, "Host " + host.name + " went offline");
+            if (!flap.suppressed && flap.penalty >= flap_limit)
+                set_flapping(host.id, true);
+        } else {
+            if (index_item == hostid_to_index.end()) {
+                auto flap = flaps.find(host.id);
+                bool suppressed = flap != flaps.end() && flap->second.suppressed;
+                if (!suppressed)
+                    announce(event_log_pane::NOTICE, "Host " + host.name + " (" + host.platform + ") came online");
+                unsigned index = host_layouts.size();  // Add it at the end.
+                ti::window w { root, { shown_rows, 0, 1, root.columns() } };
+                host_layouts.emplace_back(std::make_unique<host_layout>(std::move(w), host));
+                auto marks = host_marks.find(host.id);
+                if (marks != host_marks.end())
+                    host_layouts.back()->set_marks(marks->second);
+                host_layouts.back()->flapping = suppressed;
+                refilter(index, true);
+            } else if (host_layouts[index_item->second]->offline) {
+                auto& row = *host_layouts[index_item->second];
+                row.set_offline(false, now);
+                row.host_info_updated(host);
+                announce(event_log_pane::DEBUG, "Host " + host.name + " is back online");
+            } else {
+                announce(event_log_pane::DEBUG, "Host " + host.name + " (" + host.platform + ") is still online");
+                if (host_layouts[index_item->second]->host_info_updated(host))
+                    refilter(index_item->second);
+            }
+        }
+    }
 
-    void on_expose(ti::window::expose_event& ev) {
-        ev.render.set_pen(line_pens[position() % 2]).clear(ev.area);
-        ev.render.at(0, 1) << platform;
-        ev.render.at(0, 9) << host_pen << hostname;
-        ev.render.at(0, 30).restore() << filename;
-        if (window.columns() >= (11 + origin.size())) {
-            // TODO: Do something better than erasing the line all over.
-            auto col = window.columns() - 12 - origin.size();
-            ev.render.clear(0, col, window.columns() - col);
-            ev.render.at(0, ++col) << host_pen << origin;
-            col = window.columns() - 11;
-            ev.render.clear(0, col, window.columns() - col).restore();
-            if (auto pen = state_pen()) ev.render << *pen;
-            ev.render.at(0, ++col) << state_string;
-            ev.render.restore();
+    void job_info_updated(const job_info& job) {
+        if (job.state == job_info::FAILED) {
+            auto server = job.server();
+            announce(event_log_pane::ERROR, "Job " + std::to_string(job.id) + " (" + job.filename
+                 + ") failed on " + (server ? server->name : "<unknown>")
+                 + " with exit code " + std::to_string(job.exit_code));
+        }
+
+        auto index_item = hostid_to_index.find(job.server() ? job.server_id : job.client_id);
+        if (index_item == hostid_to_index.end())
+            return;
+        auto& row = *host_layouts[index_item->second];
+        uint32_t predicted = 0;
+        if (predictor && !frozen && job.state == job_info::COMPILING)
+            predicted = predictor->predict(job.filename_id, row.platform);
+        if (row.job_info_updated(job, predicted))
+            refilter(index_item->second);
+    }
+
+    // Removes all the rows, to show the hosts of another monitor.
+    void reset() {
+        host_layouts.clear();
+        hostid_to_index.clear();
+        relayout();
+        root.expose();
+    }
+
+    void set_rewind_label(const std::string& s) {
+        rewind_label = s;
+        status.expose();
+    }
+
+    // Rows of hosts which did not come back within the grace period are
+    // removed, and hosts which stopped flapping are shown again.
+    void check_flapping(int64_t now) {
+        size_t first_removed = SIZE_MAX;
+        for (size_t index = 0; index < host_layouts.size(); ) {
+            auto& row = *host_layouts[index];
+            if (row.offline && now - row.offline_since >= offline_grace_usec) {
+                hostid_to_index.erase(row.host_id);
+                host_layouts.erase(host_layouts.begin() + index);
+                first_removed = std::min(first_removed, index);
+            } else {
+                index++;
+            }
+        }
+        if (first_removed != SIZE_MAX)
+            relayout(first_removed);
+
+        for (auto item = flaps.begin(); item != flaps.end(); ) {
+            auto& flap = item->second;
+            flap.decay(now);
+            if (flap.suppressed && flap.penalty < flap_limit / 4) {
+                set_flapping(item->first, false);
+            }
+            // Forget hosts which have been quiet for long.
+            if (!flap.suppressed && flap.penalty < 0.01)
+                item = flaps.erase(item);
+            else
+                ++item;
+        }
+    }
+
+    void set_flapping(unsigned int host_id, bool flapping) {
+        auto& flap = flaps[host_id];
+        flap.suppressed = flapping;
+        flapping_hosts += flapping ? 1 : -1;
+        auto index_item = hostid_to_index.find(host_id);
+        if (index_item != hostid_to_index.end()) {
+            auto& row = *host_layouts[index_item->second];
+            post(flapping ? event_log_pane::WARNING : event_log_pane::NOTICE, "Host " + row.hostname
+                 + (flapping ? " keeps going offline, hiding it" : " stopped flapping"));
+            row.flapping = flapping;
+            refilter(index_item->second, true);
+        } else {
+            relayout(host_layouts.size());
+        }
+    }
+
+    void flap_report(std::vector<std::string>& lines, std::function<std::string(unsigned int)> host_name) {
+        std::vector<std::pair<unsigned int, flap_state>> ranked(flaps.begin(), flaps.end());
+        std::sort(ranked.begin(), ranked.end(), [](const std::pair<unsigned int, flap_state>& a,
+                                                   const std::pair<unsigned int, flap_state>& b) {
+            return a.second.penalty > b.second.penalty;
+        });
+        char buffer[120];
+        snprintf(buffer, sizeof(buffer), "Hosts are hidden at a penalty of %.1f, and shown again below %.1f.",
+                 flap_limit, flap_limit / 4);
+        lines.emplace_back(buffer);
+        lines.emplace_back();
+        snprintf(buffer, sizeof(buffer), "  %-32s %7s %8s  %s", "Host", "Flaps", "Penalty", "State");
+        lines.emplace_back(buffer);
+        for (auto& item: ranked) {
+            auto index_item = hostid_to_index.find(item.first);
+            const char* state = "gone";
+            if (index_item != hostid_to_index.end())
+                state = host_layouts[index_item->second]->offline ? "offline" : "online";
+            snprintf(buffer, sizeof(buffer), "%c %-32.32s %7u %8.2f  %s", item.second.suppressed ? '~' : ' ',
+                     host_name(item.first).c_str(), item.second.flaps, item.second.penalty, state);
+            lines.emplace_back(buffer);
+        }
+    }
+
+    // Marks are kept for hosts which go offline and come back.
+    void set_host_mark(unsigned int host_id, host_layout::mark mark, bool enabled) {
+        auto& marks = host_marks[host_id];
+        marks = enabled ? (marks | mark) : (marks & ~mark);
+        auto index_item = hostid_to_index.find(host_id);
+        if (index_item != hostid_to_index.end())
+            host_layouts[index_item->second]->set_marks(marks);
+        if (!marks)
+            host_marks.erase(host_id);
+    }
+
+    // Assigns consecutive lines to the rows accepted by the filter, from
+    // the given index onwards, and keeps the index map in sync.
+    void relayout(size_t from = 0) {
+        unsigned line = std::count_if(host_layouts.begin(), host_layouts.begin() + from,
+                                      [](const std::unique_ptr<host_layout>& row) {
+                                          return row->visible;
+                                      });
+        for (size_t index = from; index < host_layouts.size(); index++) {
+            auto& row = host_layouts[index];
+            hostid_to_index[row->host_id] = index;
+            if (row->visible)
+                row->set_position(line++);
+        }
+        shown_rows = line;
+        if (flapping_hosts) {
+            flapping_row.set_position(line, 0);
+            flapping_row.show();
+            flapping_row.expose();
+        } else {
+            flapping_row.hide();
+        }
+        status.expose();
+    }
+
+    void on_flapping_expose(ti::window::expose_event& ev) {
+        ev.render.clear(ev.area);
+        std::string text = "~ " + std::to_string(flapping_hosts) + " flapping:";
+        for (auto& item: flaps) {
+            if (!item.second.suppressed)
+                continue;
+            auto index_item = hostid_to_index.find(item.first);
+            if (index_item != hostid_to_index.end())
+                text += " " + host_layouts[index_item->second]->hostname;
+            if (text.size() > flapping_row.columns())
+                break;
+        }
+        ev.render.save_pen().set_pen(host_layout::offline_pen);
+        ev.render.at(0, 0) << text.substr(0, flapping_row.columns());
+        ev.render.restore();
+    }
+
+    // Re-evaluates the filter for a single row, after some of the fields
+    // it matches on have changed.
+    void refilter(size_t index, bool force_relayout = false) {
+        auto& row = host_layouts[index];
+        bool visible = !row->flapping && (!filter || filter->matches(*row));
+        if (force_relayout || visible != row->visible) {
+            row->set_visible(visible);
+            relayout(index);
+        }
+    }
+
+    // Changing the pattern is the only case in which all rows are checked.
+    void set_filter(const std::string& pattern) {
+        filter_text = pattern;
+        try {
+            filter = pattern.empty() ? nullptr : filter_cache.get(pattern);
+            filter_error.clear();
+        } catch (const std::regex_error& e) {
+            // Keep the previous filter until the pattern is valid again.
+            filter_error = e.what();
+            status.expose();
+            return;
+        }
+        for (auto& row: host_layouts) {
+            row->set_visible(!row->flapping && (!filter || filter->matches(*row)));
+        }
+        relayout();
+    }
+
+    bool on_key(ti::window::key_event& ev) {
+        if (editing_filter) {
+            if (ev.is_text()) {
+                set_filter(filter_text + ev.name);
+            } else if (ev.is_key("Backspace")) {
+                auto text = filter_text;
+                // Drop a whole UTF-8 sequence, not just its last byte.
+                while (!text.empty() && (text.back() & 0xC0) == 0x80)
+                    text.pop_back();
+                if (!text.empty())
+                    text.pop_back();
+                set_filter(text);
+            } else if (ev.is_key("Enter")) {
+                editing_filter = false;
+                status.expose();
+            } else if (ev.is_key("Escape")) {
+                editing_filter = false;
+                set_filter("");
+            }
+            return true;
+        }
+
+        if (current_view < views.size() && views[current_view].on_key
+            && views[current_view].on_key(ev)) {
+            return true;
+        }
+        if (ev.is_text() && ev.name == "/") {
+            editing_filter = true;
+            status.expose();
+            return true;
+        }
+        if (current_view == no_view && host_list_keys && host_list_keys(ev)) {
+            return true;
+        }
+        if (ev.is_key("Escape")) {
+            if (current_view < views.size()) {
+                toggle_view(current_view);
+                return true;
+            }
+            if (filter) {
+                set_filter("");
+                return true;
+            }
+        }
+        if (ev.is_text()) {
+            for (size_t i = 0; i < views.size(); i++) {
+                if (views[i].key == ev.name) {
+                    toggle_view(i);
+                    return true;
+                }
+            }
+            for (auto& o: overlays) {
+                if (o.v.key == ev.name) {
+                    toggle_overlay(o);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void on_status_expose(ti::window::expose_event& ev) {
+        ev.render.set_pen(status_pen).clear().at(0, 1);
+        if (editing_filter) {
+            ev.render << "/" << filter_text;
+            if (!filter_error.empty())
+                ev.render << "  (" << filter_error << ")";
+            return;
+        }
+
+        ev.render << format_time(statustime) << statusline;
+
+        std::string summary;
+        if (!rewind_label.empty()) {
+            summary += " " + rewind_label + " ";
+        }
+        if (filter) {
+            summary += " " + filter->pattern + " [" + std::to_string(shown_rows)
+                + "/" + std::to_string(host_layouts.size()) + "] ";
+        }
+        if (!perf_summary.empty()) {
+            summary += " " + perf_summary + " ";
+        }
+        if (!summary.empty() && summary.size() < status.columns()) {
+            auto col = status.columns() - summary.size();
+            ev.render.clear(0, col, summary.size());
+            ev.render.at(0, col) << summary;
+        }
+    }
+
+    void set_perf_summary(const std::string& s) {
+        perf_summary = s;
+        status.expose();
+    }
+
+    void flush() {
+        root.flush();
+    }
+
+    void set_status(const std::string& s) {
+        statustime = time(nullptr);
+        statusline = s;
+        status.expose();
+    }
+
+    // The status line always shows the latest message, while the event log
+    // only keeps those at or above its configured level.
+    void post(event_log_pane::level severity, const std::string& s) {
+        set_status(s);
+        log.append(severity, s);
+    }
+
+    // Updates replayed into a frozen layout happened already.
+    void announce(event_log_pane::level severity, const std::string& s) {
+        if (!frozen)
+            post(severity, s);
+    }
+
+    // Keys handled while the host list is shown.
+    std::function<bool(ti::window::key_event&)> host_list_keys;
+
+    ti::window root;
+    ti::window status;
+    event_log_pane log;
+    unsigned log_lines;
+
+    std::unordered_map<int, size_t> hostid_to_index;
+    std::vector<std::unique_ptr<host_layout>> host_layouts;
+    std::unordered_map<unsigned int, unsigned> host_marks;
+    unsigned shown_rows;
+    std::unordered_map<unsigned int, flap_state> flaps;
+    ti::window flapping_row;
+    unsigned flapping_hosts;
+    const duration_predictor* predictor = nullptr;
+
+    // While frozen, rows only change when told to: nothing is announced, no
+    // progress is shown, and flapping is not tracked.
+    bool frozen = false;
+
+    std::vector<view> views;
+    std::vector<overlay> overlays;
+    std::vector<std::unique_ptr<report_view>> reports;
+    size_t current_view;  // No view means the host list is shown.
+    int64_t last_view_refresh;
+    std::string statusline;
+    std::string perf_summary;
+    time_t statustime;
+
+    std::shared_ptr<const host_filter> filter;
+    host_filter_cache filter_cache;
+    std::string filter_text;
+    std::string filter_error;
+    bool editing_filter;
+    std::string rewind_label;
+};
+
+
+ti::pen screen_layout::status_pen = { ti::pen::bg(4) };
+
+
+/*
+ * Pausing freezes the host list, while everything else keeps going. While
+ * paused, the host list can go back to any moment kept by the timeline: a
+ * monitor of its own is fed the state at that moment, and it updates the
+ * layout in turn. Resuming shows the state of the live monitor again.
+ */
+struct rewind_control {
+    rewind_control(screen_layout& layout_, icecc_monitor& live_, const stream::timeline& timeline_)
+        : layout(layout_)
+        , live(live_)
+        , timeline(timeline_)
+        , position(0)
+        , labelled(0)
+        , rebuild_usec(0)
+    { }
+
+    bool paused() const { return layout.frozen; }
+
+    bool on_key(ti::window::key_event& ev) {
+        static constexpr int64_t step_usec = 5 * 1000 * 1000;
+        static constexpr int64_t page_usec = 60 * 1000 * 1000;
+        if (ev.is_text() && ev.name == "p") {
+            if (paused())
+                resume();
+            else
+                pause();
+            return true;
+        }
+        if (!paused())
+            return false;
+        if (ev.is_key("Left"))
+            seek(position - step_usec);
+        else if (ev.is_key("Right"))
+            seek(position + step_usec);
+        else if (ev.is_key("PageUp"))
+            seek(position - page_usec);
+        else if (ev.is_key("PageDown"))
+            seek(position + page_usec);
+        else if (ev.is_key("Home"))
+            seek(timeline.oldest());
+        else if (ev.is_key("End"))
+            seek(timeline.newest());
+        else
+            return false;
+        return true;
+    }
+
+    // Called every frame, to keep how long ago up to date.
+    void update(int64_t now) {
+        if (paused() && now - labelled >= 1000 * 1000)
+            label(now);
+    }
+
+private:
+    void pause() {
+        layout.frozen = true;
+        position = now_usec();
+        label(position);
+    }
+
+    void resume() {
+        replay.reset();
+        layout.reset();
+        layout.frozen = false;
+        live.for_each([this](const host_info& host) { layout.host_info_updated(host); },
+                      [this](const job_info& job) { layout.job_info_updated(job); });
+        layout.set_rewind_label("");
+    }
+
+    void seek(int64_t when) {
+        if (!timeline.newest())
+            return;
+        auto started = now_usec();
+        layout.reset();
+        replay = std::make_unique<icecc_monitor>(
+            [this](const host_info& host) { layout.host_info_updated(host); },
+            [this](const job_info& job) { layout.job_info_updated(job); });
+        auto& monitor = *replay;
+        stream::decoder decoder {
+            [&monitor](const stream::host_state& host) { monitor.apply(host); },
+            [&monitor](const stream::job_state& job, const std::string& filename) {
+                monitor.apply(job, filename);
+            },
+        };
+        if (auto reached = timeline.replay(when, decoder))
+            position = reached;
+        rebuild_usec = now_usec() - started;
+        label(now_usec());
+    }
+
+    void label(int64_t now) {
+        auto ago = (now - position) / (1000 * 1000);
+        auto kept = (timeline.newest() - timeline.oldest()) / (1000 * 1000);
+        std::string text = "Paused " + format_time(time(nullptr) - ago) + "-"
+            + std::to_string(ago) + "s of " + std::to_string(kept) + "s";
+        if (replay)
+            text += ", " + std::to_string(rebuild_usec / 1000) + "ms";
+        layout.set_rewind_label(text);
+        labelled = now;
+    }
+
+    screen_layout&                 layout;
+    icecc_monitor&                 live;
+    const stream::timeline&        timeline;
+    std::unique_ptr<icecc_monitor> replay;
+    int64_t                        position;  // Moment shown, from now_usec().
+    int64_t                        labelled;
+    int64_t                        rebuild_usec;
+};
+
+
+/*
+ * Turns the pipeline counters into per-second figures for the status line.
+ */
+struct pipeline_meter {
+    pipeline_meter(pipeline_stats& stats_, bool threaded_)
+        : stats(stats_)
+        , threaded(threaded_)
+        , last_time(now_usec())
+    { }
+
+    void frame_rendered(int64_t usec) {
+        max_frame_usec = std::max(max_frame_usec, usec);
+    }
+
+    // Returns whether a new summary was produced.
+    bool update(std::string& summary) {
+        auto t = now_usec();
+        auto elapsed = t - last_time;
+        if (elapsed < 1000000)
+            return false;
+
+        uint64_t received = stats.received;
+        uint64_t read_usec = stats.read_usec;
+        uint64_t stalls = stats.stalls;
+
+        char buffer[160];
+        summary.clear();
+        if (threaded) {
+            snprintf(buffer, sizeof(buffer),
+                     "in %llu/s read %.1f%% stalls %llu | q %zu %.1fms | frame %.1fms | ",
+                     static_cast<unsigned long long>((received - last_received) * 1000000 / elapsed),
+                     (read_usec - last_read_usec) * 100.0 / elapsed,
+                     static_cast<unsigned long long>(stalls - last_stalls),
+                     stats.max_queue_depth,
+                     stats.max_queue_delay_usec / 1000.0,
+                     max_frame_usec / 1000.0);
+            summary += buffer;
+        }
+        snprintf(buffer, sizeof(buffer), "lag %.1fKiB %.0fms shed %llu",
+                 stats.pending_bytes / 1024.0,
+                 stats.max_lag_usec / 1000.0,
+                 static_cast<unsigned long long>(stats.shed));
+        summary += buffer;
+
+        last_time = t;
+        last_received = received;
+        last_read_usec = read_usec;
+        last_stalls = stalls;
+        stats.max_queue_depth = 0;
+        stats.max_queue_delay_usec = 0;
+        stats.max_lag_usec = 0;
+        max_frame_usec = 0;
+        return true;
+    }
+
+private:
+    pipeline_stats& stats;
+    bool     threaded;
+    int64_t  last_time;
+    uint64_t last_received  = 0;
+    uint64_t last_read_usec = 0;
+    uint64_t last_stalls    = 0;
+    int64_t  max_frame_usec = 0;
+};
+
+
+/*
+ * Writes job timelines in the Chrome trace event format, which Perfetto
+ * and chrome://tracing can open. Each host is a process with one thread
+ * per job slot; jobs are complete events, written when they end, the time
+ * jobs wait for a server shows as async spans on their client, and the
+ * load of each host is a counter. Events go out through a bounded buffer,
+ * so memory use only depends on the number of jobs in flight.
+ */
+struct trace_writer {
+    static constexpr size_t buffer_size = 256 * 1024;
+
+    trace_writer(FILE* output_)
+        : output(output_)
+        , start_usec(now_usec())
+        , buffer("[")
+        , events(0)
+    { }
+
+    void host_updated(const host_info& host) {
+        auto& h = hosts[host.id];
+        if (h.name != host.name) {
+            h.name = host.name;
+            std::string args = "{\"name\":";
+            json_string(args, host.name + " (" + host.platform + ")");
+            metadata("process_name", host.id, 0, args + "}");
+        }
+        if (!host.offline && host.load != h.load) {
+            h.load = host.load;
+            char event[120];
+            snprintf(event, sizeof(event), "{\"ph\":\"C\",\"name\":\"Load\",\"pid\":%u,"
+                     "\"ts\":%lld,\"args\":{\"load\":%d}}",
+                     host.id, static_cast<long long>(now_usec() - start_usec), host.load);
+            append(event);
+        }
+    }
+
+    void job_updated(const job_info& job) {
+        switch (job.state) {
+            case job_info::LOCAL:
+                job_started(job, job.client_id, now_usec());
+                break;
+            case job_info::COMPILING:
+                if (job.submitted_usec && job.started_usec) {
+                    queue_span("b", job, job.submitted_usec);
+                    queue_span("e", job, job.started_usec);
+                }
+                job_started(job, job.server_id, job.started_usec ? job.started_usec : now_usec());
+                break;
+            case job_info::FINISHED:
+            case job_info::FAILED:
+                job_stopped(job);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Writes out the buffered events.
+    void flush() {
+        if (!buffer.empty())
+            fwrite(buffer.data(), 1, buffer.size(), output);
+        buffer.clear();
+        fflush(output);
+    }
+
+    // Ends the trace; jobs still running are left out.
+    void finish() {
+        buffer += "\n]\n";
+        flush();
+    }
+
+private:
+    struct host_track {
+        std::string       name;
+        int               load = -1;
+        std::vector<bool> slots;  // In use.
+        size_t            named_slots = 0;
+    };
+
+    struct running_job {
+        unsigned int host_id;
+        size_t       slot;
+        int64_t      start_usec;
+    };
+
+    static void json_string(std::string& out, const std::string& s) {
+        out += '"';
+        for (unsigned char c: s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c < 0x20) {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out += escape;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    void append(const std::string& event) {
+        if (events++)
+            buffer += ',';
+        buffer += '\n';
+        buffer += event;
+        if (buffer.size() >= buffer_size)
+            flush();
+    }
+
+    void metadata(const char* name, unsigned int pid, size_t tid, const std::string& args) {
+        char event[120];
+        snprintf(event, sizeof(event), "{\"ph\":\"M\",\"name\":\"%s\",\"pid\":%u,\"tid\":%zu,\"args\":",
+                 name, pid, tid);
+        append(event + args + "}");
+    }
+
+    void queue_span(const char* phase, const job_info& job, int64_t usec) {
+        char event[160];
+        snprintf(event, sizeof(event), "{\"ph\":\"%s\",\"cat\":\"queue\",\"name\":\"Waiting\","
+                 "\"id\":%u,\"pid\":%u,\"tid\":0,\"ts\":%lld}",
+                 phase, job.id, job.client_id, static_cast<long long>(usec - start_usec));
+        append(event);
+    }
+
+    void job_started(const job_info& job, unsigned int host_id, int64_t usec) {
+        if (!host_id || running.count(job.id))
+            return;
+        auto& h = hosts[host_id];
+        auto slot = std::find(h.slots.begin(), h.slots.end(), false) - h.slots.begin();
+        if (static_cast<size_t>(slot) == h.slots.size())
+            h.slots.push_back(false);
+        h.slots[slot] = true;
+        for (; h.named_slots < h.slots.size(); h.named_slots++) {
+            metadata("thread_name", host_id, h.named_slots,
+                     "{\"name\":\"Slot " + std::to_string(h.named_slots + 1) + "\"}");
+        }
+        running.emplace(job.id, running_job { host_id, static_cast<size_t>(slot), usec });
+    }
+
+    void job_stopped(const job_info& job) {
+        auto item = running.find(job.id);
+        if (item == running.end())
+            return;
+        auto r = item->second;
+        running.erase(item);
+        hosts[r.host_id].slots[r.slot] = false;
+
+        auto slash = job.filename.rfind('/');
+        std::string event = "{\"ph\":\"X\",\"cat\":";
+        event += job.server_id ? "\"remote\"" : "\"local\"";
+        event += ",\"name\":";
+        json_string(event, slash == std::string::npos ? job.filename : job.filename.substr(slash + 1));
+        char fields[160];
+        snprintf(fields, sizeof(fields), ",\"pid\":%u,\"tid\":%zu,\"ts\":%lld,\"dur\":%lld,"
+                 "\"args\":{\"exit_code\":%d,\"user_msec\":%u,\"sys_msec\":%u,\"client\":",
+                 r.host_id, r.slot, static_cast<long long>(r.start_usec - start_usec),
+                 static_cast<long long>(std::max<int64_t>(now_usec() - r.start_usec, 0)),
+                 job.exit_code, job.user_msec, job.sys_msec);
+        event += fields;
+        auto client = hosts.find(job.client_id);
+        json_string(event, client == hosts.end() ? std::to_string(job.client_id) : client->second.name);
+        event += ",\"file\":";
+        json_string(event, job.filename);
+        append(event + "}}");
+    }
+
+    FILE*                                          output;
+    int64_t                                        start_usec;
+    std::string                                    buffer;
+    uint64_t                                       events;
+    std::unordered_map<unsigned int, host_track>   hosts;
+    std::unordered_map<unsigned int, running_job>  running;
+};
+
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+static uint64_t resident_bytes()
+{
+    long size = 0, resident = 0;
+    if (FILE* statm = fopen("/proc/self/statm", "r")) {
+        if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    return static_cast<uint64_t>(resident) * sysconf(_SC_PAGESIZE);
+}
+
+
+/*
+ * icetop's own costs, sampled every second for the debug overlay and the
+ * --self-stats dump. Also measures the latency from the arrival of each
+ * message to the flush of the frame which shows its effects; with -t the
+ * arrival time of a batch is that of its oldest message, so it is an
+ * upper bound.
+ */
+struct self_profile {
+    struct sample {
+        double   seconds;
+        double   messages;         // All of these are per second.
+        double   types[max_message_type];
+        double   handle_usec;
+        double   callbacks;
+        double   frames;
+        double   tty_bytes;
+        double   exposes_per_frame;
+        double   render_usec_per_frame;
+        double   flush_usec_per_frame;
+        int64_t  max_flush_usec;
+        double   cpu_percent;
+        uint64_t rss_bytes;
+        size_t   jobs;
+        size_t   hosts;
+    };
+
+    self_profile()
+        : last_time(now_usec())
+        , last_counters(ti::get_counters())
+        , last_cpu(cpu_seconds())
+        , last_received()
+        , last_handle_usec(0)
+        , last_callbacks(0)
+        , frames(0)
+        , flush_usec(0)
+        , max_flush_usec(0)
+        , current()
+    { }
+
+    // Called for each update delivered to the display.
+    void update_delivered(int64_t arrival_usec) {
+        pending.push_back(arrival_usec);
+    }
+
+    void frame_flushed(int64_t started_usec) {
+        auto t = now_usec();
+        for (auto arrival: pending) {
+            latency.add(t - arrival);
+            recent_latency.add(t - arrival);
+        }
+        pending.clear();
+        frames++;
+        flush_usec += t - started_usec;
+        max_flush_usec = std::max(max_flush_usec, t - started_usec);
+    }
+
+    // Returns true when a new sample is available, once per second.
+    bool update(const icecc_monitor& monitor) {
+        auto t = now_usec();
+        if (t - last_time < 1000 * 1000)
+            return false;
+
+        double elapsed = (t - last_time) / 1000000.0;
+        auto& stats = monitor.stats;
+        auto& counters = ti::get_counters();
+        current.seconds = elapsed;
+        current.messages = 0;
+        for (unsigned type = 0; type < max_message_type; type++) {
+            current.types[type] = (stats.types[type].received - last_received[type]) / elapsed;
+            current.messages += current.types[type];
+            last_received[type] = stats.types[type].received;
+        }
+        current.handle_usec = (stats.handle_usec - last_handle_usec) / elapsed;
+        current.callbacks = (stats.callbacks - last_callbacks) / elapsed;
+        current.frames = frames / elapsed;
+        current.tty_bytes = (counters.bytes_written - last_counters.bytes_written) / elapsed;
+        auto f = std::max<uint64_t>(frames, 1);
+        current.exposes_per_frame = double(counters.expose_events - last_counters.expose_events) / f;
+        current.render_usec_per_frame = double(counters.expose_usec - last_counters.expose_usec) / f;
+        current.flush_usec_per_frame = double(flush_usec) / f;
+        current.max_flush_usec = max_flush_usec;
+        auto cpu = cpu_seconds();
+        current.cpu_percent = (cpu - last_cpu) * 100 / elapsed;
+        last_cpu = cpu;
+        current.rss_bytes = resident_bytes();
+        current.jobs = monitor.job_count();
+        current.hosts = monitor.host_count();
+
+        recent_summary = recent_latency;
+        recent_latency.clear();
+        last_time = t;
+        last_counters = counters;
+        last_handle_usec = stats.handle_usec;
+        last_callbacks = stats.callbacks;
+        frames = 0;
+        flush_usec = 0;
+        max_flush_usec = 0;
+        return true;
+    }
+
+    void describe(std::vector<std::string>& lines) const {
+        char buffer[120];
+        auto& s = current;
+        snprintf(buffer, sizeof(buffer), "Messages  %8.0f/s  handlers %.1f%% %.1fus/msg",
+                 s.messages, s.handle_usec / 10000.0,
+                 s.messages > 0 ? s.handle_usec / s.messages : 0.0);
+        lines.emplace_back(buffer);
+        for (unsigned type = 0; type < max_message_type; type++) {
+            if (s.types[type] <= 0)
+                continue;
+            auto name = icecc_monitor::message_type_name(type);
+            snprintf(buffer, sizeof(buffer), "  %-20s %8.0f/s",
+                     name ? name : ("#" + std::to_string(type)).c_str(), s.types[type]);
+            lines.emplace_back(buffer);
         }
+        snprintf(buffer, sizeof(buffer), "Callbacks %8.0f/s", s.callbacks);
+        lines.emplace_back(buffer);
+        snprintf(buffer, sizeof(buffer), "Frames    %8.1f/s  %.1f exposes/frame",
+                 s.frames, s.exposes_per_frame);
+        lines.emplace_back(buffer);
+        snprintf(buffer, sizeof(buffer), "Flush     %7.2fms  render %.2fms max %.2fms",
+                 s.flush_usec_per_frame / 1000, s.render_usec_per_frame / 1000,
+                 s.max_flush_usec / 1000.0);
+        lines.emplace_back(buffer);
+        snprintf(buffer, sizeof(buffer), "Terminal  %7.1fKiB/s", s.tty_bytes / 1024);
+        lines.emplace_back(buffer);
+        snprintf(buffer, sizeof(buffer), "Memory    %7.1fMiB  %zu jobs %zu hosts",
+                 s.rss_bytes / (1024.0 * 1024.0), s.jobs, s.hosts);
+        lines.emplace_back(buffer);
+        snprintf(buffer, sizeof(buffer), "CPU       %7.1f%%", s.cpu_percent);
+        lines.emplace_back(buffer);
+        lines.emplace_back("Latency, message to screen:");
+        describe_latency(lines, "  last second", recent_summary);
+        describe_latency(lines, "  overall", latency);
+    }
+
+    // Latencies since startup include those of previous runs.
+    void save(snapshot::writer& w) const {
+        w.section(SNAPSHOT_LATENCY);
+        w.raw(latency);
     }
 
-    void host_info_updated(const host_info& host) {
-        hostname = host.name;
-        platform = host.platform;
-        window.expose();
+    void load(snapshot::reader& r) {
+        util::log_histogram saved;
+        if (r.section(SNAPSHOT_LATENCY) && r.raw(saved))
+            latency = saved;
     }
 
-    void job_info_updated(const job_info& job) {
-        if (job.state == job_info::WAITING)
-            return;
-        if (job.server()) {
-            origin = job.client()->name;
-        } else {
-            origin = "";
+    // Writes the last sample as a line of JSON.
+    void dump(FILE* output) const {
+        auto& s = current;
+        fprintf(output, "{\"time\":%lld,\"messages\":%.1f,\"types\":{",
+                static_cast<long long>(time(nullptr)), s.messages);
+        const char* separator = "";
+        for (unsigned type = 0; type < max_message_type; type++) {
+            if (s.types[type] <= 0)
+                continue;
+            auto name = icecc_monitor::message_type_name(type);
+            fprintf(output, "%s\"%s\":%.1f", separator,
+                    name ? name : ("#" + std::to_string(type)).c_str(), s.types[type]);
+            separator = ",";
         }
-        state = job.state;
-        state_string = job.state_string();
-        filename = job.filename;
-        window.expose();
+        fprintf(output, "},\"handle_usec\":%.0f,\"callbacks\":%.1f,\"frames\":%.1f,"
+                "\"exposes_per_frame\":%.1f,\"render_usec_per_frame\":%.0f,"
+                "\"flush_usec_per_frame\":%.0f,\"max_flush_usec\":%lld,\"tty_bytes\":%.0f,"
+                "\"cpu_percent\":%.1f,\"rss_bytes\":%llu,\"jobs\":%zu,\"hosts\":%zu,\"latency_usec\":{",
+                s.handle_usec, s.callbacks, s.frames, s.exposes_per_frame,
+                s.render_usec_per_frame, s.flush_usec_per_frame,
+                static_cast<long long>(s.max_flush_usec), s.tty_bytes, s.cpu_percent,
+                static_cast<unsigned long long>(s.rss_bytes), s.jobs, s.hosts);
+        fprintf(output, "\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}}\n",
+                static_cast<unsigned long long>(recent_summary.count()),
+                static_cast<unsigned long long>(recent_summary.percentile(0.5)),
+                static_cast<unsigned long long>(recent_summary.percentile(0.9)),
+                static_cast<unsigned long long>(recent_summary.percentile(0.99)),
+                static_cast<unsigned long long>(recent_summary.max()));
+        fflush(output);
     }
 
-    ti::pen* state_pen() const {
-        switch (state) {
-            case job_info::FAILED:
-                return &warn_pen;
-            case job_info::FINISHED:
-                return &okay_pen;
-            case job_info::LOCAL:
-            case job_info::COMPILING:
-                return &busy_pen;
-            default:
-                return nullptr;
-        }
+private:
+    static void describe_latency(std::vector<std::string>& lines, const char* label,
+                                 const util::log_histogram& h) {
+        char buffer[120];
+        snprintf(buffer, sizeof(buffer), "%-14s p50 %.1fms p90 %.1fms p99 %.1fms max %.1fms",
+                 label, h.percentile(0.5) / 1000.0, h.percentile(0.9) / 1000.0,
+                 h.percentile(0.99) / 1000.0, h.max() / 1000.0);
+        lines.emplace_back(buffer);
     }
 
-    ti::window window;
-    std::string hostname;
-    std::string platform;
-    std::string filename;
-    std::string origin;
-    const char *state_string;
-    job_info::job_state state;
+    int64_t              last_time;
+    ti::counters         last_counters;
+    double               last_cpu;
+    uint64_t             last_received[max_message_type];
+    uint64_t             last_handle_usec;
+    uint64_t             last_callbacks;
+    uint64_t             frames;
+    int64_t              flush_usec;
+    int64_t              max_flush_usec;
+    std::vector<int64_t> pending;  // Arrival times of updates not yet shown.
+    util::log_histogram  latency;
+    util::log_histogram  recent_latency;
+    util::log_histogram  recent_summary;
+    sample               current;
 };
 
-ti::pen host_layout::line_pens[2] = {
-    { ti::pen::bg() },
-    { ti::pen::bg(234) },
-};
-ti::pen host_layout::busy_pen = { ti::pen::fg(3), ti::pen::bold };
-ti::pen host_layout::okay_pen = { ti::pen::fg(2), ti::pen::bold };
-ti::pen host_layout::warn_pen = { ti::pen::fg(1), ti::pen::bold };
-ti::pen host_layout::host_pen = { ti::pen::fg(7), ti::pen::bold };
 
+/*
+ * Lists the counters for each type of message seen so far.
+ */
+static void message_types_report(std::vector<std::string>& lines, const pipeline_stats& stats)
+{
+    char buffer[120];
+    snprintf(buffer, sizeof(buffer), "%-22s %10s %10s %10s %10s %10s",
+             "Type", "Received", "Handled", "Ignored", "KiB", "usec/msg");
+    lines.emplace_back(buffer);
+    for (unsigned type = 0; type < max_message_type; type++) {
+        auto& t = stats.types[type];
+        if (!t.received)
+            continue;
+        auto name = icecc_monitor::message_type_name(type);
+        std::string label = name ? name : "#" + std::to_string(type) + " (no handler)";
+        snprintf(buffer, sizeof(buffer), "%-22s %10llu %10llu %10llu %10.1f %10.1f",
+                 label.c_str(),
+                 static_cast<unsigned long long>(t.received),
+                 static_cast<unsigned long long>(t.handled),
+                 static_cast<unsigned long long>(t.ignored),
+                 t.bytes / 1024.0,
+                 double(t.handle_usec) / t.received);
+        lines.emplace_back(buffer);
+    }
+}
 
-struct screen_layout {
-    static ti::pen status_pen;
 
-    screen_layout(ti::terminal& term)
-        : root(ti::window(term))
-        , status(root, { root.lines() - 1, 0, 1, root.columns() })
-    {
-        status.on_expose([this](ti::window::expose_event& ev) {
-            char timestring[15];
-            struct tm *t = localtime(&statustime);
-            strftime(timestring, sizeof(timestring), "[%H:%M:%S] ", t);
-            ev.render.set_pen(status_pen).clear().at(0, 1) << timestring << statusline;
-            return true;
-        });
+#include <signal.h>
 
-        root.on_expose([](ti::window::expose_event& ev) {
-            // Just clear the backgrond. Avoids ghost text after certain
-            // kinds of geometry changes.
-            ev.render.clear(ev.area);
-            return true;
-        });
+static bool running = true;
+static void handle_sigint(int)
+{
+    running = false;
+}
 
-        root.on_geometry_change([this, &term](ti::window::geometry_change_event& ev) {
-            auto geom = status.geometry();
-            assert(geom.top > 0);
-            geom.top--;
-            status.set_geometry(geom);
-            term.clear();
-            root.expose();
-            return true;
-        });
+
+static void usage(const char* argv0)
+{
+    printf("Usage: %s [-h] [-t] [-S] [-n netname] [-l loglines]"
+           " [-e debug|info|notice|warning|error] [-f file-stats.tsv]"
+           " [--history[=DIR]] [--self-stats=FILE] [--trace=FILE] [--connect=ADDRESS]"
+           " [--offline-grace=SECONDS] [--flap-limit=N] [--rewind=MINUTES]"
+           " [--state=FILE|--no-state]\n"
+           "       %s [-t] [-n netname] --serve=ADDRESS\n"
+           "       %s [--history=DIR] --query [TERM...]\n"
+           "       %s [--history=DIR] [--state=FILE] --simulate [TERM...]\n",
+           argv0, argv0, argv0, argv0);
+}
+
+
+// The hosts saved by the last run, as written by icecc_monitor::save().
+// Hosts saved offline are left out, and so are the older identifiers of
+// daemons which came back under a new one: only the latest is kept.
+static bool load_farm(const std::string& path, std::vector<history::farm_host>& farm)
+{
+    std::string error;
+    auto saved = path.empty() ? nullptr : snapshot::reader::open(path, error);
+    if (!error.empty())
+        fprintf(stderr, "%s\n", error.c_str());
+    if (!saved || !saved->section(SNAPSHOT_HOSTS)) {
+        fprintf(stderr, "No hosts saved in %s; run icetop with --state first\n",
+                path.empty() ? "the state file" : path.c_str());
+        return false;
     }
 
-    void host_info_updated(const host_info& host) {
-        if (host.offline) {
-            set_status("Host " + host.name + " went offline");
-            auto index_item = hostid_to_index.find(host.id);
-            if (index_item == hostid_to_index.end()) {
-                // No line for it: do nothing.
-                return;
-            }
-            auto index = index_item->second;
-            host_layouts.erase(host_layouts.begin() + index);
-            for (auto it = host_layouts.begin() + index; it != host_layouts.end(); ++it) {
-                it->get()->move_up();
-            }
-            hostid_to_index.erase(index_item);
-        } else {
-            auto index_item = hostid_to_index.find(host.id);
-            if (index_item == hostid_to_index.end()) {
-                set_status("Host " + host.name + " (" + host.platform + ") came online");
-                unsigned index = host_layouts.size();  // Add it at the end.
-                ti::window w { root, { index, 0, 1, root.columns() } };
-                host_layouts.emplace_back(std::make_unique<host_layout>(std::move(w), host));
-                hostid_to_index[host.id] = index;
-            } else {
-                set_status("Host " + host.name + " (" + host.platform + ") is still online");
-                host_layouts[index_item->second]->host_info_updated(host);
-            }
+    std::unordered_map<std::string, std::pair<uint64_t, history::farm_host>> latest;
+    size_t offline = 0, stale = 0;
+    while (saved->more()) {
+        auto id = saved->u64();
+        history::farm_host host;
+        host.name = saved->str();
+        host.platform = saved->shared_str();
+        host.max_jobs = saved->u64();
+        saved->i64();  // Load.
+        bool is_offline = saved->u64();
+        if (!saved->ok())
+            break;
+        if (is_offline) {
+            offline++;
+            continue;
+        }
+        auto item = latest.find(host.name);
+        if (item == latest.end()) {
+            latest.emplace(host.name, std::make_pair(id, std::move(host)));
+            continue;
         }
+        stale++;
+        if (id > item->second.first)
+            item->second = std::make_pair(id, std::move(host));
     }
 
-    void job_info_updated(const job_info& job) {
-        auto index_item = hostid_to_index.find(job.server() ? job.server_id : job.client_id);
-        if (index_item == hostid_to_index.end())
-            return;
-        host_layouts[index_item->second]->job_info_updated(job);
+    for (auto& item: latest)
+        farm.push_back(std::move(item.second.second));
+    std::sort(farm.begin(), farm.end(), [](const history::farm_host& a, const history::farm_host& b) {
+        return a.name < b.name;
+    });
+    if (offline || stale) {
+        printf("Left out %zu hosts saved offline, and %zu older entries of hosts"
+               " which reconnected\n", offline, stale);
     }
+    if (farm.empty()) {
+        fprintf(stderr, "No online hosts saved in %s\n", path.c_str());
+        return false;
+    }
+    return true;
+}
 
-    void flush() {
-        root.flush();
+
+/*
+ * Holds the only connection to the scheduler, and serves the model to any
+ * number of viewers (icetop --connect=ADDRESS), without a user interface.
+ */
+static int serve(const std::string& address, bool threaded)
+{
+    static constexpr size_t ingest_queue_size = 64 * 1024;
+    static constexpr int64_t drain_budget_usec = 20 * 1000;
+    static constexpr int64_t tick_msec = 100;
+
+    icecc_monitor monitor;
+    auto server = stream::server::open(address, monitor.filenames());
+    if (!server) {
+        return EXIT_FAILURE;
     }
+    monitor.add_host_observer([&server](const host_info& host) {
+        server->model().host_updated(stream_state(host));
+    });
+    monitor.add_job_observer([&server](const job_info& job) {
+        server->model().job_updated(stream_state(job));
+    });
 
-    void set_status(const std::string& s) {
-        statustime = time(nullptr);
-        statusline = s;
-        status.expose();
+    if (threaded) {
+        monitor.start_ingest_thread(ingest_queue_size);
+    } else {
+        go(monitor.check_scheduler());
+        go(monitor.listen());
     }
 
-    ti::window root;
-    ti::window status;
+    signal(SIGINT, handle_sigint);
+    signal(SIGTERM, handle_sigint);
+    printf("Serving on %s\n", address.c_str());
+    fflush(stdout);
 
-    std::unordered_map<int, size_t> hostid_to_index;
-    std::vector<std::unique_ptr<host_layout>> host_layouts;
-    std::string statusline;
-    time_t statustime;
-};
+    bool was_online = false;
+    size_t viewers = 0;
+    while (running) {
+        if (threaded) {
+            monitor.drain(drain_budget_usec);
+        }
+        server->tick();
+        monitor.collect_filenames([&server](util::string_table::in_use& in_use) {
+            server->model().mark_strings(in_use);
+        });
 
+        if (monitor.online() != was_online) {
+            was_online = monitor.online();
+            if (was_online)
+                printf("Connected to scheduler %s\n", monitor.scheduler_host().c_str());
+            else
+                printf("Lost the scheduler, reconnecting\n");
+            fflush(stdout);
+        }
+        if (server->viewers() != viewers) {
+            viewers = server->viewers();
+            printf("%zu viewers, %llu bytes sent so far\n", viewers,
+                   static_cast<unsigned long long>(server->bytes_sent()));
+            fflush(stdout);
+        }
+        msleep(now() + tick_msec);
+    }
+    return EXIT_SUCCESS;
+}
 
-ti::pen screen_layout::status_pen = { ti::pen::bg(4) };
 
+// The whole argument must be the number, unlike with std::sto*(), which
+// accept trailing garbage and throw on anything else.
+static bool parse_number(const char* text, double& value)
+{
+    char* end;
+    errno = 0;
+    value = strtod(text, &end);
+    return end != text && !*end && !errno;
+}
 
-#include <signal.h>
+static bool parse_number(const char* text, int64_t& value)
+{
+    char* end;
+    errno = 0;
+    value = strtoll(text, &end, 10);
+    return end != text && !*end && !errno;
+}
 
-static bool running = true;
-static void handle_sigint(int)
+static bool parse_number(const char* text, unsigned& value)
 {
-    running = false;
+    int64_t number;
+    if (!parse_number(text, number) || number < 0 || number > UINT_MAX)
+        return false;
+    value = static_cast<unsigned>(number);
+    return true;
 }
 
 
 int main(int argc, char **argv)
 {
-    ti::terminal term { };
-    term.wait_ready();
+    unsigned log_lines = 5;
+    auto log_level = event_log_pane::INFO;
+    bool threaded = false;
+    bool shedding = true;
+    std::string file_stats_path;
+    bool record_history = false;
+    bool query_history = false;
+    bool simulate_history = false;
+    std::string history_path = history::default_directory();
+    std::string self_stats_path;
+    std::string serve_address;
+    std::string connect_address;
+    std::string trace_path;
+    double offline_grace = 30;
+    double flap_limit = 4;
+    int64_t rewind_minutes = 10;
+    std::string state_path = snapshot::default_path();
+
+    enum { OPT_HISTORY = 256, OPT_QUERY, OPT_SIMULATE, OPT_SELF_STATS, OPT_SERVE, OPT_CONNECT, OPT_TRACE,
+           OPT_OFFLINE_GRACE, OPT_FLAP_LIMIT, OPT_REWIND, OPT_STATE, OPT_NO_STATE };
+    static const struct option long_options[] = {
+        { "history",    optional_argument, nullptr, OPT_HISTORY    },
+        { "query",      no_argument,       nullptr, OPT_QUERY      },
+        { "simulate",   no_argument,       nullptr, OPT_SIMULATE   },
+        { "self-stats", required_argument, nullptr, OPT_SELF_STATS },
+        { "serve",      required_argument, nullptr, OPT_SERVE      },
+        { "connect",    required_argument, nullptr, OPT_CONNECT    },
+        { "trace",      required_argument, nullptr, OPT_TRACE      },
+        { "offline-grace", required_argument, nullptr, OPT_OFFLINE_GRACE },
+        { "flap-limit", required_argument, nullptr, OPT_FLAP_LIMIT },
+        { "rewind",     required_argument, nullptr, OPT_REWIND     },
+        { "state",      required_argument, nullptr, OPT_STATE      },
+        { "no-state",   no_argument,       nullptr, OPT_NO_STATE   },
+        { nullptr,   0,                 nullptr, 0           },
+    };
 
     int opt;
-    while ((opt = getopt(argc, argv, "hn:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "hn:l:e:tSf:", long_options, nullptr)) != -1) {
+        bool valid = true;
         switch (opt) {
+        case OPT_HISTORY:
+            record_history = true;
+            if (optarg)
+                history_path = optarg;
+            break;
+        case OPT_QUERY:
+            query_history = true;
+            break;
+        case OPT_SIMULATE:
+            simulate_history = true;
+            break;
+        case OPT_SELF_STATS:
+            self_stats_path = optarg;
+            break;
+        case OPT_SERVE:
+            serve_address = optarg;
+            break;
+        case OPT_CONNECT:
+            connect_address = optarg;
+            break;
+        case OPT_TRACE:
+            trace_path = optarg;
+            break;
+        case OPT_OFFLINE_GRACE:
+            valid = parse_number(optarg, offline_grace) && offline_grace >= 0;
+            break;
+        case OPT_FLAP_LIMIT:
+            valid = parse_number(optarg, flap_limit) && flap_limit >= 0;
+            break;
+        case OPT_REWIND:
+            valid = parse_number(optarg, rewind_minutes) && rewind_minutes >= 0;
+            break;
+        case OPT_STATE:
+            state_path = optarg;
+            break;
+        case OPT_NO_STATE:
+            state_path.clear();
+            break;
+        case 'f':
+            file_stats_path = optarg;
+            break;
+        case 't':
+            threaded = true;
+            break;
+        case 'S':
+            shedding = false;
+            break;
         case 'n':
             s_opt_netnames.emplace_back(optarg);
             break;
+        case 'l':
+            valid = parse_number(optarg, log_lines);
+            break;
+        case 'e':
+            if (event_log_pane::parse_level(optarg, log_level))
+                break;
+            // fall-through
         default:
-            term << "Usage: " << argv[0] <<  " [-h] [-n netname]\n";
+            usage(argv[0]);
             return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
         }
+        if (!valid) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
     }
 
-    screen_layout layout { term };
+    if (query_history) {
+        return history::query(history_path, std::vector<std::string>(argv + optind, argv + argc));
+    }
+    if (simulate_history) {
+        std::vector<history::farm_host> farm;
+        if (!load_farm(state_path, farm))
+            return EXIT_FAILURE;
+        return history::simulate(history_path, farm,
+                                 std::vector<std::string>(argv + optind, argv + argc));
+    }
+
+    if (!serve_address.empty()) {
+        return serve(serve_address, threaded);
+    }
+    if (!connect_address.empty()) {
+        threaded = false;  // The aggregator reads from the scheduler.
+    }
+
+    std::unique_ptr<history::writer> history;
+    bool history_busy = false;
+    if (record_history && !(history = history::writer::open(history_path, history_busy))
+        && !history_busy) {
+        return EXIT_FAILURE;
+    }
+
+    ti::terminal term { };
+    term.wait_ready();
 
+    screen_layout layout { term, log_lines, log_level };
+    layout.offline_grace_usec = static_cast<int64_t>(offline_grace * 1000 * 1000);
+    layout.flap_limit = flap_limit;
+
+    self_profile profile;
     icecc_monitor monitor {
-        [&layout](const host_info& host) {
-            layout.host_info_updated(host);
+        [&layout, &profile, &monitor](const host_info& host) {
+            if (!layout.frozen)
+                layout.host_info_updated(host);
+            profile.update_delivered(monitor.arrival_usec);
         },
-        [&layout](const job_info& job) {
-            layout.job_info_updated(job);
+        [&layout, &profile, &monitor](const job_info& job) {
+            if (!layout.frozen)
+                layout.job_info_updated(job);
+            profile.update_delivered(monitor.arrival_usec);
+        }
+    };
+
+    static constexpr size_t ingest_queue_size = 64 * 1024;
+    static constexpr int64_t drain_budget_usec = 20 * 1000;
+
+    monitor.set_load_shedding(shedding);
+
+    auto host_name = [&monitor](unsigned int id) {
+        auto host = monitor.find_host(id);
+        return host ? host->name : "#" + std::to_string(id);
+    };
+
+    client_tracker clients;
+    monitor.add_job_observer([&clients](const job_info& job) {
+        clients.job_updated(job, now_sec());
+    });
+    layout.add_report("c", "Top clients", [&clients, &host_name](std::vector<std::string>& lines, unsigned) {
+        clients.report(lines, now_sec(), host_name);
+    });
+
+    file_stats files;
+    monitor.add_job_observer([&files](const job_info& job) {
+        if (job.state == job_info::FINISHED && job.server_id)
+            files.job_finished(job.filename_id, job.real_msec);
+    });
+    layout.add_report("f", "Slowest files", [&files, &monitor](std::vector<std::string>& lines, unsigned columns) {
+        files.report(lines, columns, monitor.filenames());
+    });
+
+    if (history_busy) {
+        layout.post(event_log_pane::WARNING, "Another icetop records to " + history_path
+                    + ", not recording the history");
+    }
+    if (history) {
+        monitor.add_job_observer([&history, &host_name](const job_info& job) {
+            if ((job.state != job_info::FINISHED && job.state != job_info::FAILED) || !job.submitted_usec)
+                return;
+            auto end = wall_msec();
+            history->append({
+                static_cast<uint64_t>(end - (now_usec() - job.submitted_usec) / 1000),
+                static_cast<uint64_t>(end),
+                host_name(job.client_id),
+                job.server_id ? host_name(job.server_id) : std::string(),
+                job.filename,
+                job.real_msec,
+                job.user_msec,
+                job.sys_msec,
+                job.page_faults,
+                job.exit_code,
+            });
+        });
+    }
+
+    failure_tracker failures;
+    monitor.add_job_observer([&failures](const job_info& job) {
+        failures.job_updated(job, now_sec());
+    });
+    layout.add_report("s", "Server failures", [&failures, &host_name](std::vector<std::string>& lines, unsigned) {
+        failures.report(lines, now_sec(), host_name);
+    });
+
+    health_tracker health;
+    monitor.add_host_observer([&health](const host_info& host) {
+        health.host_updated(host);
+    });
+    monitor.add_job_observer([&health, &layout, &host_name](const job_info& job) {
+        if (!health.job_finished(job))
+            return;
+        auto server = health.find(job.server_id);
+        char buffer[120];
+        if (server->slow) {
+            snprintf(buffer, sizeof(buffer), "Host %s is %.1fx slower than its peers",
+                     host_name(job.server_id).c_str(), server->slowdown());
+        } else {
+            snprintf(buffer, sizeof(buffer), "Host %s is no longer slower than its peers",
+                     host_name(job.server_id).c_str());
+        }
+        layout.post(server->slow ? event_log_pane::WARNING : event_log_pane::NOTICE, buffer);
+        layout.set_host_mark(job.server_id, host_layout::SLOW, server->slow);
+    });
+    layout.add_report("h", "Server health", [&health, &host_name](std::vector<std::string>& lines, unsigned) {
+        health.report(lines, host_name);
+    });
+
+    layout.add_report("t", "Scheduler messages", [&monitor](std::vector<std::string>& lines, unsigned) {
+        message_types_report(lines, monitor.stats);
+    });
+    std::vector<bool> announced_types(max_message_type);
+
+    layout.add_overlay("d", "icetop", 24, 60, [&profile](std::vector<std::string>& lines, unsigned) {
+        profile.describe(lines);
+    });
+    FILE* self_stats = nullptr;
+    if (!self_stats_path.empty() && !(self_stats = fopen(self_stats_path.c_str(), "a"))) {
+        perror(self_stats_path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    FILE* trace_file = nullptr;
+    if (!trace_path.empty() && !(trace_file = fopen(trace_path.c_str(), "w"))) {
+        perror(trace_path.c_str());
+        return EXIT_FAILURE;
+    }
+    std::unique_ptr<trace_writer> trace;
+    if (trace_file) {
+        trace = std::make_unique<trace_writer>(trace_file);
+        monitor.add_host_observer([&trace](const host_info& host) {
+            trace->host_updated(host);
+        });
+        monitor.add_job_observer([&trace](const job_info& job) {
+            trace->job_updated(job);
+        });
+    }
+
+    utilization_history utilization { 512, 5 * 1000 * 1000 };
+    monitor.add_host_observer([&utilization](const host_info& host) {
+        utilization.host_updated(host, now_usec());
+    });
+    monitor.add_job_observer([&utilization](const job_info& job) {
+        utilization.job_updated(job, now_usec());
+    });
+    heatmap_view heatmap { ti::window(layout.root, layout.main_geometry()), utilization };
+    layout.add_view("m", heatmap.window, [&heatmap] { heatmap.refresh(); });
+
+    host_grid_view grid { ti::window(layout.root, layout.main_geometry()), utilization, monitor.hosts(),
+                         layout.host_marks };
+    layout.add_view("g", grid.window, [&grid] { grid.refresh(); },
+                    [&grid](ti::window::key_event& ev) { return grid.on_key(ev); });
+
+    duration_predictor predictor;
+    monitor.add_job_observer([&predictor, &monitor](const job_info& job) {
+        if (job.state != job_info::FINISHED || !job.server_id || !job.real_msec)
+            return;
+        if (auto server = monitor.find_host(job.server_id))
+            predictor.job_finished(job.filename_id, server->platform, job.real_msec);
+    });
+    layout.predictor = &predictor;
+
+    session_tracker sessions;
+    monitor.add_job_observer([&sessions](const job_info& job) {
+        sessions.job_updated(job, now_usec());
+    });
+    layout.add_report("b", "Build sessions", [&](std::vector<std::string>& lines, unsigned) {
+        sessions.report(lines, now_usec(), host_name, monitor.hosts().totals().slots,
+                        [&](uint32_t file, unsigned int server_id) {
+                            auto server = monitor.find_host(server_id);
+                            return predictor.predict(file, server ? server->platform : std::string());
+                        });
+    });
+
+    redundancy_tracker redundancy;
+    monitor.add_job_observer([&redundancy](const job_info& job) {
+        redundancy.job_updated(job, now_sec());
+    });
+    layout.add_report("r", "Redundant compiles", [&](std::vector<std::string>& lines, unsigned columns) {
+        redundancy.report(lines, columns, now_sec(), host_name, monitor.filenames());
+    });
+
+    layout.add_report("o", "Flapping hosts", [&](std::vector<std::string>& lines, unsigned) {
+        layout.flap_report(lines, host_name);
+    });
+
+    job_queue queue;
+    monitor.add_job_observer([&queue](const job_info& job) {
+        queue.job_updated(job, now_usec());
+    });
+    layout.add_report("w", "Waiting jobs", [&](std::vector<std::string>& lines, unsigned columns) {
+        queue.report(lines, columns, now_usec(), host_name, monitor.filenames(), utilization.free_slots());
+    });
+
+    stream::timeline timeline { monitor.filenames(), rewind_minutes * 60 * 1000 * 1000,
+                                10 * 1000 * 1000, 256 * 1024 * 1024 };
+    if (rewind_minutes > 0) {
+        monitor.add_host_observer([&timeline](const host_info& host) {
+            timeline.host_updated(stream_state(host));
+        });
+        monitor.add_job_observer([&timeline](const job_info& job) {
+            timeline.job_updated(stream_state(job));
+        });
+    }
+    rewind_control rewind { layout, monitor, timeline };
+    layout.host_list_keys = [&rewind](ti::window::key_event& ev) { return rewind.on_key(ev); };
+
+    static constexpr int64_t save_state_msec = 5 * 60 * 1000;
+    // Returns an empty string, or why the state could not be saved.
+    auto save_state = [&]() {
+        snapshot::writer w;
+        monitor.save(w);
+        files.save(w, monitor.filenames());
+        predictor.save(w, monitor.filenames());
+        profile.save(w);
+        std::string error;
+        w.save(state_path, error);
+        return error;
+    };
+    int64_t last_saved = now();
+    if (!state_path.empty()) {
+        std::string error;
+        auto saved = snapshot::reader::open(state_path, error);
+        if (!error.empty()) {
+            layout.post(event_log_pane::ERROR, error);
+        }
+        if (saved) {
+            auto intern = [&monitor](const std::string& name) { return monitor.intern_filename(name); };
+            monitor.load(*saved);
+            files.load(*saved, intern);
+            predictor.load(*saved, intern);
+            profile.load(*saved);
         }
+    }
+
+    static constexpr int64_t reconnect_msec = 2000;
+    std::unique_ptr<stream::client> upstream;
+    stream::decoder decoder {
+        [&monitor](const stream::host_state& host) { monitor.apply(host); },
+        [&monitor](const stream::job_state& job, const std::string& filename) {
+            monitor.apply(job, filename);
+        },
     };
+    int64_t last_connect_attempt = 0;
 
-    term << "Waiting for scheduler...\n";
-    go(monitor.check_scheduler());
-    while (!monitor.scheduler) msleep(now() + 100);
+    if (!connect_address.empty()) {
+        term << "Connecting to " << connect_address << "...\n";
+        while (!(upstream = stream::client::connect(connect_address))) {
+            if (errno != ENOENT && errno != ECONNREFUSED) {
+                term << connect_address << ": " << strerror(errno) << "\n";
+                return EXIT_FAILURE;
+            }
+            msleep(now() + reconnect_msec);
+        }
+        monitor.set_online(connect_address);
+    } else {
+        term << "Waiting for scheduler...\n";
+        if (threaded) {
+            monitor.start_ingest_thread(ingest_queue_size);
+        } else {
+            go(monitor.check_scheduler());
+        }
+        while (!monitor.online()) msleep(now() + 100);
 
-    go(monitor.listen());
+        if (!threaded) {
+            go(monitor.listen());
+        }
+    }
 
     term.set(ti::terminal::altscreen).clear();
 
+    pipeline_meter meter { monitor.stats, threaded };
+
     signal(SIGINT, handle_sigint);
     while (running) {
+        if (threaded) {
+            monitor.drain(drain_budget_usec);
+        }
+        if (upstream) {
+            monitor.arrival_usec = now_usec();
+            if (!upstream->poll(decoder)) {
+                upstream.reset();
+                last_connect_attempt = now();
+                layout.post(event_log_pane::ERROR, "Lost the connection to " + connect_address);
+            }
+        } else if (!connect_address.empty() && now() - last_connect_attempt >= reconnect_msec) {
+            last_connect_attempt = now();
+            if ((upstream = stream::client::connect(connect_address)))
+                layout.post(event_log_pane::NOTICE, "Connected again to " + connect_address);
+        }
+
+        monitor.expire_restored();
+        utilization.advance(now_usec());
+        grid.update();
+        if (rewind_minutes > 0) {
+            timeline.tick(now_usec());
+        }
+        rewind.update(now_usec());
+        failures.evaluate(now_sec(), [&](unsigned int id, bool failing,
+                                         failure_tracker::counts c, double baseline) {
+            char buffer[120];
+            if (failing) {
+                snprintf(buffer, sizeof(buffer), "Host %s failed %u of %u jobs (%.0f%%, cluster: %.1f%%)",
+                         host_name(id).c_str(), c.failed, c.jobs, c.rate() * 100, baseline * 100);
+            } else {
+                snprintf(buffer, sizeof(buffer), "Host %s no longer fails more jobs than the rest",
+                         host_name(id).c_str());
+            }
+            layout.post(failing ? event_log_pane::ERROR : event_log_pane::NOTICE, buffer);
+            layout.set_host_mark(id, host_layout::FAILING, failing);
+        });
+        layout.tick();
+
+        auto started = now_usec();
         layout.flush();
+        meter.frame_rendered(now_usec() - started);
+        profile.frame_flushed(started);
+        if (profile.update(monitor) && self_stats) {
+            profile.dump(self_stats);
+        }
+
+        std::string summary;
+        if (meter.update(summary)) {
+            layout.set_perf_summary(summary);
+            for (unsigned type = 0; type < max_message_type; type++) {
+                if (monitor.stats.types[type].received && !announced_types[type]
+                    && !icecc_monitor::has_handler(type)) {
+                    announced_types[type] = true;
+                    layout.post(event_log_pane::NOTICE, "Ignoring scheduler messages of type #"
+                                + std::to_string(type) + ", see 't' for details");
+                }
+            }
+            if (history) {
+                history->flush();
+            }
+            if (trace) {
+                trace->flush();
+            }
+            monitor.collect_filenames([&](util::string_table::in_use& in_use) {
+                files.mark_filenames(in_use);
+                health.mark_filenames(in_use);
+                predictor.mark_filenames(in_use);
+                sessions.mark_filenames(in_use);
+                redundancy.mark_filenames(in_use);
+                queue.mark_filenames(in_use);
+                timeline.mark_strings(in_use);
+            });
+            if (!state_path.empty() && now() - last_saved >= save_state_msec) {
+                auto error = save_state();
+                if (!error.empty()) {
+                    layout.post(event_log_pane::ERROR, "Cannot save the state: " + error);
+                }
+                last_saved = now();
+            }
+        }
+
         term.wait_input(10);
         msleep(40);
     }
+
+    // Back to the normal screen, so that errors from here on can be seen.
+    term.set(ti::terminal::normal).flush();
+
+    if (!file_stats_path.empty()) {
+        if (FILE* output = fopen(file_stats_path.c_str(), "w")) {
+            files.dump(output, monitor.filenames());
+            fclose(output);
+        } else {
+            perror(file_stats_path.c_str());
+        }
+    }
+
+    if (self_stats) {
+        fclose(self_stats);
+    }
+
+    if (!state_path.empty()) {
+        auto error = save_state();
+        if (!error.empty()) {
+            fprintf(stderr, "Cannot save the state: %s\n", error.c_str());
+        }
+    }
+
+    if (trace) {
+        trace->finish();
+        fclose(trace_file);
+    }
+
+    if (history) {
+        history.reset();  // Waits for pending rows to be written.
+    }
 }
@@ -0,0 +1,297 @@
+/*
+ * snapshot.cc
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#include "snapshot.hh"
+#include "util/file.hh"
+#include "util/getenv.hh"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace snapshot {
+
+namespace {
+
+constexpr char     magic[8] = { 'I', 'C', 'E', 'T', 'O', 'P', 'W', '1' };
+constexpr uint32_t strings_tag = 0;
+
+void put_varint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool get_varint(const char*& pos, const char* end, uint64_t& value)
+{
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && pos != end; shift += 7) {
+        auto byte = static_cast<uint8_t>(*pos++);
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+uint64_t wall_clock_msec()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+
+std::string default_path()
+{
+    if (auto state_home = util::getenv("XDG_STATE_HOME"))
+        return state_home.value() + "/icetop/state";
+    if (auto home = util::getenv("HOME"))
+        return home.value() + "/.local/state/icetop/state";
+    return "icetop-state";
+}
+
+
+writer::writer()
+    : m_tag(strings_tag)
+{ }
+
+void writer::end_section()
+{
+    if (m_tag == strings_tag)
+        return;
+    put_varint(m_data, m_tag);
+    put_varint(m_data, m_section.size());
+    m_data += m_section;
+    m_section.clear();
+    m_tag = strings_tag;
+}
+
+void writer::section(uint32_t tag)
+{
+    end_section();
+    m_tag = tag;
+}
+
+void writer::u64(uint64_t value)
+{
+    put_varint(m_section, value);
+}
+
+void writer::i64(int64_t value)
+{
+    put_varint(m_section, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+void writer::f64(double value)
+{
+    char bytes[sizeof(value)];
+    memcpy(bytes, &value, sizeof(value));
+    m_section.append(bytes, sizeof(bytes));
+}
+
+void writer::str(const std::string& s)
+{
+    put_varint(m_section, s.size());
+    m_section += s;
+}
+
+void writer::shared_str(const std::string& s)
+{
+    put_varint(m_section, m_strings.intern(s));
+}
+
+namespace {
+
+std::string system_error(const std::string& path)
+{
+    return path + ": " + strerror(errno);
+}
+
+} // namespace
+
+bool writer::save(const std::string& path, std::string& error)
+{
+    end_section();
+
+    std::string header(magic, sizeof(magic));
+    put_varint(header, wall_clock_msec());
+    std::string strings;
+    put_varint(strings, m_strings.size() - 1);
+    for (uint32_t id = 1; id < m_strings.size(); id++) {
+        put_varint(strings, m_strings.lookup(id).size());
+        strings += m_strings.lookup(id);
+    }
+    put_varint(header, strings_tag);
+    put_varint(header, strings.size());
+    header += strings;
+
+    auto slash = path.rfind('/');
+    if (slash != std::string::npos && slash > 0 && !util::make_directories(path.substr(0, slash))) {
+        error = system_error(path);
+        return false;
+    }
+    auto temporary = path + ".new";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = system_error(temporary);
+        return false;
+    }
+    bool ok = util::write_fully(fd, header.data(), header.size(), -1)
+        && util::write_fully(fd, m_data.data(), m_data.size(), -1);
+    if (close(fd) != 0)
+        ok = false;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        error = system_error(temporary);
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+reader::reader(const char* base, size_t length)
+    : m_base(base)
+    , m_length(length)
+    , m_saved_msec(0)
+    , m_pos(nullptr)
+    , m_end(nullptr)
+    , m_ok(false)
+{ }
+
+reader::~reader()
+{
+    munmap(const_cast<char*>(m_base), m_length);
+}
+
+std::unique_ptr<reader> reader::open(const std::string& path, std::string& error)
+{
+    error.clear();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            error = system_error(path);
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(magic))) {
+        close(fd);
+        error = path + ": not a valid snapshot, ignored";
+        return nullptr;
+    }
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        error = system_error(path);
+        return nullptr;
+    }
+
+    std::unique_ptr<reader> r(new reader(static_cast<const char*>(base), st.st_size));
+    if (!r->index()) {
+        error = path + ": not a valid snapshot, ignored";
+        return nullptr;
+    }
+    return r;
+}
+
+bool reader::index()
+{
+    if (memcmp(m_base, magic, sizeof(magic)) != 0)
+        return false;
+    const char* pos = m_base + sizeof(magic);
+    const char* end = m_base + m_length;
+    if (!get_varint(pos, end, m_saved_msec))
+        return false;
+    while (pos != end) {
+        uint64_t tag, size;
+        if (!get_varint(pos, end, tag) || !get_varint(pos, end, size)
+            || size > static_cast<uint64_t>(end - pos))
+            return false;
+        m_sections[tag] = { pos, pos + size };
+        pos += size;
+    }
+
+    if (!section(strings_tag))
+        return false;
+    auto count = u64();
+    if (count > m_length)
+        return false;
+    m_strings.reserve(count + 1);
+    m_strings.emplace_back();
+    while (m_ok && count--)
+        m_strings.push_back(str());
+    return m_ok;
+}
+
+bool reader::section(uint32_t tag)
+{
+    auto item = m_sections.find(tag);
+    if (item == m_sections.end())
+        return false;
+    m_pos = item->second.first;
+    m_end = item->second.second;
+    m_ok = true;
+    return true;
+}
+
+uint64_t reader::u64()
+{
+    uint64_t value = 0;
+    if (m_ok && !get_varint(m_pos, m_end, value))
+        m_ok = false;
+    return m_ok ? value : 0;
+}
+
+int64_t reader::i64()
+{
+    auto value = u64();
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+double reader::f64()
+{
+    double value = 0;
+    if (m_ok && static_cast<size_t>(m_end - m_pos) >= sizeof(value)) {
+        memcpy(&value, m_pos, sizeof(value));
+        m_pos += sizeof(value);
+    } else {
+        m_ok = false;
+    }
+    return value;
+}
+
+std::string reader::str()
+{
+    auto size = u64();
+    if (!m_ok || size > static_cast<uint64_t>(m_end - m_pos)) {
+        m_ok = false;
+        return std::string();
+    }
+    std::string s(m_pos, size);
+    m_pos += size;
+    return s;
+}
+
+const std::string& reader::shared_str()
+{
+    auto id = u64();
+    if (id >= m_strings.size()) {
+        m_ok = false;
+        return m_strings[0];
+    }
+    return m_strings[id];
+}
+
+} // namespace snapshot
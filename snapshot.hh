@@ -0,0 +1,127 @@
+/*
+ * snapshot.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef SNAPSHOT_HH
+#define SNAPSHOT_HH
+
+#include "util/intern.hh"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ * State saved across runs, so a restarted icetop does not start from
+ * scratch. A snapshot starts with a magic string and the time it was
+ * saved, followed by sections: a varint tag, a varint size, and the
+ * contents, made of varints and strings. Strings used by several sections
+ * (file names, mostly) are stored once, in a section of their own, and
+ * referred to by an identifier. Unknown sections are skipped, and missing
+ * ones left alone, so the format can change without much fuss.
+ */
+namespace snapshot {
+
+// $XDG_STATE_HOME/icetop/state, or ~/.local/state/icetop/state
+std::string default_path();
+
+
+class writer {
+public:
+    writer();
+
+    // Starts a section; the previous one ends.
+    void section(uint32_t tag);
+
+    void u64(uint64_t value);
+    void i64(int64_t value);
+    void f64(double value);
+    void str(const std::string& s);
+
+    // Stores the string once, however many times it is written.
+    void shared_str(const std::string& s);
+
+    // Plain values, in the layout of this build.
+    template <typename T>
+    void raw(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "not a plain value");
+        u64(sizeof(T));
+        m_section.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    // Writes to a temporary file next to the path, which then replaces it,
+    // so a crash never leaves a half-written snapshot behind. Returns false,
+    // leaving the reason in "error", on failure. Nothing is printed, as the
+    // terminal is most likely showing the user interface.
+    bool save(const std::string& path, std::string& error);
+
+private:
+    void end_section();
+
+    std::string        m_data;       // Sections so far.
+    std::string        m_section;    // The one being written.
+    uint32_t           m_tag;
+    util::string_table m_strings;
+};
+
+
+class reader {
+public:
+    // Returns nullptr when there is no snapshot, or when it cannot be used,
+    // leaving the reason in "error" (empty when there is no snapshot).
+    static std::unique_ptr<reader> open(const std::string& path, std::string& error);
+
+    ~reader();
+
+    // Moves to the start of a section; false if there is none such.
+    bool section(uint32_t tag);
+
+    // Whether the section has more to read, and all read so far was valid.
+    bool more() const { return m_ok && m_pos != m_end; }
+    bool ok() const { return m_ok; }
+
+    uint64_t u64();
+    int64_t i64();
+    double f64();
+    std::string str();
+    const std::string& shared_str();
+
+    template <typename T>
+    bool raw(T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "not a plain value");
+        if (u64() != sizeof(T) || static_cast<size_t>(m_end - m_pos) < sizeof(T))
+            return m_ok = false;
+        memcpy(&value, m_pos, sizeof(T));
+        m_pos += sizeof(T);
+        return true;
+    }
+
+    // Wall clock, milliseconds since the epoch.
+    uint64_t saved_msec() const { return m_saved_msec; }
+
+private:
+    reader(const char* base, size_t length);
+
+    bool index();
+
+    const char*                                  m_base;
+    size_t                                       m_length;
+    uint64_t                                     m_saved_msec;
+    std::unordered_map<uint32_t, std::pair<const char*, const char*>> m_sections;
+    std::vector<std::string>                     m_strings;
+    const char*                                  m_pos;
+    const char*                                  m_end;
+    bool                                         m_ok;
+};
+
+} // namespace snapshot
+
+#endif /* !SNAPSHOT_HH */
@@ -0,0 +1,699 @@
+/*
+ * stream.cc
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#include "stream.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace stream {
+
+namespace {
+
+constexpr char   magic[8] = { 'I', 'C', 'E', 'T', 'O', 'P', 'S', '2' };
+constexpr size_t max_frame_size = 64 * 1024 * 1024;
+constexpr size_t max_backlog = 16 * 1024 * 1024;  // Unsent, per viewer.
+
+enum record_kind {
+    RESET,   // Forget all hosts, jobs, and strings.
+    STRING,  // Identifier and contents of a string.
+    HOST,
+    JOB,
+};
+
+enum host_field {
+    HOST_NAME     = 1 << 0,
+    HOST_PLATFORM = 1 << 1,
+    HOST_MAX_JOBS = 1 << 2,
+    HOST_LOAD     = 1 << 3,
+    HOST_OFFLINE  = 1 << 4,
+};
+
+enum job_field {
+    JOB_STATE     = 1 << 0,
+    JOB_CLIENT    = 1 << 1,
+    JOB_SERVER    = 1 << 2,
+    JOB_FILENAME  = 1 << 3,
+    JOB_REAL      = 1 << 4,
+    JOB_USER      = 1 << 5,
+    JOB_SYS       = 1 << 6,
+    JOB_FAULTS    = 1 << 7,
+    JOB_EXIT_CODE = 1 << 8,
+    JOB_SUBMITTED = 1 << 9,
+    JOB_STARTED   = 1 << 10,
+};
+
+int64_t now_usec()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void put_varint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+void put_signed(std::string& out, int64_t value)
+{
+    put_varint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+void put_string(std::string& out, const std::string& s)
+{
+    put_varint(out, s.size());
+    out += s;
+}
+
+// Zero means unknown, otherwise the age plus one.
+void put_age(std::string& out, int64_t usec, int64_t now)
+{
+    put_varint(out, usec ? std::max<int64_t>(now - usec, 0) + 1 : 0);
+}
+
+void frame(std::string& out, const std::string& payload)
+{
+    put_varint(out, payload.size());
+    out += payload;
+}
+
+void encode_host(std::string& out, const host_state* old, const host_state& h)
+{
+    unsigned fields = 0;
+    if (!old || old->name != h.name)         fields |= HOST_NAME;
+    if (!old || old->platform != h.platform) fields |= HOST_PLATFORM;
+    if (!old || old->max_jobs != h.max_jobs) fields |= HOST_MAX_JOBS;
+    if (!old || old->load != h.load)         fields |= HOST_LOAD;
+    if (!old || old->offline != h.offline)   fields |= HOST_OFFLINE;
+    if (old && !fields)
+        return;
+
+    put_varint(out, HOST);
+    put_varint(out, h.id);
+    put_varint(out, fields);
+    if (fields & HOST_NAME)     put_string(out, h.name);
+    if (fields & HOST_PLATFORM) put_string(out, h.platform);
+    if (fields & HOST_MAX_JOBS) put_varint(out, h.max_jobs);
+    if (fields & HOST_LOAD)     put_signed(out, h.load);
+    if (fields & HOST_OFFLINE)  put_varint(out, h.offline);
+}
+
+void encode_job(std::string& out, const job_state* old, const job_state& j, int64_t now)
+{
+    unsigned fields = 0;
+    if (!old || old->state != j.state)                   fields |= JOB_STATE;
+    if (!old || old->client_id != j.client_id)           fields |= JOB_CLIENT;
+    if (!old || old->server_id != j.server_id)           fields |= JOB_SERVER;
+    if (!old || old->filename_id != j.filename_id)       fields |= JOB_FILENAME;
+    if (!old || old->real_msec != j.real_msec)           fields |= JOB_REAL;
+    if (!old || old->user_msec != j.user_msec)           fields |= JOB_USER;
+    if (!old || old->sys_msec != j.sys_msec)             fields |= JOB_SYS;
+    if (!old || old->page_faults != j.page_faults)       fields |= JOB_FAULTS;
+    if (!old || old->exit_code != j.exit_code)           fields |= JOB_EXIT_CODE;
+    if (!old || old->submitted_usec != j.submitted_usec) fields |= JOB_SUBMITTED;
+    if (!old || old->started_usec != j.started_usec)     fields |= JOB_STARTED;
+
+    put_varint(out, JOB);
+    put_varint(out, j.id);
+    put_varint(out, fields);
+    if (fields & JOB_STATE)     put_varint(out, j.state);
+    if (fields & JOB_CLIENT)    put_varint(out, j.client_id);
+    if (fields & JOB_SERVER)    put_varint(out, j.server_id);
+    if (fields & JOB_FILENAME)  put_varint(out, j.filename_id);
+    if (fields & JOB_REAL)      put_varint(out, j.real_msec);
+    if (fields & JOB_USER)      put_varint(out, j.user_msec);
+    if (fields & JOB_SYS)       put_varint(out, j.sys_msec);
+    if (fields & JOB_FAULTS)    put_varint(out, j.page_faults);
+    if (fields & JOB_EXIT_CODE) put_signed(out, j.exit_code);
+    if (fields & JOB_SUBMITTED) put_age(out, j.submitted_usec, now);
+    if (fields & JOB_STARTED)   put_age(out, j.started_usec, now);
+}
+
+
+struct cursor {
+    const char* pos;
+    const char* end;
+    bool        ok;
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (pos == end)
+                break;
+            auto byte = static_cast<uint8_t>(*pos++);
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        ok = false;
+        return 0;
+    }
+
+    int64_t signed_varint() {
+        auto value = varint();
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    std::string string() {
+        auto size = varint();
+        if (!ok || size > static_cast<uint64_t>(end - pos)) {
+            ok = false;
+            return std::string();
+        }
+        std::string s(pos, size);
+        pos += size;
+        return s;
+    }
+
+    int64_t time(int64_t now) {
+        auto age = varint();
+        return age ? now - static_cast<int64_t>(age - 1) : 0;
+    }
+};
+
+// Returns false if the data does not contain a whole varint yet.
+bool peek_varint(const std::string& data, size_t offset, uint64_t& value, size_t& length)
+{
+    cursor c { data.data() + offset, data.data() + data.size(), true };
+    value = c.varint();
+    length = c.pos - (data.data() + offset);
+    return c.ok;
+}
+
+
+// Splits "host:port"; returns false for Unix socket paths.
+bool split_address(const std::string& address, std::string& host, std::string& port)
+{
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos || address.find('/') != std::string::npos)
+        return false;
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    return true;
+}
+
+bool unix_address(const std::string& path, sockaddr_un& addr)
+{
+    if (path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+} // namespace
+
+
+encoder::encoder(const util::string_table& strings)
+    : m_strings(strings)
+{ }
+
+void encoder::add_string(uint32_t id, std::string& out)
+{
+    if (id && m_string_refs[id]++ == 0) {
+        put_varint(out, STRING);
+        put_varint(out, id);
+        put_string(out, m_strings.lookup(id));
+    }
+}
+
+void encoder::remove_string(uint32_t id)
+{
+    auto item = m_string_refs.find(id);
+    if (item != m_string_refs.end() && --item->second == 0)
+        m_string_refs.erase(item);
+}
+
+void encoder::host_updated(const host_state& host)
+{
+    auto item = m_hosts.find(host.id);
+    encode_host(m_pending, item == m_hosts.end() ? nullptr : &item->second, host);
+    m_hosts[host.id] = host;
+}
+
+void encoder::job_updated(const job_state& job)
+{
+    auto item = m_jobs.find(job.id);
+    auto old = (item == m_jobs.end()) ? nullptr : &item->second;
+    if (!old || old->filename_id != job.filename_id) {
+        add_string(job.filename_id, m_pending);
+        if (old)
+            remove_string(old->filename_id);
+    }
+    encode_job(m_pending, old, job, now_usec());
+    if (job.done()) {
+        remove_string(job.filename_id);
+        if (old)
+            m_jobs.erase(item);
+    } else {
+        m_jobs[job.id] = job;
+    }
+}
+
+void encoder::take_frame(std::string& out)
+{
+    out.clear();
+    if (m_pending.empty())
+        return;
+    frame(out, m_pending);
+    m_pending.clear();
+}
+
+void encoder::snapshot(std::string& out) const
+{
+    auto now = now_usec();
+    std::string payload;
+    put_varint(payload, RESET);
+    for (auto& item: m_string_refs) {
+        put_varint(payload, STRING);
+        put_varint(payload, item.first);
+        put_string(payload, m_strings.lookup(item.first));
+    }
+    for (auto& item: m_hosts)
+        encode_host(payload, nullptr, item.second);
+    for (auto& item: m_jobs)
+        encode_job(payload, nullptr, item.second, now);
+    out.clear();
+    frame(out, payload);
+}
+
+void encoder::mark_strings(util::string_table::in_use& in_use) const
+{
+    for (auto& item: m_string_refs)
+        in_use.mark(item.first);
+}
+
+
+decoder::decoder(host_func on_host, job_func on_job)
+    : m_on_host(on_host)
+    , m_on_job(on_job)
+{ }
+
+void decoder::remove_string(uint32_t id)
+{
+    auto item = m_strings.find(id);
+    if (item != m_strings.end() && --item->second.refs == 0)
+        m_strings.erase(item);
+}
+
+bool decoder::decode(const char* data, size_t size)
+{
+    return decode(data, size, now_usec());
+}
+
+bool decoder::decode(const char* data, size_t size, int64_t now)
+{
+    cursor c { data, data + size, true };
+    while (c.ok && c.pos != c.end) {
+        switch (c.varint()) {
+            case RESET:
+                m_strings.clear();
+                m_hosts.clear();
+                m_jobs.clear();
+                break;
+
+            case STRING: {
+                auto id = static_cast<uint32_t>(c.varint());
+                auto s = c.string();
+                if (c.ok)
+                    m_strings[id].value.swap(s);
+                break;
+            }
+
+            case HOST: {
+                auto id = static_cast<unsigned int>(c.varint());
+                auto fields = c.varint();
+                auto item = m_hosts.find(id);
+                if (item == m_hosts.end())
+                    item = m_hosts.emplace(id, host_state { id, {}, {}, 0, 0, false }).first;
+                auto& h = item->second;
+                if (fields & HOST_NAME)     h.name = c.string();
+                if (fields & HOST_PLATFORM) h.platform = c.string();
+                if (fields & HOST_MAX_JOBS) h.max_jobs = c.varint();
+                if (fields & HOST_LOAD)     h.load = c.signed_varint();
+                if (fields & HOST_OFFLINE)  h.offline = c.varint();
+                if (c.ok)
+                    m_on_host(h);
+                break;
+            }
+
+            case JOB: {
+                auto id = static_cast<unsigned int>(c.varint());
+                auto fields = c.varint();
+                auto item = m_jobs.find(id);
+                if (item == m_jobs.end())
+                    item = m_jobs.emplace(id, job_state { id, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }).first;
+                auto& j = item->second;
+                auto old_filename_id = j.filename_id;
+                if (fields & JOB_STATE)     j.state = c.varint();
+                if (fields & JOB_CLIENT)    j.client_id = c.varint();
+                if (fields & JOB_SERVER)    j.server_id = c.varint();
+                if (fields & JOB_FILENAME)  j.filename_id = c.varint();
+                if (fields & JOB_REAL)      j.real_msec = c.varint();
+                if (fields & JOB_USER)      j.user_msec = c.varint();
+                if (fields & JOB_SYS)       j.sys_msec = c.varint();
+                if (fields & JOB_FAULTS)    j.page_faults = c.varint();
+                if (fields & JOB_EXIT_CODE) j.exit_code = c.signed_varint();
+                if (fields & JOB_SUBMITTED) j.submitted_usec = c.time(now);
+                if (fields & JOB_STARTED)   j.started_usec = c.time(now);
+                if (!c.ok)
+                    return false;
+
+                // Same bookkeeping as the encoder, so strings go away together.
+                static const std::string no_filename;
+                auto filename = &no_filename;
+                if (j.filename_id) {
+                    auto s = m_strings.find(j.filename_id);
+                    if (s == m_strings.end())
+                        return false;
+                    if (j.filename_id != old_filename_id)
+                        s->second.refs++;
+                    filename = &s->second.value;
+                }
+                if (old_filename_id && j.filename_id != old_filename_id)
+                    remove_string(old_filename_id);
+                m_on_job(j, *filename);
+                if (j.done()) {
+                    remove_string(j.filename_id);
+                    m_jobs.erase(item);
+                }
+                break;
+            }
+
+            default:
+                return false;
+        }
+    }
+    return c.ok;
+}
+
+
+timeline::timeline(const util::string_table& strings, int64_t window_usec,
+                   int64_t keyframe_usec, size_t max_bytes)
+    : m_encoder(strings)
+    , m_window_usec(window_usec)
+    , m_keyframe_usec(keyframe_usec)
+    , m_max_bytes(max_bytes)
+    , m_bytes(0)
+    , m_keyframes(0)
+    , m_last_keyframe(0)
+{ }
+
+void timeline::tick(int64_t now)
+{
+    // Changes before the first keyframe are part of it.
+    m_encoder.take_frame(m_frame);
+    if (m_keyframes && !m_frame.empty())
+        add(now, false, m_frame);
+    if (now - m_last_keyframe >= m_keyframe_usec) {
+        m_encoder.snapshot(m_frame);
+        add(now, true, m_frame);
+        m_last_keyframe = now;
+    }
+    trim(now);
+}
+
+void timeline::add(int64_t when, bool keyframe, std::string& frame)
+{
+    m_bytes += frame.size();
+    m_keyframes += keyframe;
+    m_entries.push_back({ when, keyframe, std::string() });
+    m_entries.back().frame.swap(frame);
+}
+
+void timeline::trim(int64_t now)
+{
+    while (m_keyframes > 1) {
+        auto next = std::find_if(m_entries.begin() + 1, m_entries.end(),
+                                 [](const entry& e) { return e.keyframe; });
+        if (next->when > now - m_window_usec && m_bytes <= m_max_bytes)
+            break;
+        for (auto e = m_entries.begin(); e != next; ++e)
+            m_bytes -= e->frame.size();
+        m_entries.erase(m_entries.begin(), next);
+        m_keyframes--;
+    }
+}
+
+int64_t timeline::replay(int64_t when, decoder& d) const
+{
+    if (m_entries.empty())
+        return 0;
+    auto end = std::upper_bound(m_entries.begin(), m_entries.end(), when,
+                                [](int64_t t, const entry& e) { return t < e.when; });
+    if (end == m_entries.begin())
+        ++end;  // Earlier than kept: go to the oldest.
+    auto start = end;
+    while (!(--start)->keyframe) { }
+
+    for (auto e = start; e != end; ++e) {
+        cursor c { e->frame.data(), e->frame.data() + e->frame.size(), true };
+        auto size = c.varint();
+        if (!c.ok || size != static_cast<uint64_t>(c.end - c.pos) || !d.decode(c.pos, size, e->when))
+            return 0;
+    }
+    return std::prev(end)->when;
+}
+
+
+std::unique_ptr<server> server::open(const std::string& address, const util::string_table& strings)
+{
+    std::string host, port;
+    int fd = -1;
+    if (split_address(address, host, port)) {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* result;
+        if (int error = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result)) {
+            fprintf(stderr, "%s: %s\n", address.c_str(), gai_strerror(error));
+            return nullptr;
+        }
+        for (auto ai = result; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+        host.clear();
+    } else {
+        sockaddr_un addr;
+        if (unix_address(address, addr)) {
+            // Remove stale sockets left behind by a previous run.
+            struct stat st;
+            if (lstat(address.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+                unlink(address.c_str());
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        host = address;
+    }
+
+    if (fd < 0 || listen(fd, 64) != 0) {
+        perror(address.c_str());
+        if (fd >= 0)
+            close(fd);
+        return nullptr;
+    }
+    return std::unique_ptr<server>(new server(fd, host, strings));
+}
+
+server::server(int fd, const std::string& unix_path, const util::string_table& strings)
+    : m_fd(fd)
+    , m_unix_path(unix_path)
+    , m_encoder(strings)
+    , m_bytes_sent(0)
+{ }
+
+server::~server()
+{
+    for (auto& v: m_viewers)
+        close(v.fd);
+    close(m_fd);
+    if (!m_unix_path.empty())
+        unlink(m_unix_path.c_str());
+}
+
+void server::tick()
+{
+    // The frame goes out before accepting, so snapshots already include it.
+    m_encoder.take_frame(m_frame);
+    if (!m_frame.empty()) {
+        for (auto& v: m_viewers)
+            v.output += m_frame;
+    }
+
+    int fd;
+    while ((fd = accept4(m_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));  // Fails for Unix sockets.
+        m_viewers.push_back({ fd, std::string(magic, sizeof(magic)) });
+        m_encoder.snapshot(m_frame);
+        m_viewers.back().output += m_frame;
+    }
+
+    for (size_t i = 0; i < m_viewers.size(); ) {
+        if (send(m_viewers[i])) {
+            i++;
+        } else {
+            close(m_viewers[i].fd);
+            m_viewers.erase(m_viewers.begin() + i);
+        }
+    }
+}
+
+bool server::send(viewer& v)
+{
+    // Viewers never write, so readable means they went away.
+    char byte;
+    if (recv(v.fd, &byte, 1, MSG_DONTWAIT) >= 0)
+        return false;
+
+    size_t sent = 0;
+    while (sent < v.output.size()) {
+        auto n = ::send(v.fd, v.output.data() + sent, v.output.size() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return false;
+        }
+        sent += n;
+    }
+    m_bytes_sent += sent;
+    v.output.erase(0, sent);
+    return v.output.size() <= max_backlog;
+}
+
+
+std::unique_ptr<client> client::connect(const std::string& address)
+{
+    std::string host, port;
+    int fd = -1;
+    if (split_address(address, host, port)) {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result)) {
+            errno = EHOSTUNREACH;
+            return nullptr;
+        }
+        for (auto ai = result; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd >= 0 && ::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+                int saved = errno;
+                close(fd);
+                fd = -1;
+                errno = saved;
+            }
+        }
+        freeaddrinfo(result);
+    } else {
+        sockaddr_un addr;
+        if (!unix_address(address, addr))
+            return nullptr;
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            int saved = errno;
+            close(fd);
+            fd = -1;
+            errno = saved;
+        }
+    }
+
+    if (fd < 0)
+        return nullptr;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return std::unique_ptr<client>(new client(fd));
+}
+
+client::client(int fd)
+    : m_fd(fd)
+    , m_greeted(false)
+{ }
+
+client::~client()
+{
+    close(m_fd);
+}
+
+bool client::poll(decoder& d)
+{
+    char buffer[64 * 1024];
+    for (;;) {
+        auto n = read(m_fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            m_input.append(buffer, n);
+            continue;
+        }
+        if (n == 0)
+            return false;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        return false;
+    }
+
+    size_t offset = 0;
+    if (!m_greeted) {
+        if (m_input.size() < sizeof(magic))
+            return true;
+        if (memcmp(m_input.data(), magic, sizeof(magic)) != 0)
+            return false;
+        m_greeted = true;
+        offset = sizeof(magic);
+    }
+
+    uint64_t size;
+    size_t length;
+    while (peek_varint(m_input, offset, size, length)) {
+        if (size > max_frame_size)
+            return false;
+        if (m_input.size() - offset - length < size)
+            break;
+        if (!d.decode(m_input.data() + offset + length, size))
+            return false;
+        offset += length + size;
+    }
+    m_input.erase(0, offset);
+    return true;
+}
+
+} // namespace stream
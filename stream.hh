@@ -0,0 +1,250 @@
+/*
+ * stream.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef STREAM_HH
+#define STREAM_HH
+
+#include "util/intern.hh"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Model updates, as exchanged between an aggregator (icetop --serve) and
+ * its viewers (icetop --connect).
+ *
+ * A connection starts with a magic string, followed by frames: a varint
+ * with the size of the payload, then the payload, which is a sequence of
+ * records. Each host and job record carries only the fields which changed
+ * since the previous record for the same host or job, so both ends keep a
+ * copy of the state. Finished and failed jobs are forgotten by both ends.
+ * File names are sent along with the first job which refers to them, and
+ * then referred to by an identifier, until no job refers to them anymore;
+ * both ends count the references, so they forget them at the same time.
+ * Timestamps are sent as ages, so clocks need not agree.
+ */
+namespace stream {
+
+// Field values match those of host_info.
+struct host_state {
+    unsigned int id;
+    std::string  name;
+    std::string  platform;
+    unsigned int max_jobs;
+    int          load;
+    bool         offline;
+};
+
+// Field values match those of job_info; timestamps are from now_usec().
+struct job_state {
+    unsigned int id;
+    unsigned int state;
+    unsigned int client_id;
+    unsigned int server_id;
+    uint32_t     filename_id;
+    uint32_t     real_msec;
+    uint32_t     user_msec;
+    uint32_t     sys_msec;
+    uint32_t     page_faults;
+    int32_t      exit_code;
+    int64_t      submitted_usec;
+    int64_t      started_usec;
+
+    // Same values as job_info::FINISHED and job_info::FAILED.
+    static constexpr unsigned finished = 3;
+    static constexpr unsigned failed = 4;
+
+    bool done() const { return state == finished || state == failed; }
+};
+
+
+/*
+ * Keeps the state last sent for each host and job, and encodes updates as
+ * records which only contain what changed. File names are looked up in
+ * the string table of the monitor which produces the updates.
+ */
+class encoder {
+public:
+    explicit encoder(const util::string_table& strings);
+
+    void host_updated(const host_state& host);
+    void job_updated(const job_state& job);
+
+    // Moves the records encoded since the previous call into "frame", with
+    // its size prefix; leaves it empty if there were none.
+    void take_frame(std::string& frame);
+
+    // Encodes a frame which brings a decoder from any state to ours.
+    void snapshot(std::string& frame) const;
+
+    // Marks the strings which decoders still hold, so they are kept.
+    void mark_strings(util::string_table::in_use& in_use) const;
+
+private:
+    void add_string(uint32_t id, std::string& out);
+    void remove_string(uint32_t id);
+
+    const util::string_table&                    m_strings;
+    std::unordered_map<uint32_t, unsigned>       m_string_refs;  // By live jobs.
+    std::string                                  m_pending;
+    std::unordered_map<unsigned int, host_state> m_hosts;
+    std::unordered_map<unsigned int, job_state>  m_jobs;
+};
+
+
+class decoder {
+public:
+    using host_func = std::function<void(const host_state&)>;
+    using job_func = std::function<void(const job_state&, const std::string& filename)>;
+
+    decoder(host_func on_host, job_func on_job);
+
+    // Applies the records of a frame payload. Returns false when it is
+    // malformed, after which the decoder is of no more use.
+    bool decode(const char* data, size_t size);
+
+    // Same, for a frame encoded at "now" instead of just now.
+    bool decode(const char* data, size_t size, int64_t now);
+
+private:
+    struct shared_string {
+        std::string value;
+        unsigned    refs = 0;
+    };
+
+    void remove_string(uint32_t id);
+
+    host_func                                    m_on_host;
+    job_func                                     m_on_job;
+    std::unordered_map<uint32_t, shared_string>  m_strings;
+    std::unordered_map<unsigned int, host_state> m_hosts;
+    std::unordered_map<unsigned int, job_state>  m_jobs;
+};
+
+
+/*
+ * The updates of the last minutes, kept in memory to go back in time: a
+ * snapshot every so often (a keyframe), and the frames in between. The
+ * oldest keyframe and its frames are dropped once the next keyframe is
+ * older than the window, or when over the size limit. Going to a moment
+ * decodes at most the frames of one keyframe interval.
+ */
+class timeline {
+public:
+    timeline(const util::string_table& strings, int64_t window_usec,
+             int64_t keyframe_usec, size_t max_bytes);
+
+    void host_updated(const host_state& host) { m_encoder.host_updated(host); }
+    void job_updated(const job_state& job) { m_encoder.job_updated(job); }
+
+    // Frames carry their own strings; only the live ones need keeping.
+    void mark_strings(util::string_table::in_use& in_use) const { m_encoder.mark_strings(in_use); }
+
+    // Stores the updates since the previous call as happening "now".
+    void tick(int64_t now);
+
+    // Feeds a fresh decoder with the state at the given moment, or the
+    // closest one kept. Returns the moment actually reached, zero if
+    // nothing was kept yet.
+    int64_t replay(int64_t when, decoder& d) const;
+
+    int64_t oldest() const { return m_entries.empty() ? 0 : m_entries.front().when; }
+    int64_t newest() const { return m_entries.empty() ? 0 : m_entries.back().when; }
+    size_t bytes() const { return m_bytes; }
+
+private:
+    struct entry {
+        int64_t     when;
+        bool        keyframe;
+        std::string frame;
+    };
+
+    void add(int64_t when, bool keyframe, std::string& frame);
+    void trim(int64_t now);
+
+    encoder           m_encoder;
+    int64_t           m_window_usec;
+    int64_t           m_keyframe_usec;
+    size_t            m_max_bytes;
+    std::deque<entry> m_entries;
+    size_t            m_bytes;
+    size_t            m_keyframes;
+    int64_t           m_last_keyframe;
+    std::string       m_frame;
+};
+
+
+/*
+ * Addresses are either paths of Unix sockets (anything with a slash or
+ * without a colon), or host:port pairs for TCP. An empty host listens on
+ * all interfaces.
+ */
+class server {
+public:
+    // Returns nullptr, after printing the reason, on failure.
+    static std::unique_ptr<server> open(const std::string& address,
+                                        const util::string_table& strings);
+
+    ~server();
+
+    encoder& model() { return m_encoder; }
+
+    // Sends the updates encoded since the previous tick to all viewers,
+    // accepts new viewers and sends each a snapshot. Never blocks: viewers
+    // which fall too far behind are disconnected, and may reconnect.
+    void tick();
+
+    size_t viewers() const { return m_viewers.size(); }
+    uint64_t bytes_sent() const { return m_bytes_sent; }
+
+private:
+    struct viewer {
+        int         fd;
+        std::string output;
+    };
+
+    server(int fd, const std::string& unix_path, const util::string_table& strings);
+
+    bool send(viewer& v);
+
+    int                 m_fd;
+    std::string         m_unix_path;
+    encoder             m_encoder;
+    std::vector<viewer> m_viewers;
+    std::string         m_frame;
+    uint64_t            m_bytes_sent;
+};
+
+
+class client {
+public:
+    // Returns nullptr, leaving the reason in errno, on failure.
+    static std::unique_ptr<client> connect(const std::string& address);
+
+    ~client();
+
+    // Reads whatever has arrived, without blocking, and hands complete
+    // frames to the decoder. Returns false when the connection is gone,
+    // or the data is not valid.
+    bool poll(decoder& d);
+
+private:
+    explicit client(int fd);
+
+    int         m_fd;
+    std::string m_input;
+    bool        m_greeted;
+};
+
+} // namespace stream
+
+#endif /* !STREAM_HH */
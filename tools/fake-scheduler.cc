@@ -0,0 +1,505 @@
+/*
+ * fake-scheduler.cc
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+/*
+ * Stand-in for the icecream scheduler, to load test icetop without a build
+ * farm. It listens on the loopback interface, accepts monitor connections
+ * through libicecc, and streams synthetic host statistics and jobs for a
+ * configurable number of hosts, job rate, and failure mix.
+ *
+ * Messages are sent with blocking writes, so a monitor which cannot keep
+ * up slows the stream down: the job rate actually achieved, and the bytes
+ * queued on each monitor socket, are printed every second.
+ */
+
+#include <icecc/comm.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <poll.h>
+#include <queue>
+#include <random>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef SIOCOUTQ
+#include <linux/sockios.h>
+#endif
+
+
+static int64_t now_msec()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+struct options {
+    unsigned short port           = 8765;
+    unsigned int   hosts          = 100;
+    double         jobs_per_min   = 6000;
+    double         local_share    = 0.1;   // Jobs compiled on the client.
+    double         failure_rate   = 0.01;
+    unsigned int   broken_hosts   = 0;     // Fail half of their jobs.
+    unsigned int   slow_hosts     = 0;     // Three times slower.
+    unsigned int   flapping_hosts = 0;     // Go offline and back every few seconds.
+    unsigned int   files          = 20000;
+    int64_t        stats_msec     = 5000;  // Between updates of each host.
+    int64_t        duration_msec  = 0;     // Forever.
+    unsigned int   seed           = 1;
+};
+
+
+struct simulation {
+    struct host {
+        std::string  name;
+        std::string  platform;
+        unsigned int max_jobs;
+        unsigned int active;
+        double       speed;         // Multiplies compile times.
+        double       failure_rate;
+        int          exit_code;     // For failures of broken hosts.
+        bool         offline;
+        int64_t      next_flip;     // Zero for hosts which do not flap.
+    };
+
+    struct event {
+        enum kind { BEGIN, DONE, LOCAL_DONE };
+
+        int64_t      when;
+        kind         type;
+        unsigned int job_id;
+        unsigned int host;          // Server, or client for local jobs.
+        unsigned int file;
+
+        bool operator>(const event& other) const { return when > other.when; }
+    };
+
+    using send_func = std::function<void(const Msg&)>;
+
+    simulation(const options& opt_, send_func send_)
+        : jobs_started(0)
+        , messages_sent(0)
+        , opt(opt_)
+        , send(send_)
+        , random(opt_.seed)
+        , next_job_id(1)
+        , next_stats_host(0)
+        , pending_jobs(0)
+        , pending_stats(0)
+        , last_advance(now_msec())
+    {
+        static const char* platforms[] = { "x86_64", "x86_64", "x86_64", "aarch64", "i686" };
+        std::uniform_int_distribution<unsigned int> slots(2, 32);
+        std::uniform_int_distribution<unsigned int> platform(0, 4);
+        std::lognormal_distribution<double> speed(0, 0.15);
+        for (unsigned int i = 0; i < opt.hosts; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "node%05u", i + 1);
+            hosts.push_back({ name, platforms[platform(random)], slots(random), 0,
+                              speed(random), opt.failure_rate, 1, false, 0 });
+        }
+        for (unsigned int i = 0; i < std::min(opt.broken_hosts, opt.hosts); i++) {
+            hosts[i].failure_rate = 0.5;
+            hosts[i].exit_code = 127;
+        }
+        for (unsigned int i = 0; i < std::min(opt.slow_hosts, opt.hosts); i++)
+            hosts[opt.hosts - 1 - i].speed *= 3;
+        for (unsigned int i = 0; i < std::min(opt.flapping_hosts, opt.hosts); i++)
+            hosts[(opt.hosts / 2 + i) % opt.hosts].next_flip = last_advance + flip_msec();
+
+        // Compile times are log-normal, with a median of two seconds.
+        std::lognormal_distribution<double> base(std::log(2000), 1);
+        for (unsigned int i = 0; i < opt.files; i++) {
+            char name[64];
+            snprintf(name, sizeof(name), "/src/project/module%03u/file%05u.cpp", i % 500, i);
+            files.push_back({ name, std::min(600000.0, base(random)) });
+        }
+    }
+
+    // Sends statistics for all hosts, to a monitor which just logged in.
+    void send_all_stats(const std::function<void(const Msg&)>& send_to) {
+        for (unsigned int i = 0; i < hosts.size(); i++)
+            send_to(MonStatsMsg(i + 1, stats_for(hosts[i])));
+    }
+
+    void advance(int64_t now) {
+        auto elapsed = now - last_advance;
+        last_advance = now;
+
+        pending_stats += double(hosts.size()) * elapsed / opt.stats_msec;
+        for (; pending_stats >= 1; pending_stats -= 1) {
+            auto& h = hosts[next_stats_host];
+            emit(MonStatsMsg(next_stats_host + 1, stats_for(h)));
+            next_stats_host = (next_stats_host + 1) % hosts.size();
+        }
+
+        for (unsigned int i = 0; i < hosts.size(); i++) {
+            auto& h = hosts[i];
+            if (h.next_flip && h.next_flip <= now) {
+                h.offline = !h.offline;
+                h.next_flip = now + flip_msec();
+                emit(MonStatsMsg(i + 1, stats_for(h)));
+            }
+        }
+
+        pending_jobs += opt.jobs_per_min * elapsed / 60000.0;
+        for (; pending_jobs >= 1; pending_jobs -= 1)
+            start_job(now);
+
+        while (!events.empty() && events.top().when <= now) {
+            auto e = events.top();
+            events.pop();
+            handle(e, now);
+        }
+    }
+
+    size_t active_jobs() const { return events.size(); }
+
+    uint64_t jobs_started;
+    uint64_t messages_sent;
+
+private:
+    struct file {
+        std::string name;
+        double      base_msec;
+    };
+
+    std::string stats_for(const host& h) const {
+        auto load = std::min(1000u, h.active * 1000 / std::max(1u, h.max_jobs));
+        return "Name:" + h.name + "\nIP:127.0.0.1\nMaxJobs:" + std::to_string(h.max_jobs)
+            + "\nNoRemote:false\nPlatform:" + h.platform + "\nLoad:" + std::to_string(load) + "\n"
+            + (h.offline ? "State:Offline\n" : "");
+    }
+
+    int64_t flip_msec() {
+        std::uniform_int_distribution<int64_t> msec(1000, 8000);
+        return msec(random);
+    }
+
+    void emit(const Msg& m) {
+        send(m);
+        messages_sent++;
+    }
+
+    // Picks a server with free slots, if one is found after a few tries.
+    unsigned int pick_server() {
+        std::uniform_int_distribution<unsigned int> pick(0, hosts.size() - 1);
+        unsigned int server = pick(random);
+        for (int tries = 0; tries < 8 && (hosts[server].offline
+                                        || hosts[server].active >= hosts[server].max_jobs); tries++)
+            server = pick(random);
+        return server;
+    }
+
+    void start_job(int64_t now) {
+        std::uniform_int_distribution<unsigned int> pick_host(0, hosts.size() - 1);
+        std::uniform_int_distribution<unsigned int> pick_file(0, files.size() - 1);
+        std::uniform_real_distribution<double> chance(0, 1);
+        std::uniform_int_distribution<int64_t> queue_msec(5, 50);
+
+        auto job_id = next_job_id++;
+        auto client = pick_host(random);
+        auto f = pick_file(random);
+        jobs_started++;
+
+        if (chance(random) < opt.local_share) {
+            hosts[client].active++;
+            emit(MonLocalJobBeginMsg(job_id, files[f].name, now / 1000, client + 1));
+            events.push({ now + compile_msec(client, f), event::LOCAL_DONE, job_id, client, f });
+        } else {
+            MonGetCSMsg m;
+            m.job_id = job_id;
+            m.clientid = client + 1;
+            m.filename = files[f].name;
+            emit(m);
+            events.push({ now + queue_msec(random), event::BEGIN, job_id, pick_server(), f });
+        }
+    }
+
+    int64_t compile_msec(unsigned int h, unsigned int f) {
+        std::lognormal_distribution<double> noise(0, 0.2);
+        return std::max<int64_t>(1, files[f].base_msec * hosts[h].speed * noise(random));
+    }
+
+    void handle(const event& e, int64_t now) {
+        auto& h = hosts[e.host];
+        switch (e.type) {
+            case event::BEGIN:
+                h.active++;
+                emit(MonJobBeginMsg(e.job_id, now / 1000, e.host + 1));
+                events.push({ now + compile_msec(e.host, e.file), event::DONE, e.job_id, e.host, e.file });
+                break;
+
+            case event::DONE: {
+                h.active--;
+                std::uniform_real_distribution<double> chance(0, 1);
+                MonJobDoneMsg m;
+                m.job_id = e.job_id;
+                m.exitcode = (chance(random) < h.failure_rate) ? h.exit_code : 0;
+                auto real = compile_msec(e.host, e.file);
+                m.real_msec = real;
+                m.user_msec = real * 0.9 / h.speed;
+                m.sys_msec = real * 0.05;
+                m.pfaults = 20000 + files[e.file].base_msec * 5;
+                emit(m);
+                break;
+            }
+
+            case event::LOCAL_DONE:
+                h.active--;
+                emit(JobLocalDoneMsg(e.job_id));
+                break;
+        }
+    }
+
+    const options&      opt;
+    send_func           send;
+    std::mt19937        random;
+    std::vector<host>   hosts;
+    std::vector<file>   files;
+    std::priority_queue<event, std::vector<event>, std::greater<event>> events;
+    unsigned int        next_job_id;
+    unsigned int        next_stats_host;
+    double              pending_jobs;
+    double              pending_stats;
+    int64_t             last_advance;
+};
+
+
+struct monitor_connection {
+    std::unique_ptr<MsgChannel> channel;
+    bool                        logged_in;
+    bool                        failed;
+};
+
+
+static int listen_loopback(unsigned short port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+static void usage(const char* argv0)
+{
+    printf("Usage: %s [-h] [-p port] [-n hosts] [-r jobs-per-minute] [-L local-share]\n"
+           "       [-f failure-rate] [-b broken-hosts] [-w slow-hosts] [-o flapping-hosts]\n"
+           "       [-F files]\n"
+           "       [-s stats-interval-msec] [-d duration-seconds] [-S seed]\n"
+           "\n"
+           "Then run: USE_SCHEDULER=127.0.0.1 icetop\n", argv0);
+}
+
+
+// The whole argument must be the number, unlike with std::sto*().
+static bool parse_number(const char* text, double& value)
+{
+    char* end;
+    errno = 0;
+    value = strtod(text, &end);
+    return end != text && !*end && !errno;
+}
+
+static bool parse_number(const char* text, int64_t& value)
+{
+    char* end;
+    errno = 0;
+    value = strtoll(text, &end, 10);
+    return end != text && !*end && !errno;
+}
+
+static bool parse_number(const char* text, unsigned int& value)
+{
+    int64_t number;
+    if (!parse_number(text, number) || number < 0 || number > UINT_MAX)
+        return false;
+    value = static_cast<unsigned int>(number);
+    return true;
+}
+
+
+int main(int argc, char **argv)
+{
+    options opt;
+    int o;
+    while ((o = getopt(argc, argv, "hp:n:r:L:f:b:w:o:F:s:d:S:")) != -1) {
+        bool valid = true;
+        unsigned int port;
+        switch (o) {
+        case 'p':
+            valid = parse_number(optarg, port) && port <= USHRT_MAX;
+            opt.port = port;
+            break;
+        case 'n':
+            valid = parse_number(optarg, opt.hosts);
+            opt.hosts = std::max(1u, opt.hosts);
+            break;
+        case 'r': valid = parse_number(optarg, opt.jobs_per_min); break;
+        case 'L': valid = parse_number(optarg, opt.local_share); break;
+        case 'f': valid = parse_number(optarg, opt.failure_rate); break;
+        case 'b': valid = parse_number(optarg, opt.broken_hosts); break;
+        case 'w': valid = parse_number(optarg, opt.slow_hosts); break;
+        case 'o': valid = parse_number(optarg, opt.flapping_hosts); break;
+        case 'F':
+            valid = parse_number(optarg, opt.files);
+            opt.files = std::max(1u, opt.files);
+            break;
+        case 's':
+            valid = parse_number(optarg, opt.stats_msec);
+            opt.stats_msec = std::max(int64_t(1), opt.stats_msec);
+            break;
+        case 'd':
+            valid = parse_number(optarg, opt.duration_msec);
+            opt.duration_msec *= 1000;
+            break;
+        case 'S': valid = parse_number(optarg, opt.seed); break;
+        default:
+            usage(argv[0]);
+            return (o == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int listen_fd = listen_loopback(opt.port);
+    std::vector<monitor_connection> monitors;
+
+    auto broadcast = [&monitors](const Msg& m) {
+        for (auto& mon: monitors) {
+            if (mon.logged_in && !mon.failed && !mon.channel->send_msg(m))
+                mon.failed = true;
+        }
+    };
+    simulation sim { opt, broadcast };
+
+    fprintf(stderr, "Listening on 127.0.0.1:%u, %u hosts, %.0f jobs/min\n",
+            opt.port, opt.hosts, opt.jobs_per_min);
+
+    auto started = now_msec();
+    auto last_report = started;
+    uint64_t last_jobs = 0, last_messages = 0;
+    double last_cpu = cpu_seconds();
+
+    while (!opt.duration_msec || now_msec() - started < opt.duration_msec) {
+        std::vector<struct pollfd> fds { { listen_fd, POLLIN, 0 } };
+        for (auto& mon: monitors)
+            fds.push_back({ mon.channel->fd, POLLIN, 0 });
+        if (poll(fds.data(), fds.size(), 10) < 0 && errno != EINTR) {
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        for (size_t i = 1; i < fds.size(); i++) {
+            if (!fds[i].revents)
+                continue;
+            auto& mon = monitors[i - 1];
+            mon.channel->read_a_bit();
+            while (!mon.failed && mon.channel->has_msg()) {
+                std::unique_ptr<Msg> m(mon.channel->get_msg(0));
+                if (!m) {
+                    mon.failed = true;
+                } else if (m->type == M_MON_LOGIN && !mon.logged_in) {
+                    mon.logged_in = true;
+                    fprintf(stderr, "Monitor logged in\n");
+                    sim.send_all_stats([&mon](const Msg& m) {
+                        if (!mon.failed && !mon.channel->send_msg(m))
+                            mon.failed = true;
+                    });
+                }
+            }
+            if (mon.channel->at_eof())
+                mon.failed = true;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            int fd = accept4(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), &len, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                monitors.push_back({ std::unique_ptr<MsgChannel>(
+                    Service::createChannel(fd, reinterpret_cast<struct sockaddr*>(&addr), len)),
+                    false, false });
+            }
+        }
+
+        auto before = monitors.size();
+        monitors.erase(std::remove_if(monitors.begin(), monitors.end(),
+                                      [](const monitor_connection& mon) {
+                                          return !mon.channel || mon.failed;
+                                      }), monitors.end());
+        if (monitors.size() != before)
+            fprintf(stderr, "Monitor disconnected\n");
+
+        sim.advance(now_msec());
+
+        auto t = now_msec();
+        if (t - last_report >= 1000) {
+            double elapsed = (t - last_report) / 1000.0;
+            int queued = 0;
+            for (auto& mon: monitors) {
+                int n = 0;
+                if (ioctl(mon.channel->fd, SIOCOUTQ, &n) == 0)
+                    queued += n;
+            }
+            auto cpu = cpu_seconds();
+            fprintf(stderr, "%6llds  monitors %zu  jobs %.0f/min  msgs %.0f/s  active %zu"
+                    "  unsent %.1fKiB  cpu %.1f%%\n",
+                    static_cast<long long>((t - started) / 1000), monitors.size(),
+                    (sim.jobs_started - last_jobs) * 60 / elapsed,
+                    (sim.messages_sent - last_messages) / elapsed,
+                    sim.active_jobs(), queued / 1024.0,
+                    (cpu - last_cpu) * 100 / elapsed);
+            last_report = t;
+            last_jobs = sim.jobs_started;
+            last_messages = sim.messages_sent;
+            last_cpu = cpu;
+        }
+    }
+
+    close(listen_fd);
+    return EXIT_SUCCESS;
+}
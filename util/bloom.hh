@@ -0,0 +1,129 @@
+/*
+ * bloom.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef BLOOM_HH
+#define BLOOM_HH
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace util {
+
+/*
+ * Set membership over a sliding time window: a ring of Bloom filters, one
+ * per time bucket. Memory is fixed to buckets * bits_per_bucket bits, no
+ * matter how many keys are added. There are no false negatives, and false
+ * positives stay rare while each bucket gets fewer keys than a tenth of
+ * its bits. Keys are 64-bit hashes; they are mixed again, so any hash will
+ * do, even the identity.
+ */
+class sliding_bloom {
+public:
+    sliding_bloom(size_t buckets, int64_t bucket_seconds, size_t bits_per_bucket, unsigned hashes = 4)
+        : m_bucket_seconds(bucket_seconds)
+        , m_hashes(hashes)
+        , m_words((bits_per_bucket + 63) / 64)
+        , m_bits(buckets * m_words, 0)
+        , m_keys(buckets, 0)
+        , m_current(0)
+        , m_current_start(0)
+    {
+        assert(buckets > 0);
+        assert(bucket_seconds > 0);
+        assert(m_words > 0);
+    }
+
+    // Whether the key was added within the window, current bucket included.
+    bool contains(int64_t now, uint64_t key) {
+        advance(now);
+        for (size_t b = 0; b < m_keys.size(); b++) {
+            if (m_keys[b] && contains_in(b, key))
+                return true;
+        }
+        return false;
+    }
+
+    void add(int64_t now, uint64_t key) {
+        advance(now);
+        auto h = mix(key);
+        auto bits = &m_bits[m_current * m_words];
+        for (unsigned i = 0; i < m_hashes; i++) {
+            auto bit = bit_index(h, i);
+            bits[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+        m_keys[m_current]++;
+    }
+
+    // Keys added to the window; repeated keys count each time.
+    uint64_t keys() const {
+        uint64_t total = 0;
+        for (auto n: m_keys)
+            total += n;
+        return total;
+    }
+
+private:
+    static uint64_t mix(uint64_t x) {
+        // splitmix64 finalizer.
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+    // Double hashing: the i-th index is h1 + i * h2.
+    size_t bit_index(uint64_t h, unsigned i) const {
+        auto h1 = static_cast<uint32_t>(h);
+        auto h2 = static_cast<uint32_t>(h >> 32) | 1;
+        return (h1 + uint64_t(i) * h2) % (m_words * 64);
+    }
+
+    bool contains_in(size_t bucket, uint64_t key) const {
+        auto h = mix(key);
+        auto bits = &m_bits[bucket * m_words];
+        for (unsigned i = 0; i < m_hashes; i++) {
+            auto bit = bit_index(h, i);
+            if (!(bits[bit / 64] & (uint64_t(1) << (bit % 64))))
+                return false;
+        }
+        return true;
+    }
+
+    void advance(int64_t now) {
+        if (m_current_start == 0) {
+            m_current_start = now - now % m_bucket_seconds;
+            return;
+        }
+        auto steps = (now - m_current_start) / m_bucket_seconds;
+        if (steps <= 0)
+            return;
+        // Clear the buckets which are being reused for the new time range.
+        for (int64_t i = 0; i < steps && i < static_cast<int64_t>(m_keys.size()); i++) {
+            m_current = (m_current + 1) % m_keys.size();
+            std::fill(m_bits.begin() + m_current * m_words,
+                      m_bits.begin() + (m_current + 1) * m_words, 0);
+            m_keys[m_current] = 0;
+        }
+        m_current_start += steps * m_bucket_seconds;
+    }
+
+    int64_t               m_bucket_seconds;
+    unsigned              m_hashes;
+    size_t                m_words;    // Per bucket.
+    std::vector<uint64_t> m_bits;
+    std::vector<uint64_t> m_keys;     // Added, per bucket.
+    size_t                m_current;
+    int64_t               m_current_start;
+};
+
+} // namespace util
+
+#endif /* !BLOOM_HH */
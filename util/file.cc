@@ -0,0 +1,44 @@
+/*
+ * file.cc
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#include "file.hh"
+
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace util {
+
+bool make_directories(const std::string& path)
+{
+    for (size_t pos = 1; pos <= path.size(); pos++) {
+        if (pos == path.size() || path[pos] == '/') {
+            auto prefix = path.substr(0, pos);
+            if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+                return false;
+        }
+    }
+    return true;
+}
+
+bool write_fully(int fd, const void* data, size_t size, off_t offset)
+{
+    auto bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        auto n = (offset < 0) ? write(fd, bytes, size) : pwrite(fd, bytes, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += n;
+        size -= n;
+        if (offset >= 0) offset += n;
+    }
+    return true;
+}
+
+} // namespace util
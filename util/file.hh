@@ -0,0 +1,22 @@
+/*
+ * file.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef FILE_HH
+#define FILE_HH
+
+#include <string>
+#include <sys/types.h>
+
+namespace util {
+    // Creates the directory and any missing parents, like "mkdir -p".
+    bool make_directories(const std::string& path);
+
+    // Retries short writes; a negative offset writes at the current one.
+    bool write_fully(int fd, const void* data, size_t size, off_t offset);
+} // namespace util
+
+#endif /* !FILE_HH */
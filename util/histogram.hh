@@ -0,0 +1,91 @@
+/*
+ * histogram.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef HISTOGRAM_HH
+#define HISTOGRAM_HH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace util {
+
+/*
+ * Histogram of non-negative values in logarithmic buckets: each power of
+ * two is split in eight linear sub-buckets, so percentiles are accurate to
+ * within 12.5% using a small, fixed amount of memory, whatever the range
+ * of the values.
+ */
+class log_histogram {
+public:
+    static constexpr unsigned sub_bits = 3;
+    static constexpr unsigned sub_buckets = 1u << sub_bits;
+    static constexpr unsigned buckets = (64 - sub_bits + 1) * sub_buckets;
+
+    log_histogram() { clear(); }
+
+    void add(uint64_t value) {
+        m_counts[index(value)]++;
+        m_count++;
+        m_sum += value;
+        m_max = std::max(m_max, value);
+    }
+
+    uint64_t count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_count ? double(m_sum) / m_count : 0; }
+
+    // Upper bound of the values below the given fraction (0 to 1) of them.
+    uint64_t percentile(double fraction) const {
+        auto target = static_cast<uint64_t>(std::ceil(fraction * m_count));
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < buckets; i++) {
+            seen += m_counts[i];
+            if (seen >= target && seen > 0)
+                return std::min(upper_bound(i), m_max);
+        }
+        return m_max;
+    }
+
+    void merge(const log_histogram& other) {
+        for (unsigned i = 0; i < buckets; i++)
+            m_counts[i] += other.m_counts[i];
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    void clear() {
+        std::fill(m_counts, m_counts + buckets, 0);
+        m_count = m_sum = m_max = 0;
+    }
+
+private:
+    static unsigned index(uint64_t value) {
+        if (value < sub_buckets)
+            return value;
+        unsigned shift = 63 - __builtin_clzll(value) - sub_bits;
+        return (shift + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+    }
+
+    static uint64_t upper_bound(unsigned i) {
+        if (i < sub_buckets)
+            return i;
+        unsigned shift = i / sub_buckets - 1;
+        uint64_t lower = uint64_t(sub_buckets | (i % sub_buckets)) << shift;
+        return lower + ((uint64_t(1) << shift) - 1);
+    }
+
+    uint64_t m_counts[buckets];
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_max;
+};
+
+} // namespace util
+
+#endif /* !HISTOGRAM_HH */
@@ -0,0 +1,115 @@
+/*
+ * intern.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef INTERN_HH
+#define INTERN_HH
+
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace util {
+
+/*
+ * Maps strings to small, dense integer identifiers and back. Each distinct
+ * string is stored once, and zero is never used so it can mean "no
+ * string". Identifiers are stable until their string is swept away, after
+ * which intern() hands them out again: tables of strings which keep coming
+ * (file names) stay as large as the strings still referred to.
+ */
+class string_table {
+public:
+    using id_type = uint32_t;
+
+    string_table() {
+        m_strings.push_back(nullptr);
+    }
+
+    string_table(const string_table&) = delete;
+    string_table& operator=(const string_table&) = delete;
+
+    id_type intern(const std::string& s) {
+        auto item = m_ids.find(s);
+        if (item != m_ids.end())
+            return item->second;
+        id_type id;
+        if (m_free.empty()) {
+            id = static_cast<id_type>(m_strings.size());
+            m_strings.push_back(nullptr);
+        } else {
+            id = m_free.back();
+            m_free.pop_back();
+        }
+        item = m_ids.emplace(s, id).first;
+        // Keys of node-based maps do not move, so pointing to them is safe.
+        m_strings[id] = &item->first;
+        return id;
+    }
+
+    // Returns zero if the string has not been interned.
+    id_type find(const std::string& s) const {
+        auto item = m_ids.find(s);
+        return (item == m_ids.end()) ? 0 : item->second;
+    }
+
+    const std::string& lookup(id_type id) const {
+        static const std::string empty;
+        if (id == 0 || id >= m_strings.size() || !m_strings[id])
+            return empty;
+        return *m_strings[id];
+    }
+
+    // Largest identifier handed out, plus one.
+    size_t size() const { return m_strings.size(); }
+
+    // Strings stored right now.
+    size_t count() const { return m_ids.size(); }
+
+    // Identifiers which are still referred to, to be marked by whoever
+    // holds them before calling sweep().
+    class in_use {
+    public:
+        explicit in_use(size_t size): m_marked(size, false) { }
+
+        void mark(id_type id) {
+            if (id < m_marked.size())
+                m_marked[id] = true;
+        }
+
+        bool marked(id_type id) const { return id < m_marked.size() && m_marked[id]; }
+
+    private:
+        std::vector<bool> m_marked;
+    };
+
+    in_use begin_sweep() const { return in_use(m_strings.size()); }
+
+    // Forgets the strings which were not marked, and returns how many.
+    size_t sweep(const in_use& marks) {
+        size_t swept = 0;
+        for (id_type id = 1; id < m_strings.size(); id++) {
+            if (!m_strings[id] || marks.marked(id))
+                continue;
+            m_ids.erase(m_ids.find(*m_strings[id]));
+            m_strings[id] = nullptr;
+            m_free.push_back(id);
+            swept++;
+        }
+        return swept;
+    }
+
+private:
+    std::unordered_map<std::string, id_type> m_ids;
+    std::vector<const std::string*>          m_strings;  // Null once swept.
+    std::vector<id_type>                     m_free;     // Swept, to reuse.
+};
+
+} // namespace util
+
+#endif /* !INTERN_HH */
@@ -0,0 +1,83 @@
+/*
+ * ring.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef RING_HH
+#define RING_HH
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+namespace util {
+
+/*
+ * Fixed-capacity circular buffer. Once full, pushing a new element
+ * overwrites the oldest one. Elements are indexed from the oldest (0)
+ * to the newest (size() - 1).
+ */
+template <typename T>
+class ring {
+public:
+    explicit ring(size_t capacity)
+        : m_items(capacity), m_head(0), m_size(0)
+    {
+        assert(capacity > 0);
+    }
+
+    size_t capacity() const { return m_items.size(); }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    bool full() const { return m_size == m_items.size(); }
+
+    void clear() { m_head = m_size = 0; }
+
+    T& push_back(T&& item) {
+        auto& slot = m_items[(m_head + m_size) % m_items.size()];
+        slot = std::move(item);
+        if (full()) {
+            m_head = (m_head + 1) % m_items.size();
+        } else {
+            m_size++;
+        }
+        return slot;
+    }
+
+    T& push_back(const T& item) {
+        T copy(item);
+        return push_back(std::move(copy));
+    }
+
+    T& operator[](size_t index) {
+        assert(index < m_size);
+        return m_items[(m_head + index) % m_items.size()];
+    }
+
+    const T& operator[](size_t index) const {
+        assert(index < m_size);
+        return m_items[(m_head + index) % m_items.size()];
+    }
+
+    T& front() { return (*this)[0]; }
+    T& back() { return (*this)[m_size - 1]; }
+    const T& front() const { return (*this)[0]; }
+    const T& back() const { return (*this)[m_size - 1]; }
+
+    void pop_front() {
+        assert(m_size > 0);
+        m_head = (m_head + 1) % m_items.size();
+        m_size--;
+    }
+
+private:
+    std::vector<T> m_items;
+    size_t         m_head;
+    size_t         m_size;
+};
+
+} // namespace util
+
+#endif /* !RING_HH */
@@ -0,0 +1,223 @@
+/*
+ * space_saving.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef SPACE_SAVING_HH
+#define SPACE_SAVING_HH
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace util {
+
+/*
+ * Space-Saving heavy hitters sketch (Metwally et al.) with weighted
+ * updates. Keeps at most "capacity" counters; when a new key arrives and
+ * the sketch is full, the counter with the smallest count is reused for it.
+ * Counts may be overestimated by at most the recorded error.
+ */
+template <typename K, typename Hash = std::hash<K>>
+class space_saving {
+public:
+    struct counter {
+        K        key;
+        uint64_t count;
+        uint64_t error;
+    };
+
+    explicit space_saving(size_t capacity)
+        : m_capacity(capacity)
+    {
+        assert(capacity > 0);
+        m_counters.reserve(capacity);
+        m_heap.reserve(capacity);
+        m_position.reserve(capacity);
+    }
+
+    size_t capacity() const { return m_capacity; }
+    size_t size() const { return m_counters.size(); }
+
+    void clear() {
+        m_counters.clear();
+        m_heap.clear();
+        m_position.clear();
+        m_index.clear();
+    }
+
+    void add(const K& key, uint64_t weight = 1) {
+        auto item = m_index.find(key);
+        if (item != m_index.end()) {
+            m_counters[item->second].count += weight;
+            sift_down(m_position[item->second]);
+        } else if (m_counters.size() < m_capacity) {
+            auto slot = m_counters.size();
+            m_counters.push_back({ key, weight, 0 });
+            m_index.emplace(key, slot);
+            m_position.push_back(m_heap.size());
+            m_heap.push_back(slot);
+            sift_up(m_heap.size() - 1);
+        } else {
+            auto slot = m_heap[0];
+            auto& c = m_counters[slot];
+            m_index.erase(c.key);
+            m_index.emplace(key, slot);
+            c.key = key;
+            c.error = c.count;
+            c.count += weight;
+            sift_down(0);
+        }
+    }
+
+    const std::vector<counter>& counters() const { return m_counters; }
+
+    // The k counters with the highest counts, in descending order.
+    std::vector<counter> top(size_t k) const {
+        std::vector<counter> result(m_counters);
+        sort_descending(result, k);
+        return result;
+    }
+
+    static void sort_descending(std::vector<counter>& items, size_t k) {
+        k = std::min(k, items.size());
+        std::partial_sort(items.begin(), items.begin() + k, items.end(),
+                          [](const counter& a, const counter& b) {
+                              return a.count > b.count;
+                          });
+        items.resize(k);
+    }
+
+private:
+    // Min-heap of counter slots, ordered by count.
+    bool less(size_t a, size_t b) const {
+        return m_counters[m_heap[a]].count < m_counters[m_heap[b]].count;
+    }
+
+    void swap_nodes(size_t a, size_t b) {
+        std::swap(m_heap[a], m_heap[b]);
+        m_position[m_heap[a]] = a;
+        m_position[m_heap[b]] = b;
+    }
+
+    void sift_up(size_t i) {
+        while (i > 0) {
+            auto parent = (i - 1) / 2;
+            if (!less(i, parent))
+                break;
+            swap_nodes(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(size_t i) {
+        for (;;) {
+            auto smallest = i;
+            auto left = 2 * i + 1, right = left + 1;
+            if (left < m_heap.size() && less(left, smallest)) smallest = left;
+            if (right < m_heap.size() && less(right, smallest)) smallest = right;
+            if (smallest == i)
+                break;
+            swap_nodes(i, smallest);
+            i = smallest;
+        }
+    }
+
+    size_t                         m_capacity;
+    std::vector<counter>           m_counters;
+    std::vector<size_t>            m_heap;
+    std::vector<size_t>            m_position;  // Slot -> heap position.
+    std::unordered_map<K, size_t, Hash> m_index;  // Key -> slot.
+};
+
+
+/*
+ * Heavy hitters over sliding time windows: a ring of Space-Saving sketches,
+ * one per time bucket. Memory is fixed to buckets * capacity counters
+ * regardless of how many distinct keys are seen.
+ */
+template <typename K, typename Hash = std::hash<K>>
+class sliding_space_saving {
+public:
+    using counter = typename space_saving<K, Hash>::counter;
+
+    sliding_space_saving(size_t buckets, int64_t bucket_seconds, size_t capacity)
+        : m_bucket_seconds(bucket_seconds)
+        , m_current(0)
+        , m_current_start(0)
+    {
+        assert(buckets > 0);
+        assert(bucket_seconds > 0);
+        m_buckets.reserve(buckets);
+        for (size_t i = 0; i < buckets; i++)
+            m_buckets.emplace_back(capacity);
+    }
+
+    int64_t bucket_seconds() const { return m_bucket_seconds; }
+
+    // Calls f(key) for the key of every counter, in any bucket.
+    template <typename F>
+    void for_each_key(F f) const {
+        for (auto& bucket: m_buckets) {
+            for (auto& c: bucket.counters())
+                f(c.key);
+        }
+    }
+
+    void add(int64_t now, const K& key, uint64_t weight = 1) {
+        advance(now);
+        m_buckets[m_current].add(key, weight);
+    }
+
+    // Merges the most recent "buckets" buckets (the current, partial one
+    // included) and returns the k keys with the highest counts.
+    std::vector<counter> top(int64_t now, size_t buckets, size_t k) {
+        advance(now);
+        buckets = std::min(buckets, m_buckets.size());
+        std::unordered_map<K, counter, Hash> merged;
+        for (size_t i = 0; i < buckets; i++) {
+            auto& bucket = m_buckets[(m_current + m_buckets.size() - i) % m_buckets.size()];
+            for (auto& c: bucket.counters()) {
+                auto item = merged.emplace(c.key, counter { c.key, 0, 0 }).first;
+                item->second.count += c.count;
+                item->second.error += c.error;
+            }
+        }
+        std::vector<counter> result;
+        result.reserve(merged.size());
+        for (auto& item: merged)
+            result.push_back(item.second);
+        space_saving<K, Hash>::sort_descending(result, k);
+        return result;
+    }
+
+private:
+    void advance(int64_t now) {
+        if (m_current_start == 0) {
+            m_current_start = now - now % m_bucket_seconds;
+            return;
+        }
+        auto steps = (now - m_current_start) / m_bucket_seconds;
+        if (steps <= 0)
+            return;
+        // Clear the buckets which are being reused for the new time range.
+        for (int64_t i = 0; i < steps && i < static_cast<int64_t>(m_buckets.size()); i++) {
+            m_current = (m_current + 1) % m_buckets.size();
+            m_buckets[m_current].clear();
+        }
+        m_current_start += steps * m_bucket_seconds;
+    }
+
+    int64_t                            m_bucket_seconds;
+    size_t                             m_current;
+    int64_t                            m_current_start;
+    std::vector<space_saving<K, Hash>> m_buckets;
+};
+
+} // namespace util
+
+#endif /* !SPACE_SAVING_HH */
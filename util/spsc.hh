@@ -0,0 +1,97 @@
+/*
+ * spsc.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef SPSC_HH
+#define SPSC_HH
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace util {
+
+/*
+ * Bounded, lock-free queue for exactly one producer thread and one consumer
+ * thread. Each side keeps a cached copy of the other side's index, so the
+ * shared cache lines are only touched when the queue looks full (producer)
+ * or empty (consumer).
+ */
+template <typename T>
+class spsc_ring {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "spsc_ring elements must be trivially copyable");
+
+public:
+    explicit spsc_ring(size_t capacity)
+        : m_items(round_up(capacity))
+        , m_mask(m_items.size() - 1)
+        , m_head(0), m_tail_cache(0)
+        , m_tail(0), m_head_cache(0)
+    {
+    }
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    size_t capacity() const { return m_items.size(); }
+
+    // Approximate when called while the other side is running.
+    size_t size() const {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+    // Producer side. Returns false if the queue is full.
+    bool push(const T& item) {
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache == m_items.size()) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache == m_items.size())
+                return false;
+        }
+        m_items[tail & m_mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool pop(T& item) {
+        auto head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail_cache) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tail_cache)
+                return false;
+        }
+        item = m_items[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static size_t round_up(size_t n) {
+        assert(n > 0);
+        size_t result = 1;
+        while (result < n) result <<= 1;
+        return result;
+    }
+
+    std::vector<T> m_items;
+    const size_t   m_mask;
+
+    // Written by the consumer.
+    alignas(64) std::atomic<size_t> m_head;
+    size_t                          m_tail_cache;
+
+    // Written by the producer.
+    alignas(64) std::atomic<size_t> m_tail;
+    size_t                          m_head_cache;
+};
+
+} // namespace util
+
+#endif /* !SPSC_HH */
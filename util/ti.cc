@@ -11,7 +11,10 @@ extern "C" {
 #include <tickit.h>
 }
 
+#include <cerrno>
+#include <chrono>
 #include <limits>
+#include <unistd.h>
 
 namespace ti {
 
@@ -79,6 +82,7 @@ template <typename T> struct event_info_map {
 
 TI_EVENT_INFO(window, expose_event,          TICKIT_WINDOW_ON_EXPOSE,     TickitExposeEventInfo);
 TI_EVENT_INFO(window, geometry_change_event, TICKIT_WINDOW_ON_GEOMCHANGE, TickitGeomchangeEventInfo);
+TI_EVENT_INFO(window, key_event,             TICKIT_WINDOW_ON_KEY,        TickitKeyEventInfo);
 
 
 struct debug_init {
@@ -141,10 +145,33 @@ rect from_tickit(const TickitRect& r)
 }
 
 
+static counters s_counters = { 0, 0, 0 };
+
+const counters& get_counters() { return s_counters; }
+
+// Does what Tickit would do without an output function, while counting.
+static void write_output(TickitTerm* tt, const char* bytes, size_t len, void*)
+{
+    if (!bytes)
+        return;  // The terminal is being destroyed.
+    int fd = tickit_term_get_output_fd(tt);
+    while (len > 0) {
+        auto n = ::write(fd, bytes, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        s_counters.bytes_written += n;
+        bytes += n;
+        len -= n;
+    }
+}
+
 terminal::terminal()
     : terminal(tickit_term_open_stdio(), terminal_free)
 {
     trace_pointer("terminal", "TickitTerm", unwrap(), "   +");
+    tickit_term_set_output_func(unwrap(), write_output, nullptr);
 }
 
 terminal& terminal::flush() { tickit_term_flush(unwrap()); return *this; }
@@ -411,12 +438,41 @@ window& window::expose()
     return *this;
 }
 
+window& window::expose(const rect& r)
+{
+    tickit_window_expose(unwrap(), to_tickit<const TickitRect*, const rect&>(r));
+    return *this;
+}
+
 window& window::flush()
 {
     tickit_window_flush(unwrap());
     return *this;
 }
 
+window& window::raise()
+{
+    tickit_window_raise_to_front(unwrap());
+    return *this;
+}
+
+window& window::show()
+{
+    tickit_window_show(unwrap());
+    return *this;
+}
+
+window& window::hide()
+{
+    tickit_window_hide(unwrap());
+    return *this;
+}
+
+bool window::visible() const
+{
+    return tickit_window_is_visible(const_cast<TickitWindow*>(unwrap()));
+}
+
 window& window::set_position(uint line, uint col)
 {
     tickit_window_reposition(unwrap(), u2i(line), u2i(col));
@@ -516,11 +572,16 @@ struct event_handler {
     }
 
     inline bool run(TickitWindow*, TickitExposeEventInfo* info) {
+        using namespace std::chrono;
+        auto started = steady_clock::now();
         render_buffer rb { info->rb, render_buffer::no_delete };
         window::expose_event event {
             rb, from_tickit<rect&>(&info->rect)
         };
-        return handle(event);
+        bool result = handle(event);
+        s_counters.expose_events++;
+        s_counters.expose_usec += duration_cast<microseconds>(steady_clock::now() - started).count();
+        return result;
     }
 
     inline bool run(TickitWindow*, TickitGeomchangeEventInfo *info) {
@@ -531,6 +592,19 @@ struct event_handler {
         return handle(event);
     }
 
+    inline bool run(TickitWindow*, TickitKeyEventInfo *info) {
+        int modifiers = window::key_event::no_modifier;
+        if (info->mod & TICKIT_MOD_SHIFT) modifiers |= window::key_event::shift;
+        if (info->mod & TICKIT_MOD_ALT)   modifiers |= window::key_event::alt;
+        if (info->mod & TICKIT_MOD_CTRL)  modifiers |= window::key_event::ctrl;
+        window::key_event event {
+            (info->type == TICKIT_KEYEV_TEXT) ? window::key_event::text : window::key_event::key,
+            modifiers,
+            info->str
+        };
+        return handle(event);
+    }
+
     static int callback(tickit_emitter_type* e, TickitEventFlags flags, void* info, void* user) {
         auto handler = reinterpret_cast<event_handler<event_type>*>(user);
         if (flags & TICKIT_EV_UNBIND) {
@@ -563,4 +637,9 @@ window::event_binding window::on_geometry_change(window::geometry_change_event::
     return bind_event<window::geometry_change_event>(*this, f);
 }
 
+window::event_binding window::on_key(window::key_event::functor_type f)
+{
+    return bind_event<window::key_event>(*this, f);
+}
+
 } // namespace ti
@@ -11,6 +11,7 @@
 #include <string>
 #include <memory>
 #include <cassert>
+#include <cstdint>
 #include <functional>
 #include <experimental/optional>
 using std::experimental::optional;
@@ -154,6 +155,39 @@ TI_EVENT_BASE(geometry_change_event_base)
 };
 
 
+TI_EVENT_BASE(key_event_base)
+{
+    enum type { key, text };
+    enum modifier {
+        no_modifier = 0,
+        shift       = 1 << 0,
+        alt         = 1 << 1,
+        ctrl        = 1 << 2,
+    };
+
+    enum type type;
+    int modifiers;
+    // Key name (e.g. "Enter", "C-c") or the typed text, depending on type.
+    const std::string name;
+
+    key_event_base(enum type t, int m, const char* n)
+        : type(t), modifiers(m), name(n) { }
+
+    bool is_text() const { return type == text; }
+    bool is_key(const char* n) const { return type == key && name == n; }
+};
+
+
+// Totals for all terminals and windows, for profiling.
+struct counters {
+    uint64_t bytes_written;  // Sent to terminals.
+    uint64_t expose_events;  // Expose handlers run.
+    uint64_t expose_usec;    // Time spent in expose handlers.
+};
+
+const counters& get_counters();
+
+
 class terminal {
     TI_UNCOPYABLE(terminal);
     TI_MOVABLE(terminal);
@@ -305,6 +339,7 @@ public:
     using event_binding = event_binding_base<window>;
     using expose_event = expose_event_base<window>;
     using geometry_change_event = geometry_change_event_base<window>;
+    using key_event = key_event_base<window>;
 
     enum flags {
         no_flags    = 0,
@@ -323,7 +358,12 @@ public:
     optional<window> parent() const;
 
     window& expose();
+    window& expose(const rect& r);
     window& flush();
+    window& raise();
+    window& show();
+    window& hide();
+    bool visible() const;
 
     uint top() const;
     uint left() const;
@@ -342,6 +382,7 @@ public:
 
     event_binding on_expose(expose_event::functor_type f);
     event_binding on_geometry_change(geometry_change_event::functor_type f);
+    event_binding on_key(key_event::functor_type f);
 
 private:
     TI_WRAP(window, TickitWindow);
@@ -0,0 +1,122 @@
+/*
+ * top_k.hh
+ * Copyright (C) 2016 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the GPLv2 license.
+ */
+
+#ifndef TOP_K_HH
+#define TOP_K_HH
+
+#include <algorithm>
+#include <cassert>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace util {
+
+/*
+ * Keeps the k keys with the highest scores seen, using a min-heap indexed
+ * by key so the score of a key already in it can be updated in place.
+ * Keys whose score drops are not replaced by keys outside the heap, as
+ * those are not remembered.
+ */
+template <typename K, typename S, typename Hash = std::hash<K>>
+class top_k {
+public:
+    using item = std::pair<K, S>;
+
+    explicit top_k(size_t k): m_k(k) {
+        assert(k > 0);
+        m_heap.reserve(k);
+    }
+
+    size_t size() const { return m_heap.size(); }
+    bool contains(const K& key) const { return m_position.count(key) != 0; }
+
+    void update(const K& key, const S& score) {
+        auto pos = m_position.find(key);
+        if (pos != m_position.end()) {
+            auto i = pos->second;
+            auto old = m_heap[i].second;
+            m_heap[i].second = score;
+            if (score < old) sift_up(i); else sift_down(i);
+        } else if (m_heap.size() < m_k) {
+            m_heap.emplace_back(key, score);
+            m_position[key] = m_heap.size() - 1;
+            sift_up(m_heap.size() - 1);
+        } else if (m_heap[0].second < score) {
+            m_position.erase(m_heap[0].first);
+            m_heap[0] = item(key, score);
+            m_position[key] = 0;
+            sift_down(0);
+        }
+    }
+
+    void erase(const K& key) {
+        auto pos = m_position.find(key);
+        if (pos == m_position.end())
+            return;
+        auto i = pos->second;
+        m_position.erase(pos);
+        if (i + 1 != m_heap.size()) {
+            m_heap[i] = m_heap.back();
+            m_position[m_heap[i].first] = i;
+            m_heap.pop_back();
+            sift_up(i);
+            sift_down(i);
+        } else {
+            m_heap.pop_back();
+        }
+    }
+
+    // Items sorted by descending score.
+    std::vector<item> sorted() const {
+        std::vector<item> result(m_heap);
+        std::sort(result.begin(), result.end(), [](const item& a, const item& b) {
+            return b.second < a.second;
+        });
+        return result;
+    }
+
+private:
+    void swap_nodes(size_t a, size_t b) {
+        std::swap(m_heap[a], m_heap[b]);
+        m_position[m_heap[a].first] = a;
+        m_position[m_heap[b].first] = b;
+    }
+
+    void sift_up(size_t i) {
+        while (i > 0) {
+            auto parent = (i - 1) / 2;
+            if (!(m_heap[i].second < m_heap[parent].second))
+                break;
+            swap_nodes(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(size_t i) {
+        for (;;) {
+            auto smallest = i;
+            auto left = 2 * i + 1, right = left + 1;
+            if (left < m_heap.size() && m_heap[left].second < m_heap[smallest].second)
+                smallest = left;
+            if (right < m_heap.size() && m_heap[right].second < m_heap[smallest].second)
+                smallest = right;
+            if (smallest == i)
+                break;
+            swap_nodes(i, smallest);
+            i = smallest;
+        }
+    }
+
+    size_t                         m_k;
+    std::vector<item>              m_heap;
+    std::unordered_map<K, size_t, Hash> m_position;
+};
+
+} // namespace util
+
+#endif /* !TOP_K_HH */